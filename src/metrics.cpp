@@ -0,0 +1,70 @@
+#include <process/defer.hpp>
+
+#include <process/metrics/metrics.hpp>
+
+#include "config.h"
+#include "metrics.hpp"
+#include "offer_filter_module.hpp"
+
+namespace gettyimages {
+namespace mesos {
+namespace modules {
+
+Metrics::Metrics(const OfferFilteringHierarchicalDRFAllocatorProcess& allocator)
+  : filtered_agents(
+        "allocator/offer_filters/filtered_agents",
+        process::defer(
+            allocator.self(),
+            &OfferFilteringHierarchicalDRFAllocatorProcess::_filtered_agents)),
+    persist_queue_depth(
+        "allocator/offer_filters/persist_queue_depth",
+        process::defer(
+            allocator.self(),
+            &OfferFilteringHierarchicalDRFAllocatorProcess::_persist_queue_depth)),
+    persist_latency("allocator/offer_filters/persist_latency"),
+    persist_failures("allocator/offer_filters/persist_failures"),
+    restore_duration("allocator/offer_filters/restore_duration"),
+    leader_lookup_latency("allocator/offer_filters/leader_lookup_latency"),
+    request_latency("allocator/offer_filters/request_latency"),
+    requests_get("allocator/offer_filters/requests/get"),
+    mutations_post("allocator/offer_filters/mutations/post"),
+    mutations_put("allocator/offer_filters/mutations/put"),
+    mutations_patch("allocator/offer_filters/mutations/patch"),
+    mutations_delete("allocator/offer_filters/mutations/delete"),
+    apply_transitions("allocator/offer_filters/apply_transitions")
+{
+    process::metrics::add(filtered_agents);
+    process::metrics::add(persist_queue_depth);
+    process::metrics::add(persist_latency);
+    process::metrics::add(persist_failures);
+    process::metrics::add(restore_duration);
+    process::metrics::add(leader_lookup_latency);
+    process::metrics::add(request_latency);
+    process::metrics::add(requests_get);
+    process::metrics::add(mutations_post);
+    process::metrics::add(mutations_put);
+    process::metrics::add(mutations_patch);
+    process::metrics::add(mutations_delete);
+    process::metrics::add(apply_transitions);
+}
+
+Metrics::~Metrics()
+{
+    process::metrics::remove(filtered_agents);
+    process::metrics::remove(persist_queue_depth);
+    process::metrics::remove(persist_latency);
+    process::metrics::remove(persist_failures);
+    process::metrics::remove(restore_duration);
+    process::metrics::remove(leader_lookup_latency);
+    process::metrics::remove(request_latency);
+    process::metrics::remove(requests_get);
+    process::metrics::remove(mutations_post);
+    process::metrics::remove(mutations_put);
+    process::metrics::remove(mutations_patch);
+    process::metrics::remove(mutations_delete);
+    process::metrics::remove(apply_transitions);
+}
+
+} // namespace modules
+} // namespace mesos
+} // namespace gettyimages
@@ -0,0 +1,61 @@
+#ifndef __OFFER_FILTER_METRICS_HPP__
+#define __OFFER_FILTER_METRICS_HPP__
+
+#include <process/metrics/counter.hpp>
+#include <process/metrics/gauge.hpp>
+#include <process/metrics/timer.hpp>
+
+#include <stout/duration.hpp>
+
+namespace gettyimages {
+namespace mesos {
+namespace modules {
+
+class OfferFilteringHierarchicalDRFAllocatorProcess;
+
+// Metrics of the offer filtering module, exposed in /metrics/snapshot
+// under the 'allocator/offer_filters/' prefix.
+struct Metrics
+{
+  explicit Metrics(const OfferFilteringHierarchicalDRFAllocatorProcess& allocator);
+
+  ~Metrics();
+
+  // Number of agents withheld from every framework by filters.
+  process::metrics::Gauge filtered_agents;
+
+  // Number of requests waiting on the next commit of the filter set.
+  process::metrics::Gauge persist_queue_depth;
+
+  // Time taken to commit the filter set to storage.
+  process::metrics::Timer<Milliseconds> persist_latency;
+
+  // Number of commits of the filter set which failed (and were retried).
+  process::metrics::Counter persist_failures;
+
+  // Time taken from recovery until the persisted filters were restored.
+  process::metrics::Timer<Milliseconds> restore_duration;
+
+  // Time taken to look up the leading master for a request.
+  process::metrics::Timer<Milliseconds> leader_lookup_latency;
+
+  // Time spent inside the allocator actor handling a request to
+  // /allocator/filters or /allocator/drains (excluding persistence).
+  process::metrics::Timer<Milliseconds> request_latency;
+
+  // Number of requests to /allocator/filters, by method.
+  process::metrics::Counter requests_get;
+  process::metrics::Counter mutations_post;
+  process::metrics::Counter mutations_put;
+  process::metrics::Counter mutations_patch;
+  process::metrics::Counter mutations_delete;
+
+  // Number of agents (de)activated by filter changes.
+  process::metrics::Counter apply_transitions;
+};
+
+} // namespace modules
+} // namespace mesos
+} // namespace gettyimages
+
+#endif // __OFFER_FILTER_METRICS_HPP__
@@ -1,3 +1,9 @@
+#include <fnmatch.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <string>
 #include <utility>
@@ -5,14 +11,23 @@
 #include <mesos/mesos.hpp>
 #include <mesos/module.hpp>
 
+#include <stout/foreach.hpp>
+#include <stout/gzip.hpp>
 #include <stout/json.hpp>
+#include <stout/numify.hpp>
 #include <stout/os.hpp>
+#include <stout/path.hpp>
 #include <stout/protobuf.hpp>
 #include <stout/strings.hpp>
 #include <stout/hashmap.hpp>
 #include <stout/option.hpp>
 #include <stout/error.hpp>
 #include <stout/try.hpp>
+#include <process/dispatch.hpp>
+#include <process/collect.hpp>
+#include <process/defer.hpp>
+#include <process/delay.hpp>
+#include <process/clock.hpp>
 #include <process/once.hpp>
 #include <master/master.hpp>
 #include <stout/lambda.hpp>
@@ -20,6 +35,7 @@
 
 #include "config.h"
 #include "offer_filter_module.hpp"
+#include "offer_filter.pb.h"
 
 using std::map;
 using std::string;
@@ -34,19 +50,23 @@ using namespace mesos::modules;
 
 #ifdef MESOS__0_28_2
 
+using mesos::internal::state::InMemoryStorage;
+using mesos::internal::state::LevelDBStorage;
 using mesos::internal::state::ZooKeeperStorage;
-using mesos::internal::state::Variable;
 using mesos::master::allocator::Allocator;
 
 #else
 
+using mesos::state::InMemoryStorage;
+using mesos::state::LevelDBStorage;
 using mesos::state::ZooKeeperStorage;
-using mesos::state::Variable;
 using mesos::allocator::Allocator;
 
 #endif
 
+using process::Clock;
 using process::Future;
+using process::Time;
 using mesos::internal::master::allocator::HierarchicalDRFAllocatorProcess;
 
 
@@ -73,424 +93,5441 @@ process::Future<R> dispatch(const process::PID<T>& pid, R (T::*method)()const)
     return promise->future();
 }
 
+namespace mesos {
+namespace internal {
+namespace master {
+namespace allocator {
+namespace internal {
+
+// Declared by hierarchical.hpp, and defined (as here) in hierarchical.cpp: the
+// offer filters the allocation pass consults for each (framework, agent) pair.
+class OfferFilter
+{
+public:
+  virtual ~OfferFilter() {}
+
+  virtual bool filter(const Resources& resources) = 0;
+};
+
+} // namespace internal {
+} // namespace allocator {
+} // namespace master {
+} // namespace internal {
+} // namespace mesos {
+
 namespace gettyimages {
 namespace mesos {
 namespace modules {
 
 const string FILTERED_AGENTS = "filtered-agents";
+const string FILTERS_MANIFEST = "filters-manifest";
+const string FILTER_AGENT_PREFIX = "filter-agent-";
+const string FILTER_HOSTNAME_PREFIX = "filter-hostname-";
+const string FILTERS_FORMAT_VERSION = "3";
 const string CURRENT_MASTER = ":";
 const string DEFAULT_ZK_URL = "zk://127.0.0.1:2181/mesos-allocator-filters";
+const string ZOOKEEPER_STORAGE = "zookeeper";
+const string LEVELDB_STORAGE = "leveldb";
+const string IN_MEMORY_STORAGE = "in_memory";
+const string DEFAULT_STORAGE_PATH = "/var/lib/mesos/offer-filters";
+const Duration ZK_STORAGE_SESSION_TIMEOUT = Seconds(10);
+const string MASTER_ZK_ENV = "MESOS_ZK";
+const string MASTER_INFO_LABEL = "info";
+const string MASTER_INFO_JSON_LABEL = "json.info";
+const Duration MASTER_ZK_SESSION_TIMEOUT = Seconds(10);
+const Duration MASTER_DETECTION_RETRY_INTERVAL = Seconds(1);
+const Duration PERSIST_COMMIT_WINDOW = Milliseconds(10);
+const Duration PERSIST_RETRY_INTERVAL = Seconds(1);
+const Duration RESTORE_RETRY_INTERVAL = Seconds(1);
+const Duration STANDBY_POLL_INTERVAL = Seconds(5);
+const size_t MANIFEST_CHANGE_LOG_SIZE = 1000;
+const Duration PERSIST_TIMEOUT = Seconds(30);
+const string FILTER_ADDED = "ADDED";
+const string FILTER_REMOVED = "REMOVED";
+const string FILTER_UPDATED = "UPDATED";
+const size_t WATCH_EVENT_BUFFER_SIZE = 4096;
+const Duration WATCH_DEFAULT_TIMEOUT = Seconds(30);
+const Duration WATCH_MAX_TIMEOUT = Minutes(5);
+const string FILTER_SELECTOR_PREFIX = "filter-selector-";
+const string ATTRIBUTE_SELECTOR = "attribute";
+const string DOMAIN_SELECTOR = "domain";
+const string HOSTNAME_PATTERN_SELECTOR = "hostnamePattern";
+const string HOSTNAME_REGEX_SELECTOR = "hostnameRegex";
+const vector<string> SELECTOR_TYPES = {
+    ATTRIBUTE_SELECTOR, DOMAIN_SELECTOR, HOSTNAME_PATTERN_SELECTOR, HOSTNAME_REGEX_SELECTOR};
+const string ROLES_SCOPE = "roles";
+const string FRAMEWORKS_SCOPE = "frameworks";
+const string ROLE_EXCLUSION_PREFIX = "role:";
+const string FRAMEWORK_EXCLUSION_PREFIX = "framework:";
+const string RESOURCES_FILTER = "resources";
+const string RESOURCE_NAMES_FILTER = "resourceNames";
+const string FILTER_RESOURCES_PREFIX = "filter-resources-";
+const string DRAIN_PREFIX = "drain-";
+const string DRAIN_RUNNING = "RUNNING";
+const string DRAIN_COMPLETED = "COMPLETED";
+const string DRAIN_CANCELLED = "CANCELLED";
+const Duration DRAIN_DEFAULT_INTERVAL = Minutes(1);
+const Duration GUARD_RAIL_RETRY_INTERVAL = Minutes(1);
+const vector<string> CAPACITY_RESOURCES = {"cpus", "mem", "gpus"};
+const string UNRESERVED_ROLE = "*";
+const double CAPACITY_EPSILON = 1e-6;
+const string SNAPSHOT_FILE = "offer_filters.snapshot";
+const size_t ENTRY_COMPRESSION_THRESHOLD = 4096;
+const string MASTER_WORK_DIR_ENV = "MESOS_WORK_DIR";
+
 
+const string AGENT_FILTER_KEY_PREFIX = "agentId:";
+const string HOSTNAME_FILTER_KEY_PREFIX = "hostname:";
 
-Try<Nothing> OfferFilteringHierarchicalDRFAllocatorProcess::configure(const zookeeper::URL* zk_url)
+
+// Parses an RFC 3339 UTC time, e.g., "2016-11-05T14:00:00Z"
+Try<Time> parseTime(const string& value)
 {
-    if (state == nullptr) {
-        state = new State(new ZooKeeperStorage(zk_url->servers, Seconds(10), zk_url->path));
-        LOG(INFO) << "Created ZooKeeperStorage using zk_url " << zk_url->servers << zk_url->path;
-        return Try<Nothing>(Nothing());
-    } else {
-        LOG(INFO) << "Ignored duplicate configuration attempt";
+    struct tm tm = {};
+    const char* end = strptime(value.c_str(), "%Y-%m-%dT%H:%M:%S", &tm);
+    if (end == nullptr || string(end) != "Z") {
+        return Error("Expected an RFC 3339 UTC time (e.g., 2016-11-05T14:00:00Z), got '" + value + "'");
     }
+    return Time::create(static_cast<double>(timegm(&tm)));
 }
 
-Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::getOfferFilters(
-    const http::Request &request)
+string formatTime(const Time& time)
 {
-    return http::OK(getFilteredAgentsJSON());
+    time_t seconds = static_cast<time_t>(time.secs());
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    char formatted[32];
+    strftime(formatted, sizeof(formatted), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    return formatted;
 }
 
-JSON::Object OfferFilteringHierarchicalDRFAllocatorProcess::getFilteredAgentsJSON() {
+// Filters are keyed by what they name: an agent id, a hostname (for filters
+// which name no agent id) or a selector
+string agentFilterKey(const string& agentId)
+{
+    return AGENT_FILTER_KEY_PREFIX + agentId;
+}
 
-    JSON::Array filters;
+string hostnameFilterKey(const string& hostname)
+{
+    return HOSTNAME_FILTER_KEY_PREFIX + hostname;
+}
 
-    foreachpair (const SlaveID& agentId, const Slave& agent, this->slaves) {
-        if (!agent.activated) {
-            JSON::Object filter;
-            filter.values["hostname"] = agent.hostname;
-            filter.values["agentId"] = stringify(agentId);
-            filters.values.push_back(filter);
-        }
+JSON::Object filterJSON(const string& agentId, const string& hostname)
+{
+    JSON::Object filter;
+    if (!agentId.empty()) {
+        filter.values["agentId"] = agentId;
     }
+    if (!hostname.empty()) {
+        filter.values["hostname"] = hostname;
+    }
+    return filter;
+}
 
-    JSON::Object body;
-    body.values["filters"] = std::move(filters);
-    return body;
+JSON::Object eventJSON(const FilterEvent& event)
+{
+    JSON::Object json;
+    json.values["type"] = event.type;
+    json.values["filter"] = event.filter;
+    return json;
 }
 
-Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::addOfferFilter(
-    const http::Request &request)
+// The string-valued attributes of a filter
+hashmap<string, string> stringValues(const JSON::Object& filter)
 {
-    auto contentType = request.headers.get("Content-Type");
-    if (contentType.isSome() && contentType.get() != "application/json") {
-        return http::UnsupportedMediaType("expected: application/json");
+    hashmap<string, string> values;
+    foreachpair (const string& name, const JSON::Value& value, filter.values) {
+        if (value.is<JSON::String>()) {
+            values[name] = value.as<JSON::String>().value;
+        }
     }
+    return values;
+}
 
-    Try<JSON::Object> body_ = JSON::parse<JSON::Object>(request.body);
-    if (body_.isError()) {
-        return http::BadRequest(body_.error());
-    }
+// Reads the optional 'roles' and 'frameworks' (arrays of role names and
+// framework ids) of a filter; None when the filter applies to every framework
+Try<Option<FilterScope>> parseScope(const JSON::Object& filter)
+{
+    FilterScope scope;
+    foreachpair (const string& name, const JSON::Value& value, filter.values) {
+        if (name != ROLES_SCOPE && name != FRAMEWORKS_SCOPE) {
+            continue;
+        } else if (!value.is<JSON::Array>()) {
+            return Error("'" + name + "' must be an array of strings");
+        }
 
-    auto body = body_.get();
+        foreach (const JSON::Value& item, value.as<JSON::Array>().values) {
+            if (!item.is<JSON::String>() || item.as<JSON::String>().value.empty()) {
+                return Error("'" + name + "' must be an array of strings");
+            }
+            if (name == ROLES_SCOPE) {
+                scope.roles.insert(item.as<JSON::String>().value);
+            } else {
+                scope.frameworks.insert(item.as<JSON::String>().value);
+            }
+        }
+    }
 
-    string hostnameParam;
-    if (body.values.count("hostname") > 0) {
-        hostnameParam = body.values["hostname"].as<JSON::String>().value;
+    if (scope.roles.empty() && scope.frameworks.empty()) {
+        return Option<FilterScope>::none();
     }
-    string agentIdParam;
-    if (body.values.count("agentId") > 0) {
-        agentIdParam = body.values["agentId"].as<JSON::String>().value;
+    return Option<FilterScope>(scope);
+}
+
+bool sameScope(const Option<FilterScope>& left, const Option<FilterScope>& right)
+{
+    if (left.isNone() || right.isNone()) {
+        return left.isNone() && right.isNone();
     }
+    return left.get().roles == right.get().roles && left.get().frameworks == right.get().frameworks;
+}
 
-    if (!hostnameParam.empty() || !agentIdParam.empty()) {
+bool testBit(const std::vector<bool>& bits, const Option<size_t>& bit)
+{
+    return bit.isSome() && bit.get() < bits.size() && bits[bit.get()];
+}
 
-        const SlaveID* agentIdToDeactivate = nullptr;
-        foreachpair (const SlaveID& agentId, const Slave& slave, this->slaves) {
-            if ( (hostnameParam.empty() || hostnameParam == slave.hostname) &&
-                    (agentIdParam.empty() || agentIdParam == stringify(agentId)) ) {
+// Set on the (framework, agent) pairs a scoped filter excludes, so that the
+// allocation pass skips them before allocating anything. The DRF allocator
+// only deletes the filters it creates, so a single instance serves them all.
+class ExclusionFilter : public ::mesos::internal::master::allocator::internal::OfferFilter
+{
+public:
+  virtual bool filter(const Resources&)
+  {
+    return true;
+  }
+};
 
-                agentIdToDeactivate = &agentId;
-                break;
-            }
-        }
+ExclusionFilter EXCLUSION_FILTER;
 
-        if (agentIdToDeactivate == NULL) {
-            string msg = "";
-            if (!hostnameParam.empty()) {
-                msg += " hostname==" + hostnameParam;
+// Reads the 'resources' and 'resourceNames' of a filter withholding part of
+// an agent; None for filters of whole agents
+Try<Option<ResourceFilter>> parseResourceFilter(const JSON::Object& filter)
+{
+    ResourceFilter resourceFilter;
+    bool partial = false;
+    foreachpair (const string& name, const JSON::Value& value, filter.values) {
+        if (name == RESOURCES_FILTER) {
+            if (!value.is<JSON::String>()) {
+                return Error("'" + name + "' must be a string, e.g., \"disk:1024;ports:[31000-31099]\"");
             }
-            if (!agentIdParam.empty()) {
-                if (!hostnameParam.empty()) {
-                    msg += " AND ";
+            Try<Resources> resources = Resources::parse(value.as<JSON::String>().value);
+            if (resources.isError()) {
+                return Error("Invalid '" + name + "': " + resources.error());
+            } else if (resources.get().empty()) {
+                return Error("'" + name + "' must not be empty");
+            }
+            resourceFilter.text = value.as<JSON::String>().value;
+            resourceFilter.resources = resources.get();
+            partial = true;
+        } else if (name == RESOURCE_NAMES_FILTER) {
+            if (!value.is<JSON::Array>()) {
+                return Error("'" + name + "' must be an array of strings");
+            }
+            foreach (const JSON::Value& item, value.as<JSON::Array>().values) {
+                if (!item.is<JSON::String>() || item.as<JSON::String>().value.empty()) {
+                    return Error("'" + name + "' must be an array of strings");
                 }
-                msg += " agentId==" + agentIdParam;
+                resourceFilter.names.insert(item.as<JSON::String>().value);
             }
-            return http::BadRequest("No such agent matching" + msg);
-        } else {
-            LOG(INFO) << "Adding filter for agent " << agentIdToDeactivate;
-            deactivateSlave(*agentIdToDeactivate);
-            return persistAndReportOfferFilters();
+            partial = true;
         }
-    } else {
-        return http::BadRequest("body requires 'agentId' and/or 'hostname' attributes");
     }
+
+    if (!partial) {
+        return Option<ResourceFilter>::none();
+    }
+    return Option<ResourceFilter>(resourceFilter);
 }
 
-Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::removeOfferFilter(
-    const http::Request &request)
+// Parses a filter of a POST, PUT or PATCH body; the agent it names is resolved by the allocator
+Try<FilterSpec> parseFilterSpec(const JSON::Object& filter)
 {
-    auto agentIdParam = request.url.query.get("agentId");
-    auto hostnameParam = request.url.query.get("hostname");
+    hashmap<string, string> values = stringValues(filter);
 
-    if (agentIdParam.isSome() && hostnameParam.isSome()) {
-        return http::BadRequest("Specify parameter 'agentId' or 'hostname', but not both");
-    } else if (agentIdParam.isNone() && hostnameParam.isNone()) {
-        return http::BadRequest("One of parameters 'agentId' or 'hostname' is required");
+    FilterSpec spec;
+    spec.agentId = values.get("agentId").getOrElse("");
+    spec.hostname = values.get("hostname").getOrElse("");
+
+    Try<FilterSchedule> schedule = OfferFilteringHierarchicalDRFAllocatorProcess::parseSchedule(values);
+    if (schedule.isError()) {
+        return Error(schedule.error());
     }
+    spec.schedule = schedule.get();
 
-    foreachpair (const SlaveID& agentId, const Slave& agent, this->slaves) {
-        if ( (agentIdParam.isSome() && agentIdParam.get() == stringify(agentId)) ||
-                (hostnameParam.isSome() && hostnameParam.get() == agent.hostname) ) {
-            if (agent.activated) {
-                return http::NotFound("No filter exists for agent " + stringify(agentId));
-            } else {
-                LOG(INFO) << "Activating agent: (" << stringify(agentId) << "," << agent.hostname << ")";
-                activateSlave(agentId);
-                return persistAndReportOfferFilters();
+    Try<Option<FilterScope>> scope = parseScope(filter);
+    if (scope.isError()) {
+        return Error(scope.error());
+    }
+    spec.scope = scope.get();
+
+    Try<Option<ResourceFilter>> resourceFilter = parseResourceFilter(filter);
+    if (resourceFilter.isError()) {
+        return Error(resourceFilter.error());
+    } else if (resourceFilter.get().isSome()) {
+        if (spec.schedule.startsAt.isSome() || spec.schedule.expiresAt.isSome() || spec.scope.isSome()) {
+            return Error("'" + RESOURCES_FILTER + "' and '" + RESOURCE_NAMES_FILTER +
+                "' cannot be combined with a schedule or a scope");
+        }
+        foreach (const string& type, SELECTOR_TYPES) {
+            if (values.contains(type)) {
+                return Error("'" + RESOURCES_FILTER + "' and '" + RESOURCE_NAMES_FILTER +
+                    "' apply to a single agent, named by 'agentId' and/or 'hostname'");
             }
-            break;
         }
+        if (spec.agentId.empty() && spec.hostname.empty()) {
+            return Error("'" + RESOURCES_FILTER + "' and '" + RESOURCE_NAMES_FILTER +
+                "' require 'agentId' and/or 'hostname' attributes");
+        }
+        spec.resourceFilter = resourceFilter.get();
+        return spec;
     }
 
-    string msg;
-    if (agentIdParam.isSome()) {
-        msg = "agent " + agentIdParam.get();
-    } else {
-        msg = "hostname " + hostnameParam.get();
+    Result<FilterSelector> selector = OfferFilteringHierarchicalDRFAllocatorProcess::findSelector(values);
+    if (selector.isError()) {
+        return Error(selector.error());
+    } else if (selector.isSome()) {
+        spec.selector = selector.get();
+    } else if (spec.agentId.empty() && spec.hostname.empty()) {
+        return Error("A filter requires 'agentId' and/or 'hostname' attributes, "
+            "or one of 'attribute', 'domain', 'hostnamePattern' or 'hostnameRegex'");
     }
-
-    return http::NotFound("No filter exists for " + msg);
+    return spec;
 }
 
-Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::persistAndReportOfferFilters()
+// Parses an array of filters, appending the invalid ones to 'errMsg'
+void parseFilterSpecs(const JSON::Array& filters, std::vector<FilterSpec>* specs, ostringstream* errMsg)
 {
-    JSON::Object agentsJson = getFilteredAgentsJSON();
-    persistFilteredAgents(agentsJson);
-    return http::OK(agentsJson);
+    foreach (const JSON::Value& filter, filters.values) {
+        if (!filter.is<JSON::Object>()) {
+            *errMsg << ", [" << stringify(filter) << " is not an object]";
+            continue;
+        }
+        Try<FilterSpec> spec = parseFilterSpec(filter.as<JSON::Object>());
+        if (spec.isError()) {
+            *errMsg << ", [" << spec.error() << "]";
+        } else {
+            specs->push_back(spec.get());
+        }
+    }
 }
 
-Option<SlaveID> OfferFilteringHierarchicalDRFAllocatorProcess::findSlaveID(
-        const string& agentId, const string& hostname) {
-
-    foreachpair (const SlaveID& agentId_, const Slave& agent, this->slaves) {
-        if ( (hostname.empty() || hostname == agent.hostname) &&
-                (agentId.empty() || agentId == stringify(agentId_)) ) {
-            return Some(agentId_);
+JSON::Object resourceFilterJSON(const string& agentId, const ResourceFilter& filter)
+{
+    JSON::Object json = filterJSON(agentId, filter.hostname);
+    if (filter.text.isSome()) {
+        json.values[RESOURCES_FILTER] = filter.text.get();
+    }
+    if (!filter.names.empty()) {
+        JSON::Array names;
+        foreach (const string& name, filter.names) {
+            names.values.push_back(name);
         }
+        json.values[RESOURCE_NAMES_FILTER] = names;
     }
-    return None();
+    return json;
 }
 
-pair<hashset<SlaveID>, string> OfferFilteringHierarchicalDRFAllocatorProcess::parseFilters(JSON::Object json)
+// The part of an agent's total the filter withholds. Resources given by value
+// match the agent's resources of the same name and role (whatever their
+// reservation), and are clamped to what the agent has; what the agent lacks
+// is added to 'unavailable'.
+Resources resourcesToWithhold(
+    const ResourceFilter& filter,
+    const Resources& total,
+    Resources* unavailable = nullptr)
 {
-    hashset<SlaveID> slaveIds;
-    ostringstream errMsg;
+    Resources withheld;
+    foreach (const Resource& resource, total) {
+        if (filter.names.count(resource.name()) > 0) {
+            withheld += resource;
+        }
+    }
 
-    auto filters = json.values["filters"].as<JSON::Array>();
-    for ( auto const &filter : filters.values) {
-        auto values = filter.as<JSON::Object>().values;
+    foreach (const Resource& wanted, filter.resources) {
+        Resource missing = wanted;
+        foreach (const Resource& resource, total - withheld) {
+            // Persistent volumes and other disks cannot be split
+            if (resource.name() != wanted.name() || resource.role() != wanted.role() ||
+                    resource.type() != wanted.type() || resource.has_disk()) {
+                continue;
+            }
 
-        string agentId;
-        std::map<std::string, JSON::Value>::const_iterator itAgentId = values.find("agentId");
-        if (itAgentId != values.end()) {
-            agentId = itAgentId->second.as<JSON::String>().value;
+            Resource part = resource;
+            if (wanted.type() == Value::SCALAR) {
+                part.mutable_scalar()->set_value(std::min(resource.scalar().value(), missing.scalar().value()));
+                *missing.mutable_scalar() -= part.scalar();
+            } else if (wanted.type() == Value::RANGES) {
+                *part.mutable_ranges() = resource.ranges() - (resource.ranges() - missing.ranges());
+                *missing.mutable_ranges() -= part.ranges();
+            } else if (wanted.type() == Value::SET) {
+                *part.mutable_set() = resource.set() - (resource.set() - missing.set());
+                *missing.mutable_set() -= part.set();
+            }
+            if (!Resources::isEmpty(part)) {
+                withheld += part;
+            }
         }
 
-        string hostname;
-        std::map<std::string, JSON::Value>::const_iterator itHostname = values.find("hostname");
-        if (itHostname != values.end()) {
-            hostname = itHostname->second.as<JSON::String>().value;
+        if (unavailable != nullptr && !Resources::isEmpty(missing)) {
+            *unavailable += missing;
         }
+    }
+    return withheld;
+}
 
-        auto slaveId = findSlaveID(agentId, hostname);
-        if (slaveId.isNone()) {
-            errMsg << ", ";
-            if (!hostname.empty()) {
-                errMsg << "[hostname == " << hostname << "]";
-            }
-            if (!hostname.empty() && !agentId.empty()) {
-                errMsg << " && ";
-            }
-            if (!agentId.empty()) {
-                errMsg << "[agentId: " << agentId << "]";
-            }
-        } else {
-            slaveIds.insert(slaveId.get());
+// Reads a number, given either as a JSON number or as a string
+Result<double> numberValue(const JSON::Object& object, const string& name)
+{
+    auto it = object.values.find(name);
+    if (it == object.values.end()) {
+        return None();
+    } else if (it->second.is<JSON::Number>() || it->second.is<JSON::String>()) {
+        Try<double> value = numify<double>(it->second.is<JSON::String>()
+            ? it->second.as<JSON::String>().value
+            : stringify(it->second));
+        if (value.isSome()) {
+            return value.get();
         }
     }
+    return Error("'" + name + "' must be a number");
+}
 
-    string error = !errMsg.str().empty() ? errMsg.str().substr(2) : "";
-    return std::make_pair(slaveIds, error);
+JSON::Array stringArray(const hashset<string>& values)
+{
+    JSON::Array array;
+    foreach (const string& value, values) {
+        array.values.push_back(value);
+    }
+    return array;
 }
 
-void OfferFilteringHierarchicalDRFAllocatorProcess::applyFilters(hashset<SlaveID> agentIds)
+hashset<string> stringSet(const JSON::Object& object, const string& name)
 {
-    foreachpair (const SlaveID& agentId, const Slave& agent, this->slaves) {
-        hashset<SlaveID>::const_iterator it = agentIds.find(agentId);
-        if (it != agentIds.end()) {
-            deactivateSlave(agentId);
-        } else {
-            activateSlave(agentId);
+    hashset<string> values;
+    Result<JSON::Array> array = object.find<JSON::Array>(name);
+    if (array.isSome()) {
+        foreach (const JSON::Value& value, array.get().values) {
+            if (value.is<JSON::String>()) {
+                values.insert(value.as<JSON::String>().value);
+            }
         }
     }
+    return values;
 }
 
-Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::updateOfferFilters(
-    const http::Request &request)
+// Whether the request only asks for its impact
+bool isDryRun(const http::Request& request)
 {
-    auto contentType = request.headers.get("Content-Type");
-    if (contentType.isSome() && contentType.get() != "application/json") {
-        return http::UnsupportedMediaType("expected: application/json");
-    }
+    return request.url.query.get("dryRun").getOrElse("false") == "true";
+}
 
-    Try<JSON::Object> body_ = JSON::parse<JSON::Object>(request.body);
-    if (body_.isError()) {
-        return http::BadRequest(body_.error());
+Capacity capacityOf(const Resources& resources)
+{
+    Capacity capacity;
+    foreach (const mesos::Resource& resource, resources) {
+        if (resource.type() == mesos::Value::SCALAR &&
+                std::find(CAPACITY_RESOURCES.begin(), CAPACITY_RESOURCES.end(), resource.name()) !=
+                    CAPACITY_RESOURCES.end()) {
+            capacity[resource.role()][resource.name()] += resource.scalar().value();
+        }
     }
+    return capacity;
+}
 
-    auto body = body_.get();
-    if (body.values.count("filters") == 1) {
-        auto filters = parseFilters(body);
-        if (!filters.second.empty()) {
-            return http::BadRequest("One or more agents specified do not exist: " + filters.second);
-        } else {
-            applyFilters(filters.first);
+// Adds (or, with a negative sign, subtracts) capacity, dropping what reaches zero
+void addCapacity(Capacity* to, const Capacity& capacity, double sign)
+{
+    foreachpair (const string& role, const hashmap<string, double>& amounts, capacity) {
+        hashmap<string, double>& total = (*to)[role];
+        foreachpair (const string& name, double amount, amounts) {
+            total[name] += sign * amount;
+            if (std::abs(total[name]) < CAPACITY_EPSILON) {
+                total.erase(name);
+            }
+        }
+        if (total.empty()) {
+            to->erase(role);
         }
     }
+}
 
-    return persistAndReportOfferFilters();
+double capacityAmount(const Capacity& capacity, const string& role, const string& name)
+{
+    Option<hashmap<string, double>> amounts = capacity.get(role);
+    return amounts.isSome() ? amounts.get().get(name).getOrElse(0) : 0;
 }
 
+// The amount of the resource across all roles
+double clusterAmount(const Capacity& capacity, const string& name)
+{
+    double amount = 0;
+    foreachvalue (const hashmap<string, double>& amounts, capacity) {
+        amount += amounts.get(name).getOrElse(0);
+    }
+    return amount;
+}
 
+JSON::Object capacityJSON(const Capacity& capacity)
+{
+    JSON::Object json;
+    foreachpair (const string& role, const hashmap<string, double>& amounts, capacity) {
+        JSON::Object amounts_;
+        foreachpair (const string& name, double amount, amounts) {
+            amounts_.values[name] = JSON::Number(amount);
+        }
+        json.values[role] = amounts_;
+    }
+    return json;
+}
 
-// Store filters as JSON structure
-void OfferFilteringHierarchicalDRFAllocatorProcess::persistFilteredAgents(const JSON::Object& filteredAgents) {
+// The status of a drain job, as reported
+JSON::Object drainJSON(const DrainJob& job)
+{
+    JSON::Object status;
+    status.values["id"] = job.id;
+    status.values["state"] = job.state;
+    status.values["agents"] = JSON::Number(static_cast<double>(job.agents.size()));
+    status.values["filtered"] = JSON::Number(static_cast<double>(job.next));
+    status.values["draining"] = JSON::Number(static_cast<double>(job.draining.size()));
+    status.values["drained"] = JSON::Number(static_cast<double>(job.drained.size()));
+    status.values["lifted"] = JSON::Number(static_cast<double>(job.lifted.size()));
+    if (job.maxConcurrent.isSome()) {
+        status.values["maxConcurrent"] = JSON::Number(static_cast<double>(job.maxConcurrent.get()));
+    }
+    if (job.maxCapacityFraction.isSome()) {
+        status.values["maxCapacityFraction"] = JSON::Number(job.maxCapacityFraction.get());
+    }
+    status.values["interval"] = stringify(job.interval);
+    status.values["batchSize"] = JSON::Number(static_cast<double>(job.batchSize));
+    return status;
+}
 
-    string serialized = stringify(filteredAgents);
+JSON::Object selectorJSON(const FilterSelector& selector)
+{
+    JSON::Object filter;
+    filter.values[selector.type] = selector.value;
+    return filter;
+}
 
-    state->fetch(FILTERED_AGENTS)
-        .onReady([this, serialized](const Option<Variable>& option) {
-            state->store(option.get().mutate(serialized));
-        });
+string selectorKey(const FilterSelector& selector)
+{
+    return selector.type + ":" + selector.value;
 }
 
-// Read agent filters from the state store, and re-apply deactivations to
-// the associated slaves; this may be called before all agents have re-registered,
-// which is why we also call this method upon addSlave calls.
-void OfferFilteringHierarchicalDRFAllocatorProcess::restoreFilteredAgents() {
+// The domains a hostname belongs to, e.g., "b.c" and "c" for "a.b.c"
+vector<string> hostnameDomains(const string& hostname)
+{
+    vector<string> domains;
+    for (size_t dot = hostname.find('.'); dot != string::npos; dot = hostname.find('.', dot + 1)) {
+        if (dot + 1 < hostname.size()) {
+            domains.push_back(hostname.substr(dot + 1));
+        }
+    }
+    return domains;
+}
 
-    if (state != NULL) {
-        state->fetch(FILTERED_AGENTS)
-            .onReady([this](const Option<Variable>& option) {
-                string serialized = option.get().value();
-                if (!serialized.empty()) {
-                    LOG(INFO) << "Attepting to restore filtered agents: " << serialized;
-                    Try<JSON::Object> body_ = JSON::parse<JSON::Object>(serialized);
-                    if (body_.isError()) {
-                        LOG(ERROR) << "Failed to parse serialized filters '" << serialized << "': " << body_.error();
-                    } else {
-                        auto body = body_.get();
-                        if (body.values.count("filters") == 1) {
-
-                            auto filters = parseFilters(body);
-                            if (!filters.second.empty()) {
-                                LOG(WARNING) << "One or more filtered agents could not be resolved: " << filters.second;
-                            }
-                            // This event must take place AFTER the new leader has sufficiently recovered
-                            // when it occurrs too soon, it can result in failed recovery!
-                            applyFilters(filters.first);
-                        }
-                    }
-                }
-            });
-    } else {
-        LOG(WARNING) << "State not initialized";
+// The "NAME:VALUE" forms of an agent's attributes, as matched by attribute selectors
+vector<string> attributeValues(const SlaveInfo& slaveInfo)
+{
+    vector<string> values;
+    foreach (const Attribute& attribute, slaveInfo.attributes()) {
+        string value;
+        switch (attribute.type()) {
+            case Value::SCALAR:
+                value = stringify(attribute.scalar().value());
+                break;
+            case Value::TEXT:
+                value = attribute.text().value();
+                break;
+            case Value::RANGES:
+                value = stringify(attribute.ranges());
+                break;
+            case Value::SET:
+                value = stringify(attribute.set());
+                break;
+            default:
+                continue;
+        }
+        values.push_back(attribute.name() + ":" + value);
     }
+    return values;
 }
 
+// Whether a stored entry holds a filter or a drain job
+bool isFilterEntry(const string& name)
+{
+    return strings::startsWith(name, FILTER_AGENT_PREFIX) ||
+        strings::startsWith(name, FILTER_HOSTNAME_PREFIX) ||
+        strings::startsWith(name, FILTER_SELECTOR_PREFIX) ||
+        strings::startsWith(name, FILTER_RESOURCES_PREFIX) ||
+        strings::startsWith(name, DRAIN_PREFIX);
+}
 
-Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::offerFilters(
-    const http::Request &request)
+// A field of a serialized manifest; None when it has none
+Option<string> manifestField(const string& manifest, const string& name)
 {
-    bool isLeader;
-    Option<string> leader = getLeader(request);
-    if (leader.isNone()) {
-        // No leader; punt!
-        return http::ServiceUnavailable("No leader elected");
-    } else if (leader.get() != CURRENT_MASTER) {
-        // Redirect the request to the current leader
-        return http::TemporaryRedirect("//" + leader.get() + stringify(request.url));
+    Try<JSON::Object> json = JSON::parse<JSON::Object>(manifest);
+    if (json.isError()) {
+        LOG(ERROR) << "Failed to parse the filter manifest '" << manifest << "': " << json.error();
+        return None();
     }
 
-    if (request.method == "GET") {
-        return getOfferFilters(request);
-    } else if (request.method == "POST") {
-        return addOfferFilter(request);
-    } else if (request.method == "PUT") {
-        return updateOfferFilters(request);
-    } else if (request.method == "DELETE") {
-        return removeOfferFilter(request);
-    } else {
-        return http::MethodNotAllowed({"GET","POST","PUT","DELETE"}, request.method);
+    Result<JSON::String> field = json.get().find<JSON::String>(name);
+    if (field.isSome()) {
+        return field.get().value;
     }
+    return None();
 }
 
-void OfferFilteringHierarchicalDRFAllocatorProcess::recover(
-      const int _expectedAgentCount,
-      const hashmap<std::string, Quota>& quotas)
+// A counter of a serialized manifest ("generation" or "version"); None when it has none
+Option<uint64_t> manifestCounter(const string& manifest, const string& name)
 {
-
-    HierarchicalDRFAllocatorProcess::recover(_expectedAgentCount, quotas);
-    restoreFilteredAgents();
+    Option<string> counter = manifestField(manifest, name);
+    if (counter.isSome()) {
+        Try<uint64_t> counter_ = numify<uint64_t>(counter.get());
+        if (counter_.isSome()) {
+            return counter_.get();
+        }
+    }
+    return None();
 }
 
-// Gets {hostname}:{port} of the current leader; returns ":" when the current master is leader;
-// returns None when no leader has been elected.
-Option<string> OfferFilteringHierarchicalDRFAllocatorProcess::getLeader(const http::Request &request)
+// The names of the entries changed by the commits after generation 'since' up to
+// 'generation', as logged in a serialized manifest; None unless the log covers
+// every one of those commits
+Option<hashset<string>> manifestChanges(const string& manifest, uint64_t since, uint64_t generation)
 {
-    process::PID<> pid;
-    pid.id = "master";
-    pid.address = process::address();
+    Try<JSON::Object> json = JSON::parse<JSON::Object>(manifest);
+    if (json.isError()) {
+        return None();
+    }
 
-    Option<http::Headers> headers;
-    if (request.headers.get("Authorization").isSome()) {
-        headers = Some(http::Headers{{"Authorization", request.headers.get("Authorization").get() }});
-    }
-
-    auto response_ = http::get(pid, "state", None(), headers).get();
-    if (response_.code == http::Status::TEMPORARY_REDIRECT) {
-        // Follow redirect to current leader
-        auto location = response_.headers["Location"];
-        return Some(strings::split(location, "/")[2]);
-    } else if (response_.code == http::Status::OK) {
-        auto masterState_ = JSON::parse<JSON::Object>(response_.body);
-        if (!masterState_.isError()) {
-            auto pid = masterState_.get().values["pid"].as<JSON::String>().value;
-            if (masterState_.get().values.count("leader") == 1) {
-                auto leader = masterState_.get().values["leader"].as<JSON::String>().value;
-                if (leader.empty()) {
-                    return None();
-                } else if (pid == leader) {
-                    return Some(CURRENT_MASTER);
-                } else {
-                    vector<string> parts = strings::split(leader, "@");
-                    return Some(parts[1]);
-                }
-            } else {
-                return None();
-            }
-        } else {
-            LOG(WARNING) << "Failed to recover master state: " << masterState_.error();
+    Result<JSON::Array> changes = json.get().find<JSON::Array>("changes");
+    if (!changes.isSome()) {
+        return None();
+    }
+
+    hashset<string> names;
+    uint64_t covered = 0;
+    foreach (const JSON::Value& change, changes.get().values) {
+        if (!change.is<JSON::Object>()) {
             return None();
         }
-    } else {
-        LOG(WARNING) << "Failed to recover master state: " << response_.status;
+        Result<JSON::String> generation_ = change.as<JSON::Object>().find<JSON::String>("generation");
+        Result<JSON::Array> entries = change.as<JSON::Object>().find<JSON::Array>("entries");
+        Try<uint64_t> changed = generation_.isSome()
+            ? numify<uint64_t>(generation_.get().value) : Try<uint64_t>(Error("missing"));
+        if (changed.isError() || !entries.isSome()) {
+            return None();
+        }
+        if (changed.get() <= since || changed.get() > generation) {
+            continue;
+        }
+        ++covered;
+        foreach (const JSON::Value& name, entries.get().values) {
+            if (name.is<JSON::String>()) {
+                names.insert(name.as<JSON::String>().value);
+            }
+        }
+    }
+
+    if (since >= generation || covered != generation - since) {
         return None();
     }
+    return names;
 }
 
-void OfferFilteringHierarchicalDRFAllocatorProcess::addSlave(
-      const SlaveID& slaveId,
-      const SlaveInfo& slaveInfo,
-      const Option<Unavailability>& unavailability,
-      const Resources& total,
-      const hashmap<FrameworkID, Resources>& used)
+// A local snapshot is a header line ("CRC32 LENGTH") followed by the
+// FilterSnapshot it covers
+string encodeSnapshot(uint64_t generation, const hashmap<string, string>& entries)
 {
-    HierarchicalDRFAllocatorProcess::addSlave(slaveId, slaveInfo, unavailability, total, used);
-    restoreFilteredAgents();
-}
+    FilterSnapshot snapshot;
+    snapshot.set_generation(generation);
+    snapshot.set_written_at(static_cast<int64_t>(Clock::now().secs()));
+    foreachpair (const string& name, const string& value, entries) {
+        FilterSnapshot::Entry* entry = snapshot.add_entries();
+        entry->set_name(name);
+        entry->set_value(value);
+    }
+    string payload = snapshot.SerializeAsString();
 
-void OfferFilteringHierarchicalDRFAllocatorProcess::activateSlave(const SlaveID& slaveId)
-{
-    // TODO(mdeboer): need to compare this against existing filters and suppress
-    // the call as necessary
-    LOG(INFO) << "----> activateSlave called " << slaveId;
-    HierarchicalDRFAllocatorProcess::activateSlave(slaveId);
+    uLong checksum = crc32(0L, reinterpret_cast<const Bytef*>(payload.data()), payload.size());
+    return stringify(checksum) + " " + stringify(payload.size()) + "\n" + payload;
 }
 
+Try<FilterSnapshot> decodeSnapshot(const string& contents)
+{
+    size_t newline = contents.find('\n');
+    vector<string> header = strings::tokenize(contents.substr(0, newline), " ");
+    if (newline == string::npos || header.size() != 2) {
+        return Error("Missing header");
+    }
 
-} // namespace modules
-} // namespace mesos
-} // namespace gettyimages
+    Try<uLong> checksum = numify<uLong>(header[0]);
+    Try<size_t> length = numify<size_t>(header[1]);
+    if (checksum.isError() || length.isError()) {
+        return Error("Malformed header '" + contents.substr(0, newline) + "'");
+    }
 
-namespace {
+    string payload = contents.substr(newline + 1);
+    if (payload.size() != length.get()) {
+        return Error("Expected " + stringify(length.get()) + " bytes, found " + stringify(payload.size()));
+    } else if (crc32(0L, reinterpret_cast<const Bytef*>(payload.data()), payload.size()) != checksum.get()) {
+        return Error("Checksum mismatch");
+    }
+
+    FilterSnapshot snapshot;
+    if (!snapshot.ParseFromString(payload)) {
+        return Error("Malformed snapshot");
+    }
+    return snapshot;
+}
+
+// The stored identity of a filter, as given by filterJSON or selectorJSON
+StoredFilter storedIdentity(const JSON::Object& filter)
+{
+    StoredFilter stored;
+    foreachpair (const string& name, const JSON::Value& value, filter.values) {
+        if (!value.is<JSON::String>()) {
+            continue;
+        }
+        const string& text = value.as<JSON::String>().value;
+        if (name == "agentId") {
+            stored.set_agent_id(text);
+        } else if (name == "hostname") {
+            stored.set_hostname(text);
+        } else if (std::find(SELECTOR_TYPES.begin(), SELECTOR_TYPES.end(), name) != SELECTOR_TYPES.end()) {
+            stored.set_selector_type(name);
+            stored.set_selector_value(text);
+        }
+    }
+    return stored;
+}
+
+StoredFilter storedResourceFilter(const string& agentId, const ResourceFilter& filter)
+{
+    StoredFilter stored;
+    stored.set_agent_id(agentId);
+    if (!filter.hostname.empty()) {
+        stored.set_hostname(filter.hostname);
+    }
+    if (filter.text.isSome()) {
+        stored.set_resources(filter.text.get());
+    }
+    foreach (const string& name, filter.names) {
+        stored.add_resource_names(name);
+    }
+    return stored;
+}
+
+// Entries above the threshold are compressed, which only drain jobs (listing
+// their agents) ever reach
+string encodeEntry(const StoredEntry& entry)
+{
+    string serialized = entry.SerializeAsString();
+
+    if (serialized.size() > ENTRY_COMPRESSION_THRESHOLD) {
+        Try<string> compressed = gzip::compress(serialized);
+        if (compressed.isSome() && compressed.get().size() < serialized.size()) {
+            StoredEntry gzipped;
+            gzipped.set_gzip(compressed.get());
+            return gzipped.SerializeAsString();
+        }
+    }
+    return serialized;
+}
+
+string encodeEntry(const StoredFilter& filter)
+{
+    StoredEntry entry;
+    entry.mutable_filter()->CopyFrom(filter);
+    return encodeEntry(entry);
+}
+
+string encodeEntry(const JSON::Object& json)
+{
+    StoredEntry entry;
+    entry.set_json(stringify(json));
+    return encodeEntry(entry);
+}
+
+// Entries of earlier formats hold the JSON form, which no StoredEntry starts like
+bool isJSONEntry(const string& value)
+{
+    return !value.empty() && value[0] == '{';
+}
+
+// Entries of earlier formats are decoded as holding their JSON form
+Try<StoredEntry> decodeEntry(const string& value)
+{
+    StoredEntry entry;
+    if (isJSONEntry(value)) {
+        entry.set_json(value);
+        return entry;
+    }
+
+    if (!entry.ParseFromString(value)) {
+        return Error("Malformed entry");
+    } else if (entry.has_gzip()) {
+        Try<string> decompressed = gzip::decompress(entry.gzip());
+        if (decompressed.isError()) {
+            return Error("Failed to decompress: " + decompressed.error());
+        } else if (!entry.ParseFromString(decompressed.get()) || entry.has_gzip()) {
+            return Error("Malformed compressed entry");
+        }
+    }
+
+    if (!entry.has_filter() && !entry.has_json()) {
+        return Error("Empty entry");
+    }
+    return entry;
+}
+
+// Written aside and renamed into place, so that a crash never leaves a
+// partial snapshot behind; one torn by a power loss fails its checksum
+Try<Nothing> writeSnapshot(const string& path, const string& contents)
+{
+    string temporary = path + ".tmp";
+    Try<Nothing> write = os::write(temporary, contents);
+    if (write.isError()) {
+        return Error("Failed to write '" + temporary + "': " + write.error());
+    }
+
+    Try<Nothing> rename = os::rename(temporary, path);
+    if (rename.isError()) {
+        return Error("Failed to rename '" + temporary + "': " + rename.error());
+    }
+    return Nothing();
+}
+
+
+Try<Nothing> OfferFilteringHierarchicalDRFAllocatorProcess::configure(
+    Storage* storage,
+    const Option<zookeeper::URL>& master_zk_url,
+    const GuardRails& guardRails,
+    const Option<string>& snapshotPath)
+{
+    if (this->storage.get() == nullptr) {
+        this->guardRails = guardRails;
+        this->snapshotPath = snapshotPath;
+
+        frontend.reset(new OfferFilterFrontendProcess(self()));
+        process::spawn(frontend.get());
+
+        if (snapshotPath.isSome()) {
+            snapshotter.reset(new OfferFilterSnapshotProcess(snapshotPath.get()));
+            process::spawn(snapshotter.get());
+        }
+
+        if (storage != nullptr) {
+            this->storage.reset(storage);
+            state = new State(storage);
+            pollStandby();
+        } else {
+            LOG(WARNING) << "No storage configured; offer filters will not survive failover";
+        }
+
+        if (master_zk_url.isSome()) {
+            masterGroup.reset(new zookeeper::Group(master_zk_url.get(), MASTER_ZK_SESSION_TIMEOUT));
+            masterDetector.reset(new zookeeper::LeaderDetector(masterGroup.get()));
+            LOG(INFO) << "Detecting leading master using master_zk " << master_zk_url.get();
+            detectLeader(None());
+        } else {
+            LOG(WARNING) << "No master_zk configured; only the recovered master will serve filters";
+        }
+        return Nothing();
+    } else {
+        LOG(INFO) << "Ignored duplicate configuration attempt";
+        delete storage;
+        return Nothing();
+    }
+}
+
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::getOfferFilters(
+    const http::Request &request)
+{
+    Option<uint64_t> known = knownFiltersVersion(request);
+
+    Option<string> watch = request.url.query.get("watch");
+    if (watch.isNone() || watch.get() == "false") {
+        // Pollers which already hold the current filter set get no body at all
+        if (request.url.query.get("usage").getOrElse("false") == "true" ||
+                request.url.query.get("drained").getOrElse("false") == "true") {
+            return reportAgentUsage(request.url.query.get("drained").getOrElse("false") == "true");
+        } else if (known.isSome() && known.get() == filtersVersion) {
+            return notModified();
+        }
+        return reportOfferFilters();
+    }
+
+    Duration timeout = WATCH_DEFAULT_TIMEOUT;
+    Option<string> timeoutParam = request.url.query.get("timeout");
+    if (timeoutParam.isSome()) {
+        Try<Duration> timeout_ = Duration::parse(timeoutParam.get());
+        if (timeout_.isError()) {
+            return http::BadRequest("Invalid 'timeout' parameter: " + timeout_.error());
+        }
+        timeout = std::min(timeout_.get(), WATCH_MAX_TIMEOUT);
+    }
+
+    // Watchers which hold no version of this process resynchronize with the whole set
+    if (known.isNone() || known.get() > filtersVersion) {
+        return reportOfferFilters();
+    } else if (known.get() < filtersVersion) {
+        return reportFilterEvents(known.get());
+    }
+
+    uint64_t id = nextWatcherId++;
+    FilterWatcher watcher;
+    watcher.since = known.get();
+    watcher.promise.reset(new Promise<http::Response>());
+    watchers.put(id, watcher);
+    delay(timeout, self(), &OfferFilteringHierarchicalDRFAllocatorProcess::expireWatcher, id);
+    return watcher.promise->future();
+}
+
+// The filter set version named by an If-None-Match ETag from this process, if any
+Option<uint64_t> OfferFilteringHierarchicalDRFAllocatorProcess::knownFiltersVersion(
+    const http::Request& request) const
+{
+    Option<string> ifNoneMatch = request.headers.get("If-None-Match");
+    if (ifNoneMatch.isNone()) {
+        return None();
+    }
+
+    string prefix = "\"" + filtersEpoch + "-";
+    foreach (string candidate, strings::tokenize(ifNoneMatch.get(), ",")) {
+        candidate = strings::trim(candidate);
+        if (strings::startsWith(candidate, "W/")) {
+            candidate = candidate.substr(2);
+        }
+        if (candidate == "*") {
+            return filtersVersion;
+        } else if (strings::startsWith(candidate, prefix) && strings::endsWith(candidate, "\"")) {
+            Try<uint64_t> version = numify<uint64_t>(
+                candidate.substr(prefix.size(), candidate.size() - prefix.size() - 1));
+            if (version.isSome()) {
+                return version.get();
+            }
+        }
+    }
+    return None();
+}
+
+http::Response OfferFilteringHierarchicalDRFAllocatorProcess::notModified() const
+{
+    http::Response response(http::Status::NOT_MODIFIED);
+    response.headers["ETag"] = filtersETag();
+    return response;
+}
+
+// The changes made to the filter set since the specified version, or the whole
+// filter set once those changes are no longer buffered
+http::Response OfferFilteringHierarchicalDRFAllocatorProcess::reportFilterEvents(uint64_t since)
+{
+    if (filtersVersion - since > filterEvents.size()) {
+        return reportOfferFilters();
+    }
+
+    JSON::Array events;
+    foreach (const FilterEvent& event, filterEvents) {
+        if (event.version > since) {
+            events.values.push_back(eventJSON(event));
+        }
+    }
+    return reportEvents(std::move(events));
+}
+
+// The given changes, as of the current version
+http::Response OfferFilteringHierarchicalDRFAllocatorProcess::reportEvents(JSON::Array events)
+{
+    JSON::Object body;
+    body.values["events"] = std::move(events);
+    body.values["version"] = JSON::Number(static_cast<double>(filtersVersion));
+
+    http::OK response(stringify(body));
+    response.headers["Content-Type"] = "application/json";
+    response.headers["ETag"] = filtersETag();
+    return response;
+}
+
+// Answers the parked watchers with the changes made since their version;
+// runs once per batch of changes
+void OfferFilteringHierarchicalDRFAllocatorProcess::notifyWatchers()
+{
+    notifyScheduled = false;
+
+    // Nearly all watchers hold the same version, so each response is built once
+    hashmap<uint64_t, http::Response> responses;
+    for (auto it = watchers.begin(); it != watchers.end();) {
+        uint64_t since = it->second.since;
+        if (since < filtersVersion) {
+            if (!responses.contains(since)) {
+                responses.put(since, reportFilterEvents(since));
+            }
+            it->second.promise->set(responses.at(since));
+            it = watchers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::expireWatcher(uint64_t id)
+{
+    Option<FilterWatcher> watcher = watchers.get(id);
+    if (watcher.isSome()) {
+        watcher.get().promise->set(notModified());
+        watchers.erase(id);
+    }
+}
+
+// The current filter set as a response; the document is serialized once per change
+http::Response OfferFilteringHierarchicalDRFAllocatorProcess::reportOfferFilters()
+{
+    if (filtersDocument.isNone()) {
+        filtersDocument = stringify(getFilteredAgentsJSON());
+    }
+
+    http::OK response(filtersDocument.get());
+    response.headers["Content-Type"] = "application/json";
+    response.headers["ETag"] = filtersETag();
+    return response;
+}
+
+// Every ETag built is handed out, so it also records the highest version reported
+string OfferFilteringHierarchicalDRFAllocatorProcess::filtersETag() const
+{
+    if (reportedFiltersVersion.isNone() || reportedFiltersVersion.get() < filtersVersion) {
+        reportedFiltersVersion = filtersVersion;
+    }
+    return "\"" + filtersEpoch + "-" + stringify(filtersVersion) + "\"";
+}
+
+// Once restored, the filter set carries on from the committed version and
+// epoch, so that the ETags of the previous leader stay valid across a clean
+// failover. A process which has already reported versions moves past them
+// instead, under a new epoch when the store has not caught up with them: its
+// successor's versions up to there named other filter sets.
+void OfferFilteringHierarchicalDRFAllocatorProcess::restoreFiltersVersion(const string& manifest)
+{
+    Option<uint64_t> committed = manifestCounter(manifest, "version");
+    Option<string> epoch = manifestField(manifest, "epoch");
+    if (committed.isNone()) {
+        return;
+    }
+
+    if (reportedFiltersVersion.isNone() && epoch.isSome()) {
+        filtersEpoch = epoch.get();
+        filtersVersion = committed.get();
+        filtersDocument = None();
+        filterEvents.clear();
+        return;
+    }
+
+    if (reportedFiltersVersion.isSome() && committed.get() <= reportedFiltersVersion.get()) {
+        LOG(INFO) << "Moving past the filter set versions reported up to "
+                  << reportedFiltersVersion.get() << " under a new epoch";
+        filtersEpoch = UUID::random().toString();
+    }
+    filtersVersion = std::max(filtersVersion, committed.get());
+}
+
+// A mutation with an `If-Match` header applies only to the filter set it names;
+// checked and applied within one turn of the allocator, so nothing comes between
+Option<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::checkIfMatch(
+    const http::Request& request) const
+{
+    Option<string> ifMatch = request.headers.get("If-Match");
+    if (ifMatch.isNone()) {
+        return None();
+    }
+
+    string etag = filtersETag();
+    foreach (string candidate, strings::tokenize(ifMatch.get(), ",")) {
+        candidate = strings::trim(candidate);
+        if (candidate == "*" || candidate == etag) {
+            return None();
+        }
+    }
+
+    http::PreconditionFailed response("The filters have changed since " + ifMatch.get());
+    response.headers["ETag"] = etag;
+    return response;
+}
+
+// Records a change to the reported filters (active or pending), invalidating
+// the serialized filter set and queueing the change for watchers
+void OfferFilteringHierarchicalDRFAllocatorProcess::filtersChanged(
+    const string& type,
+    const JSON::Object& filter)
+{
+    ++filtersVersion;
+    filtersDocument = None();
+
+    FilterEvent event;
+    event.version = filtersVersion;
+    event.type = type;
+    event.filter = filter;
+    filterEvents.push_back(event);
+    if (recordedEvents.isSome()) {
+        recordedEvents.get().values.push_back(eventJSON(event));
+    }
+    if (filterEvents.size() > WATCH_EVENT_BUFFER_SIZE) {
+        filterEvents.pop_front();
+    }
+
+    if (!notifyScheduled) {
+        notifyScheduled = true;
+        process::dispatch(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::notifyWatchers);
+    }
+}
+
+// Reports the filters along with the allocation of each filtered agent, as
+// tracked by the allocator; not cached, as allocations change between versions
+http::Response OfferFilteringHierarchicalDRFAllocatorProcess::reportAgentUsage(bool drainedOnly)
+{
+    Time now = Clock::now();
+    JSON::Array agents;
+    foreach (const SlaveID& slaveId, fullyFilteredAgents) {
+        const Slave& agent = this->slaves.at(slaveId);
+        bool drained = agent.allocated.empty();
+        if (drainedOnly && !drained) {
+            continue;
+        }
+
+        JSON::Object usage = filterJSON(slaveId.value(), agent.hostname);
+        usage.values["total"] = stringify(agent.total);
+        usage.values["allocated"] = stringify(agent.allocated);
+        usage.values["drained"] = drained;
+
+        Option<Time> since = filteredSince(slaveId);
+        if (since.isSome()) {
+            usage.values["filteredSince"] = formatTime(since.get());
+            usage.values["filteredFor"] = stringify(now - since.get());
+        }
+        agents.values.push_back(usage);
+    }
+
+    JSON::Object body = getFilteredAgentsJSON();
+    body.values["agents"] = std::move(agents);
+
+    http::OK response(body);
+    response.headers["Content-Type"] = "application/json";
+    return response;
+}
+
+// When the earliest of the unscoped filters which apply to the agent took effect
+Option<Time> OfferFilteringHierarchicalDRFAllocatorProcess::filteredSince(const SlaveID& slaveId) const
+{
+    Option<Time> since;
+    hashset<string> keys = agentSelectors.get(slaveId).getOrElse(hashset<string>());
+    if (filteredAgents.contains(slaveId)) {
+        keys.insert(agentFilterKey(slaveId.value()));
+    }
+    foreach (const string& key, keys) {
+        Option<Time> started = filterStarts.get(key);
+        if (!filterScopes.contains(key) && started.isSome() &&
+                (since.isNone() || started.get() < since.get())) {
+            since = started;
+        }
+    }
+    return since;
+}
+
+JSON::Object OfferFilteringHierarchicalDRFAllocatorProcess::getFilteredAgentsJSON() {
+
+    JSON::Array filters;
+
+    foreach (const SlaveID& agentId, filteredAgents) {
+        filters.values.push_back(describeFilter(
+            filterJSON(stringify(agentId), this->slaves.at(agentId).hostname),
+            agentFilterKey(agentId.value())));
+    }
+
+    // Pending filters are reported (and persisted) until their agents re-register
+    foreachpair (const string& agentId, const string& hostname, pendingFilters) {
+        filters.values.push_back(describeFilter(filterJSON(agentId, hostname), agentFilterKey(agentId)));
+    }
+    foreach (const string& hostname, pendingHostnameFilters) {
+        filters.values.push_back(describeFilter(filterJSON("", hostname), hostnameFilterKey(hostname)));
+    }
+
+    foreachpair (const string& key, const FilterSelector& selector, selectors) {
+        filters.values.push_back(describeFilter(selectorJSON(selector), key));
+    }
+
+    // Filters which have yet to start
+    foreachpair (const string& key, const JSON::Object& filter, scheduledFilters) {
+        filters.values.push_back(describeFilter(filter, key));
+    }
+
+    foreachpair (const string& agentId, const ResourceFilter& filter, resourceFilters) {
+        filters.values.push_back(resourceFilterJSON(agentId, filter));
+    }
+
+    JSON::Object body;
+    body.values["filters"] = std::move(filters);
+    return body;
+}
+
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::addOfferFilter(
+    const FilterRequest& request)
+{
+    const FilterSpec& filter = request.filters.front();
+    const FilterSchedule& schedule = filter.schedule;
+    const Option<FilterScope>& scope = filter.scope;
+    bool dryRun = isDryRun(request.request);
+
+    if (filter.resourceFilter.isSome()) {
+        return addResourceFilter(filter, dryRun);
+    }
+
+    const Option<FilterSelector>& selector = filter.selector;
+    if (selector.isSome()) {
+        string key = selectorKey(selector.get());
+        bool filtering = scope.isNone() && startsNow(key, schedule);
+        hashmap<SlaveID, Capacity> proposed;
+        foreach (const SlaveID& slaveId, matchingAgents(selector.get())) {
+            proposed.put(slaveId, withheldCapacity(
+                slaveId, filtering || isFiltered(slaveId, key), resourceFilters.get(slaveId.value())));
+        }
+        Option<http::Response> rejected = assessImpact(proposed, dryRun);
+        if (rejected.isSome()) {
+            return rejected.get();
+        }
+
+        bool deferred = scheduleFilter(key, selectorJSON(selector.get()), schedule);
+        scopeFilter(key, selectorJSON(selector.get()), scope);
+        if (!deferred) {
+            addSelector(selector.get());
+        }
+        return persistAndReportOfferFilters();
+    }
+
+    const string& hostnameParam = filter.hostname;
+    const string& agentIdParam = filter.agentId;
+
+    if (!hostnameParam.empty() || !agentIdParam.empty()) {
+
+        Option<SlaveID> agentIdToDeactivate = findSlaveID(agentIdParam, hostnameParam);
+
+        if (agentIdToDeactivate.isNone()) {
+            string msg = "";
+            if (!hostnameParam.empty()) {
+                msg += " hostname==" + hostnameParam;
+            }
+            if (!agentIdParam.empty()) {
+                if (!hostnameParam.empty()) {
+                    msg += " AND ";
+                }
+                msg += " agentId==" + agentIdParam;
+            }
+            return http::BadRequest("No such agent matching" + msg);
+        } else {
+            const SlaveID& agentId = agentIdToDeactivate.get();
+            string key = agentFilterKey(agentId.value());
+            hashmap<SlaveID, Capacity> proposed;
+            proposed.put(agentId, withheldCapacity(
+                agentId,
+                (scope.isNone() && startsNow(key, schedule)) || isFiltered(agentId, key),
+                resourceFilters.get(agentId.value())));
+            Option<http::Response> rejected = assessImpact(proposed, dryRun);
+            if (rejected.isSome()) {
+                return rejected.get();
+            }
+
+            JSON::Object json = filterJSON(agentId.value(), this->slaves.at(agentId).hostname);
+            bool deferred = scheduleFilter(key, json, schedule);
+            scopeFilter(key, json, scope);
+            if (!deferred) {
+                LOG(INFO) << "Adding filter for agent " << agentId;
+                hashset<SlaveID> added;
+                added.insert(agentId);
+                applyFilterDelta(added, hashset<SlaveID>());
+            }
+            return persistAndReportOfferFilters();
+        }
+    } else {
+        return http::BadRequest("body requires 'agentId' and/or 'hostname' attributes, "
+            "or one of 'attribute', 'domain', 'hostnamePattern' or 'hostnameRegex'");
+    }
+}
+
+// Withholds the filter's resources of the agent named by 'agentId' and/or
+// 'hostname', replacing any resource filter of that agent
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::addResourceFilter(
+    const FilterSpec& spec,
+    bool dryRun)
+{
+    ResourceFilter filter = spec.resourceFilter.get();
+    const string& agentIdParam = spec.agentId;
+    const string& hostnameParam = spec.hostname;
+
+    Option<SlaveID> slaveId = findSlaveID(agentIdParam, hostnameParam);
+    if (slaveId.isNone()) {
+        return http::BadRequest("No such agent matching"
+            + (hostnameParam.empty() ? "" : " hostname==" + hostnameParam)
+            + (agentIdParam.empty() ? "" : " agentId==" + agentIdParam));
+    }
+
+    const Slave& agent = this->slaves.at(slaveId.get());
+    Resources unavailable;
+    resourcesToWithhold(filter, agent.total, &unavailable);
+    if (!unavailable.empty()) {
+        return http::BadRequest("Agent " + stringify(slaveId.get()) + " has no resources "
+            + stringify(unavailable));
+    }
+
+    filter.hostname = agent.hostname;
+
+    hashmap<SlaveID, Capacity> proposed;
+    proposed.put(slaveId.get(), withheldCapacity(slaveId.get(), isFiltered(slaveId.get()), filter));
+    Option<http::Response> rejected = assessImpact(proposed, dryRun);
+    if (rejected.isSome()) {
+        return rejected.get();
+    }
+
+    setResourceFilter(slaveId.get().value(), filter);
+    return persistAndReportOfferFilters();
+}
+
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::removeOfferFilter(
+    const http::Request &request)
+{
+    Result<FilterSelector> selector = findSelector(request.url.query);
+    if (selector.isError()) {
+        return http::BadRequest(selector.error());
+    } else if (selector.isSome()) {
+        string key = selectorKey(selector.get());
+        if (selectors.contains(key)) {
+            removeSelector(key);
+        } else if (!removeScheduledFilter(key)) {
+            return http::NotFound("No filter exists for " + key);
+        }
+        return persistAndReportOfferFilters();
+    }
+
+    auto agentIdParam = request.url.query.get("agentId");
+    auto hostnameParam = request.url.query.get("hostname");
+
+    if (agentIdParam.isSome() && hostnameParam.isSome()) {
+        return http::BadRequest("Specify parameter 'agentId' or 'hostname', but not both");
+    } else if (agentIdParam.isNone() && hostnameParam.isNone()) {
+        return http::BadRequest("One of parameters 'agentId' or 'hostname' is required");
+    }
+
+    Option<SlaveID> agentId = findSlaveID(
+        agentIdParam.isSome() ? agentIdParam.get() : "",
+        hostnameParam.isSome() ? hostnameParam.get() : "");
+
+    // Both the filter of the whole agent and its resource filter are removed
+    if (agentId.isSome()) {
+        bool removed = removeResourceFilter(agentId.get().value());
+        if (filteredAgents.contains(agentId.get())) {
+            LOG(INFO) << "Removing filter for agent: (" << stringify(agentId.get()) << ","
+                      << this->slaves.at(agentId.get()).hostname << ")";
+            hashset<SlaveID> removedAgents;
+            removedAgents.insert(agentId.get());
+            applyFilterDelta(hashset<SlaveID>(), removedAgents);
+            removed = true;
+        } else {
+            removed = removeScheduledFilter(agentFilterKey(agentId.get().value())) || removed;
+        }
+        // A filter scheduled by hostname stays keyed by it until it starts
+        if (hostnameParam.isSome()) {
+            removed = removePendingHostnameFilter(hostnameParam.get()) || removed;
+            removed = removeScheduledFilter(hostnameFilterKey(hostnameParam.get())) || removed;
+        }
+
+        if (!removed) {
+            return http::NotFound("No filter exists for agent " + stringify(agentId.get()));
+        }
+        return persistAndReportOfferFilters();
+    }
+
+    // The filter may still be pending the re-registration of its agent, or its start
+    bool removedPending = false;
+    if (agentIdParam.isSome()) {
+        removedPending = removePendingFilter(agentIdParam.get());
+        removedPending = removeScheduledFilter(agentFilterKey(agentIdParam.get())) || removedPending;
+        removedPending = removeResourceFilter(agentIdParam.get()) || removedPending;
+    } else {
+        removedPending = removePendingHostnameFilter(hostnameParam.get());
+        removedPending = removeScheduledFilter(hostnameFilterKey(hostnameParam.get())) || removedPending;
+
+        vector<string> agentIds;
+        foreachpair (const string& agentId, const string& hostname, pendingFilters) {
+            if (hostname == hostnameParam.get()) {
+                agentIds.push_back(agentId);
+            }
+        }
+        foreach (const string& agentId, agentIds) {
+            removedPending = removePendingFilter(agentId) || removedPending;
+        }
+
+        agentIds.clear();
+        foreachpair (const string& agentId, const ResourceFilter& filter, resourceFilters) {
+            if (filter.hostname == hostnameParam.get()) {
+                agentIds.push_back(agentId);
+            }
+        }
+        foreach (const string& agentId, agentIds) {
+            removedPending = removeResourceFilter(agentId) || removedPending;
+        }
+    }
+    if (removedPending) {
+        LOG(INFO) << "Removed pending filter for "
+                  << (agentIdParam.isSome() ? agentIdParam.get() : hostnameParam.get());
+        return persistAndReportOfferFilters();
+    }
+
+    string msg;
+    if (agentIdParam.isSome()) {
+        msg = "agent " + agentIdParam.get();
+    } else {
+        msg = "hostname " + hostnameParam.get();
+    }
+
+    return http::NotFound("No filter exists for " + msg);
+}
+
+// Responds with the filter state once the write covering this change has committed
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::persistAndReportOfferFilters()
+{
+    return persistAndRespond(reportOfferFilters());
+}
+
+// A change the store has not committed in time stays applied, and is retried
+// until committed: it is accepted as pending, along with the version it made
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::persistAndRespond(
+    const http::Response& response)
+{
+    uint64_t version = filtersVersion;
+    string etag = filtersETag();
+    return persistFilteredAgents()
+        .then([response](const Nothing&) -> Future<http::Response> {
+            return response;
+        })
+        .repair([version, etag](const Future<http::Response>& response) -> Future<http::Response> {
+            JSON::Object body;
+            body.values["version"] = JSON::Number(static_cast<double>(version));
+            body.values["pending"] = true;
+            body.values["message"] = "Not yet persisted: " +
+                (response.isFailed() ? response.failure() : string("discarded"));
+
+            http::Accepted accepted(stringify(body));
+            accepted.headers["Content-Type"] = "application/json";
+            accepted.headers["ETag"] = etag;
+            return accepted;
+        });
+}
+
+// Resolves an agent by id and/or hostname; when both are given, both must match.
+Option<SlaveID> OfferFilteringHierarchicalDRFAllocatorProcess::findSlaveID(
+        const string& agentId, const string& hostname) {
+
+    if (!agentId.empty()) {
+        auto it = agentIdsByString.find(agentId);
+        if (it == agentIdsByString.end() ||
+                (!hostname.empty() && hostname != this->slaves.at(it->second).hostname)) {
+            return None();
+        }
+        return it->second;
+    } else if (!hostname.empty()) {
+        auto it = agentIdsByHostname.find(hostname);
+        if (it == agentIdsByHostname.end()) {
+            return None();
+        }
+        return it->second;
+    }
+    return None();
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::indexAgent(const SlaveID& slaveId)
+{
+    agentIdsByString[stringify(slaveId)] = slaveId;
+    agentIdsByHostname[this->slaves.at(slaveId).hostname] = slaveId;
+}
+
+// Indexes the agent by its attributes and domains, for the selectors
+void OfferFilteringHierarchicalDRFAllocatorProcess::indexSelectable(
+    const SlaveID& slaveId,
+    const SlaveInfo& slaveInfo)
+{
+    vector<string> attributes = attributeValues(slaveInfo);
+    foreach (const string& attribute, attributes) {
+        agentsByAttribute[attribute].insert(slaveId);
+    }
+    agentAttributes[slaveId] = attributes;
+
+    foreach (const string& domain, hostnameDomains(slaveInfo.hostname())) {
+        agentsByDomain[domain].insert(slaveId);
+    }
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::unindexAgent(const SlaveID& slaveId)
+{
+    agentIdsByString.erase(stringify(slaveId));
+
+    // A re-registered agent may already have claimed the hostname
+    const string& hostname = this->slaves.at(slaveId).hostname;
+    auto it = agentIdsByHostname.find(hostname);
+    if (it != agentIdsByHostname.end() && it->second == slaveId) {
+        agentIdsByHostname.erase(it);
+    }
+
+    foreach (const string& attribute, agentAttributes.get(slaveId).getOrElse(vector<string>())) {
+        agentsByAttribute[attribute].erase(slaveId);
+        if (agentsByAttribute[attribute].empty()) {
+            agentsByAttribute.erase(attribute);
+        }
+    }
+    agentAttributes.erase(slaveId);
+
+    foreach (const string& domain, hostnameDomains(hostname)) {
+        agentsByDomain[domain].erase(slaveId);
+        if (agentsByDomain[domain].empty()) {
+            agentsByDomain.erase(domain);
+        }
+    }
+
+    // The agent's selectors no longer match it
+    Option<hashset<string>> keys = agentSelectors.get(slaveId);
+    if (keys.isSome()) {
+        foreach (const string& key, keys.get()) {
+            selectors.at(key).agents.erase(slaveId);
+        }
+        agentSelectors.erase(slaveId);
+    }
+}
+
+// Resolves the agents named by the filters; selectors are collected into `selected`
+pair<hashset<SlaveID>, string> OfferFilteringHierarchicalDRFAllocatorProcess::resolveFilters(
+    const std::vector<FilterSpec>& filters,
+    hashmap<string, FilterSelector>* selected,
+    hashmap<string, FilterSchedule>* schedules,
+    hashmap<string, FilterScope>* scopes,
+    hashmap<string, ResourceFilter>* partial)
+{
+    hashset<SlaveID> slaveIds;
+    ostringstream errMsg;
+
+    foreach (const FilterSpec& filter, filters) {
+        if (filter.selector.isSome()) {
+            string key = selectorKey(filter.selector.get());
+            selected->put(key, filter.selector.get());
+            schedules->put(key, filter.schedule);
+            if (filter.scope.isSome()) {
+                scopes->put(key, filter.scope.get());
+            }
+            continue;
+        }
+
+        const string& agentId = filter.agentId;
+        const string& hostname = filter.hostname;
+
+        auto slaveId = findSlaveID(agentId, hostname);
+        if (slaveId.isNone()) {
+            errMsg << ", ";
+            if (!hostname.empty()) {
+                errMsg << "[hostname == " << hostname << "]";
+            }
+            if (!hostname.empty() && !agentId.empty()) {
+                errMsg << " && ";
+            }
+            if (!agentId.empty()) {
+                errMsg << "[agentId: " << agentId << "]";
+            }
+        } else if (filter.resourceFilter.isSome()) {
+            ResourceFilter resourceFilter = filter.resourceFilter.get();
+            const Slave& agent = this->slaves.at(slaveId.get());
+            Resources unavailable;
+            resourcesToWithhold(resourceFilter, agent.total, &unavailable);
+            if (!unavailable.empty()) {
+                errMsg << ", [agentId: " << slaveId.get() << " has no resources "
+                       << unavailable << "]";
+                continue;
+            }
+            resourceFilter.hostname = agent.hostname;
+            partial->put(slaveId.get().value(), resourceFilter);
+        } else {
+            slaveIds.insert(slaveId.get());
+            schedules->put(agentFilterKey(slaveId.get().value()), filter.schedule);
+            if (filter.scope.isSome()) {
+                scopes->put(agentFilterKey(slaveId.get().value()), filter.scope.get());
+            }
+        }
+    }
+
+    string error = !errMsg.str().empty() ? errMsg.str().substr(2) : "";
+    return std::make_pair(slaveIds, error);
+}
+
+// Resolves the filters a PATCH removes, as DELETE would, into the keys of the
+// filters and the agent ids of the resource filters; returns those matching none.
+string OfferFilteringHierarchicalDRFAllocatorProcess::resolveRemovals(
+    const std::vector<FilterSpec>& removals,
+    hashset<string>* keys,
+    hashset<string>* resources)
+{
+    ostringstream errMsg;
+
+    foreach (const FilterSpec& removal, removals) {
+        if (removal.selector.isSome()) {
+            string key = selectorKey(removal.selector.get());
+            if (selectors.contains(key) || scheduledFilters.contains(key)) {
+                keys->insert(key);
+            } else {
+                errMsg << ", [" << key << "]";
+            }
+            continue;
+        }
+
+        bool found = false;
+        Option<SlaveID> slaveId = findSlaveID(removal.agentId, removal.hostname);
+        if (slaveId.isSome()) {
+            string key = agentFilterKey(slaveId.get().value());
+            if (filteredAgents.contains(slaveId.get()) || scheduledFilters.contains(key)) {
+                keys->insert(key);
+                found = true;
+            }
+            if (resourceFilters.contains(slaveId.get().value())) {
+                resources->insert(slaveId.get().value());
+                found = true;
+            }
+            // A filter scheduled by hostname stays keyed by it until it starts
+            if (!removal.hostname.empty()) {
+                string hostnameKey = hostnameFilterKey(removal.hostname);
+                if (pendingHostnameFilters.contains(removal.hostname) || scheduledFilters.contains(hostnameKey)) {
+                    keys->insert(hostnameKey);
+                    found = true;
+                }
+            }
+        } else if (!removal.agentId.empty()) {
+            // The filter may still be pending the re-registration of its agent, or its start
+            string key = agentFilterKey(removal.agentId);
+            if (pendingFilters.contains(removal.agentId) || scheduledFilters.contains(key)) {
+                keys->insert(key);
+                found = true;
+            }
+            if (resourceFilters.contains(removal.agentId)) {
+                resources->insert(removal.agentId);
+                found = true;
+            }
+        } else {
+            string key = hostnameFilterKey(removal.hostname);
+            if (pendingHostnameFilters.contains(removal.hostname) || scheduledFilters.contains(key)) {
+                keys->insert(key);
+                found = true;
+            }
+            foreachpair (const string& agentId, const string& hostname, pendingFilters) {
+                if (hostname == removal.hostname) {
+                    keys->insert(agentFilterKey(agentId));
+                    found = true;
+                }
+            }
+            foreachpair (const string& agentId, const ResourceFilter& filter, resourceFilters) {
+                if (filter.hostname == removal.hostname) {
+                    resources->insert(agentId);
+                    found = true;
+                }
+            }
+        }
+
+        if (!found) {
+            errMsg << ", [";
+            if (!removal.hostname.empty()) {
+                errMsg << "hostname == " << removal.hostname;
+            }
+            if (!removal.hostname.empty() && !removal.agentId.empty()) {
+                errMsg << " && ";
+            }
+            if (!removal.agentId.empty()) {
+                errMsg << "agentId: " << removal.agentId;
+            }
+            errMsg << "]";
+        }
+    }
+
+    return !errMsg.str().empty() ? errMsg.str().substr(2) : "";
+}
+
+// Replaces the active filters with the specified set; returns the number of
+// agents whose activation state changed.
+size_t OfferFilteringHierarchicalDRFAllocatorProcess::applyFilters(const hashset<SlaveID>& agentIds)
+{
+    hashset<SlaveID> added;
+    foreach (const SlaveID& agentId, agentIds) {
+        if (!filteredAgents.contains(agentId)) {
+            added.insert(agentId);
+        }
+    }
+
+    hashset<SlaveID> removed;
+    foreach (const SlaveID& agentId, filteredAgents) {
+        if (!agentIds.contains(agentId)) {
+            removed.insert(agentId);
+        }
+    }
+
+    return applyFilterDelta(added, removed);
+}
+
+// Adds and removes filters, only calling into the DRF allocator for those agents
+// whose activation state actually changes; returns the number of such transitions.
+size_t OfferFilteringHierarchicalDRFAllocatorProcess::applyFilterDelta(
+    const hashset<SlaveID>& added,
+    const hashset<SlaveID>& removed)
+{
+    size_t transitions = 0;
+
+    foreach (const SlaveID& agentId, added) {
+        if (filteredAgents.insert(agentId).second) {
+            if (!filterStarts.contains(agentFilterKey(agentId.value()))) {
+                filterStarts.put(agentFilterKey(agentId.value()), Clock::now());
+            }
+            filtersChanged(FILTER_ADDED, describeFilter(
+                filterJSON(agentId.value(), this->slaves.at(agentId).hostname),
+                agentFilterKey(agentId.value())));
+        }
+        dirtyAgentFilters.insert(agentId.value());
+        updateExclusions(agentId);
+        updateCapacity(agentId);
+        if (isFiltered(agentId) && this->slaves.at(agentId).activated) {
+            HierarchicalDRFAllocatorProcess::deactivateSlave(agentId);
+            ++transitions;
+        }
+    }
+
+    hashset<SlaveID> reactivated;
+    hashset<SlaveID> released;
+    foreach (const SlaveID& agentId, removed) {
+        if (filteredAgents.erase(agentId) > 0) {
+            filtersChanged(FILTER_REMOVED, filterJSON(agentId.value(), this->slaves.at(agentId).hostname));
+            forgetFilter(agentFilterKey(agentId.value()));
+        }
+        dirtyAgentFilters.insert(agentId.value());
+        if (updateExclusions(agentId)) {
+            released.insert(agentId);
+        }
+        updateCapacity(agentId);
+        if (!deactivatedAgents.contains(agentId) && !isFiltered(agentId)) {
+            reactivated.insert(agentId);
+        }
+    }
+    transitions += activateSlaves(reactivated);
+    offerReleased(released);
+    filterMetrics.apply_transitions += transitions;
+
+    LOG(INFO) << "Applied filters (+" << added.size() << "/-" << removed.size() << "); "
+              << transitions << " agent transition(s)";
+    return transitions;
+}
+
+size_t OfferFilteringHierarchicalDRFAllocatorProcess::activateSlaves(const hashset<SlaveID>& slaveIds)
+{
+    hashset<SlaveID> activated;
+    foreach (const SlaveID& slaveId, slaveIds) {
+        Slave& agent = this->slaves.at(slaveId);
+        if (!agent.activated) {
+            agent.activated = true;
+            activated.insert(slaveId);
+        }
+    }
+
+    if (!activated.empty()) {
+        LOG(INFO) << "Re-activated " << activated.size() << " agent(s)";
+        allocate(activated);
+    }
+    return activated.size();
+}
+
+// Whether any filter (by name or by selector) without a scope applies to the
+// agent, i.e., it is withheld from every framework
+bool OfferFilteringHierarchicalDRFAllocatorProcess::isFiltered(
+    const SlaveID& slaveId,
+    const Option<string>& ignored) const
+{
+    hashset<string> ignored_;
+    if (ignored.isSome()) {
+        ignored_.insert(ignored.get());
+    }
+    return isFiltered(slaveId, ignored_);
+}
+
+bool OfferFilteringHierarchicalDRFAllocatorProcess::isFiltered(
+    const SlaveID& slaveId,
+    const hashset<string>& ignored) const
+{
+    string agentKey = agentFilterKey(slaveId.value());
+    if (filteredAgents.contains(slaveId) && !filterScopes.contains(agentKey) &&
+            !ignored.contains(agentKey)) {
+        return true;
+    }
+
+    Option<hashset<string>> keys = agentSelectors.get(slaveId);
+    if (keys.isSome()) {
+        foreach (const string& key, keys.get()) {
+            if (!filterScopes.contains(key) && !ignored.contains(key)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Compiles the pattern as an extended regular expression anchored at both ends,
+// as hostnameRegex selectors match whole hostnames. The \\d and \\D shorthands,
+// which POSIX lacks, are rewritten outside bracket expressions.
+Try<HostnameRegex> HostnameRegex::compile(const string& pattern)
+{
+    string expression = "^(";
+    size_t i = 0;
+    while (i < pattern.size()) {
+        if (pattern[i] == '[') {
+            // Copied through as is, including a leading '^' and a ']' right
+            // after it (which is a literal)
+            size_t end = i + 1;
+            if (end < pattern.size() && pattern[end] == '^') {
+                ++end;
+            }
+            if (end < pattern.size() && pattern[end] == ']') {
+                ++end;
+            }
+            end = std::min(pattern.find(']', end), pattern.size() - 1);
+            expression += pattern.substr(i, end - i + 1);
+            i = end + 1;
+        } else if (pattern[i] == '\\' && i + 1 < pattern.size()) {
+            char next = pattern[i + 1];
+            if (next == 'd') {
+                expression += "[0-9]";
+            } else if (next == 'D') {
+                expression += "[^0-9]";
+            } else {
+                expression += pattern.substr(i, 2);
+            }
+            i += 2;
+        } else {
+            expression += pattern[i++];
+        }
+    }
+    expression += ")$";
+
+    std::unique_ptr<regex_t> compiled(new regex_t);
+    int error = regcomp(compiled.get(), expression.c_str(), REG_EXTENDED | REG_NOSUB);
+    if (error != 0) {
+        char message[256];
+        regerror(error, compiled.get(), message, sizeof(message));
+        return Error(message);
+    }
+
+    return HostnameRegex(std::shared_ptr<regex_t>(compiled.release(), [](regex_t* regex) {
+        regfree(regex);
+        delete regex;
+    }));
+}
+
+bool HostnameRegex::matches(const string& hostname) const
+{
+    return regexec(regex.get(), hostname.c_str(), 0, nullptr, 0) == 0;
+}
+
+// Compiles a selector of the specified type (one of SELECTOR_TYPES)
+Try<FilterSelector> OfferFilteringHierarchicalDRFAllocatorProcess::createSelector(
+    const string& type,
+    const string& value)
+{
+    if (value.empty()) {
+        return Error("'" + type + "' must not be empty");
+    }
+
+    FilterSelector selector;
+    selector.type = type;
+    selector.value = value;
+
+    if (type == ATTRIBUTE_SELECTOR) {
+        if (value.find(':') == string::npos) {
+            return Error("'" + type + "' must be of the form NAME:VALUE");
+        }
+    } else if (type == DOMAIN_SELECTOR) {
+        selector.value = strings::trim(value, ".");
+    } else if (type == HOSTNAME_REGEX_SELECTOR) {
+        Try<HostnameRegex> regex = HostnameRegex::compile(value);
+        if (regex.isError()) {
+            return Error("Invalid '" + type + "' " + value + ": " + regex.error());
+        }
+        selector.regex = regex.get();
+    } else if (type != HOSTNAME_PATTERN_SELECTOR) {
+        return Error("Unknown selector '" + type + "'");
+    }
+    return selector;
+}
+
+// Finds the (single) selector named by the specified filter attributes, if any
+Result<FilterSelector> OfferFilteringHierarchicalDRFAllocatorProcess::findSelector(
+    const hashmap<string, string>& values)
+{
+    Option<string> type;
+    foreach (const string& type_, SELECTOR_TYPES) {
+        if (values.contains(type_)) {
+            if (type.isSome()) {
+                return Error("Specify only one of '" + type.get() + "' or '" + type_ + "'");
+            }
+            type = type_;
+        }
+    }
+
+    if (type.isNone()) {
+        return None();
+    } else if (values.contains("agentId") || values.contains("hostname")) {
+        return Error("'" + type.get() + "' cannot be combined with 'agentId' or 'hostname'");
+    }
+
+    Try<FilterSelector> selector = createSelector(type.get(), values.at(type.get()));
+    if (selector.isError()) {
+        return Error(selector.error());
+    }
+    return selector.get();
+}
+
+bool OfferFilteringHierarchicalDRFAllocatorProcess::matchesSelector(
+    const FilterSelector& selector,
+    const SlaveID& slaveId) const
+{
+    const string& hostname = this->slaves.at(slaveId).hostname;
+
+    if (selector.type == HOSTNAME_PATTERN_SELECTOR) {
+        return fnmatch(selector.value.c_str(), hostname.c_str(), 0) == 0;
+    } else if (selector.type == HOSTNAME_REGEX_SELECTOR) {
+        return selector.regex.get().matches(hostname);
+    }
+
+    // Attribute and domain selectors are resolved through the agent indexes
+    Option<hashset<SlaveID>> indexed = selector.type == ATTRIBUTE_SELECTOR
+        ? agentsByAttribute.get(selector.value)
+        : agentsByDomain.get(selector.value);
+    return indexed.isSome() && indexed.get().contains(slaveId);
+}
+
+// Adds a selector, filtering every agent it currently matches; returns the
+// number of agents whose activation state changed.
+size_t OfferFilteringHierarchicalDRFAllocatorProcess::addSelector(FilterSelector selector)
+{
+    string key = selectorKey(selector);
+    if (selectors.contains(key)) {
+        return 0;
+    }
+
+    hashset<SlaveID> matched = matchingAgents(selector);
+    if (selector.type != ATTRIBUTE_SELECTOR && selector.type != DOMAIN_SELECTOR) {
+        patternSelectors.insert(key);
+    }
+
+    selectors.put(key, selector);
+    if (!filterStarts.contains(key)) {
+        filterStarts.put(key, Clock::now());
+    }
+    dirtySelectors.insert(key);
+    filtersChanged(FILTER_ADDED, selectorJSON(selector));
+
+    size_t transitions = 0;
+    foreach (const SlaveID& slaveId, matched) {
+        if (selectAgent(key, slaveId)) {
+            ++transitions;
+        }
+    }
+
+    filterMetrics.apply_transitions += transitions;
+    LOG(INFO) << "Added filter " << key << " matching " << matched.size() << " agent(s); "
+              << transitions << " agent transition(s)";
+    return transitions;
+}
+
+hashset<SlaveID> OfferFilteringHierarchicalDRFAllocatorProcess::matchingAgents(
+    const FilterSelector& selector) const
+{
+    Option<FilterSelector> active = selectors.get(selectorKey(selector));
+    if (active.isSome()) {
+        return active.get().agents;
+    } else if (selector.type == ATTRIBUTE_SELECTOR) {
+        return agentsByAttribute.get(selector.value).getOrElse(hashset<SlaveID>());
+    } else if (selector.type == DOMAIN_SELECTOR) {
+        return agentsByDomain.get(selector.value).getOrElse(hashset<SlaveID>());
+    }
+
+    hashset<SlaveID> matched;
+    foreachkey (const SlaveID& slaveId, this->slaves) {
+        if (matchesSelector(selector, slaveId)) {
+            matched.insert(slaveId);
+        }
+    }
+    return matched;
+}
+
+// Removes a selector, re-activating the agents no other filter applies to
+size_t OfferFilteringHierarchicalDRFAllocatorProcess::removeSelector(const string& key)
+{
+    Option<FilterSelector> selector = selectors.get(key);
+    if (selector.isNone()) {
+        return 0;
+    }
+
+    filtersChanged(FILTER_REMOVED, describeFilter(selectorJSON(selector.get()), key));
+    selectors.erase(key);
+    patternSelectors.erase(key);
+    forgetFilter(key);
+    dirtySelectors.insert(key);
+
+    hashset<SlaveID> reactivated;
+    hashset<SlaveID> released;
+    foreach (const SlaveID& slaveId, selector.get().agents) {
+        hashset<string>& keys = agentSelectors.at(slaveId);
+        keys.erase(key);
+        if (keys.empty()) {
+            agentSelectors.erase(slaveId);
+        }
+        if (updateExclusions(slaveId)) {
+            released.insert(slaveId);
+        }
+        updateCapacity(slaveId);
+        if (!deactivatedAgents.contains(slaveId) && !isFiltered(slaveId)) {
+            reactivated.insert(slaveId);
+        }
+    }
+    size_t transitions = activateSlaves(reactivated);
+    offerReleased(released);
+    filterMetrics.apply_transitions += transitions;
+
+    LOG(INFO) << "Removed filter " << key << "; " << transitions << " agent transition(s)";
+    return transitions;
+}
+
+// Records that the selector matches the agent, deactivating the agent if needed;
+// returns whether the agent was deactivated.
+bool OfferFilteringHierarchicalDRFAllocatorProcess::selectAgent(
+    const string& key,
+    const SlaveID& slaveId)
+{
+    selectors.at(key).agents.insert(slaveId);
+    agentSelectors[slaveId].insert(key);
+    updateExclusions(slaveId);
+    updateCapacity(slaveId);
+
+    if (isFiltered(slaveId) && this->slaves.at(slaveId).activated) {
+        HierarchicalDRFAllocatorProcess::deactivateSlave(slaveId);
+        return true;
+    }
+    return false;
+}
+
+// Applies the selectors matching a newly added agent: attribute and domain
+// selectors are looked up by the agent's attributes and domains, and only
+// hostname patterns are evaluated.
+void OfferFilteringHierarchicalDRFAllocatorProcess::matchSelectors(const SlaveID& slaveId)
+{
+    if (selectors.empty()) {
+        return;
+    }
+
+    vector<string> keys;
+    foreach (const string& attribute, agentAttributes.get(slaveId).getOrElse(vector<string>())) {
+        keys.push_back(ATTRIBUTE_SELECTOR + ":" + attribute);
+    }
+    foreach (const string& domain, hostnameDomains(this->slaves.at(slaveId).hostname)) {
+        keys.push_back(DOMAIN_SELECTOR + ":" + domain);
+    }
+    foreach (const string& key, patternSelectors) {
+        if (matchesSelector(selectors.at(key), slaveId)) {
+            keys.push_back(key);
+        }
+    }
+
+    foreach (const string& key, keys) {
+        if (selectors.contains(key)) {
+            LOG(INFO) << "Filter " << key << " matches newly added agent " << slaveId;
+            selectAgent(key, slaveId);
+        }
+    }
+}
+
+// Adds the filter's startsAt/expiresAt and roles/frameworks (if any)
+JSON::Object OfferFilteringHierarchicalDRFAllocatorProcess::describeFilter(
+    JSON::Object filter,
+    const string& key) const
+{
+    Option<FilterSchedule> schedule = filterSchedules.get(key);
+    if (schedule.isSome()) {
+        if (schedule.get().startsAt.isSome()) {
+            filter.values["startsAt"] = formatTime(schedule.get().startsAt.get());
+        }
+        if (schedule.get().expiresAt.isSome()) {
+            filter.values["expiresAt"] = formatTime(schedule.get().expiresAt.get());
+        }
+    }
+
+    Option<FilterScope> scope = filterScopes.get(key);
+    if (scope.isSome()) {
+        if (!scope.get().roles.empty()) {
+            JSON::Array roles;
+            foreach (const string& role, scope.get().roles) {
+                roles.values.push_back(role);
+            }
+            filter.values[ROLES_SCOPE] = roles;
+        }
+        if (!scope.get().frameworks.empty()) {
+            JSON::Array frameworks;
+            foreach (const string& frameworkId, scope.get().frameworks) {
+                frameworks.values.push_back(frameworkId);
+            }
+            filter.values[FRAMEWORKS_SCOPE] = frameworks;
+        }
+    }
+    return filter;
+}
+
+// Adds the filter's schedule, start and scope (if any) to its stored identity
+StoredFilter OfferFilteringHierarchicalDRFAllocatorProcess::storedFilter(
+    StoredFilter filter,
+    const string& key) const
+{
+    Option<FilterSchedule> schedule = filterSchedules.get(key);
+    if (schedule.isSome()) {
+        if (schedule.get().startsAt.isSome()) {
+            filter.set_starts_at(static_cast<int64_t>(schedule.get().startsAt.get().secs()));
+        }
+        if (schedule.get().expiresAt.isSome()) {
+            filter.set_expires_at(static_cast<int64_t>(schedule.get().expiresAt.get().secs()));
+        }
+    }
+
+    Option<Time> started = filterStarts.get(key);
+    if (started.isSome()) {
+        filter.set_started_at(static_cast<int64_t>(started.get().secs()));
+    }
+
+    Option<FilterScope> scope = filterScopes.get(key);
+    if (scope.isSome()) {
+        foreach (const string& role, scope.get().roles) {
+            filter.add_roles(role);
+        }
+        foreach (const string& frameworkId, scope.get().frameworks) {
+            filter.add_frameworks(frameworkId);
+        }
+    }
+    return filter;
+}
+
+// The filter a stored entry holds, as the API would have parsed it
+Try<FilterSpec> OfferFilteringHierarchicalDRFAllocatorProcess::parseStoredFilter(const StoredFilter& stored)
+{
+    FilterSpec filter;
+    filter.agentId = stored.agent_id();
+    filter.hostname = stored.hostname();
+
+    if (stored.has_selector_type()) {
+        Try<FilterSelector> selector = createSelector(stored.selector_type(), stored.selector_value());
+        if (selector.isError()) {
+            return Error(selector.error());
+        }
+        filter.selector = selector.get();
+    }
+
+    if (stored.has_starts_at()) {
+        Try<Time> startsAt = Time::create(static_cast<double>(stored.starts_at()));
+        if (startsAt.isError()) {
+            return Error("Invalid 'startsAt': " + startsAt.error());
+        }
+        filter.schedule.startsAt = startsAt.get();
+    }
+    if (stored.has_expires_at()) {
+        Try<Time> expiresAt = Time::create(static_cast<double>(stored.expires_at()));
+        if (expiresAt.isError()) {
+            return Error("Invalid 'expiresAt': " + expiresAt.error());
+        }
+        filter.schedule.expiresAt = expiresAt.get();
+    }
+    if (stored.has_started_at()) {
+        Try<Time> startedAt = Time::create(static_cast<double>(stored.started_at()));
+        if (startedAt.isError()) {
+            return Error("Invalid 'started_at': " + startedAt.error());
+        }
+        filter.startedAt = startedAt.get();
+    }
+
+    if (stored.roles_size() > 0 || stored.frameworks_size() > 0) {
+        FilterScope scope;
+        scope.roles.insert(stored.roles().begin(), stored.roles().end());
+        scope.frameworks.insert(stored.frameworks().begin(), stored.frameworks().end());
+        filter.scope = scope;
+    }
+
+    if (stored.has_resources() || stored.resource_names_size() > 0) {
+        ResourceFilter resourceFilter;
+        if (stored.has_resources()) {
+            Try<Resources> resources = Resources::parse(stored.resources());
+            if (resources.isError()) {
+                return Error("Invalid '" + RESOURCES_FILTER + "': " + resources.error());
+            }
+            resourceFilter.text = stored.resources();
+            resourceFilter.resources = resources.get();
+        }
+        resourceFilter.names.insert(stored.resource_names().begin(), stored.resource_names().end());
+        filter.resourceFilter = resourceFilter;
+    }
+    return filter;
+}
+
+// Reads the optional 'startsAt', and 'expiresAt' or 'ttl' (relative to the start) of a filter
+Try<FilterSchedule> OfferFilteringHierarchicalDRFAllocatorProcess::parseSchedule(
+    const hashmap<string, string>& values)
+{
+    FilterSchedule schedule;
+
+    if (values.contains("startsAt")) {
+        Try<Time> startsAt = parseTime(values.at("startsAt"));
+        if (startsAt.isError()) {
+            return Error("Invalid 'startsAt': " + startsAt.error());
+        }
+        schedule.startsAt = startsAt.get();
+    }
+
+    if (values.contains("expiresAt") && values.contains("ttl")) {
+        return Error("Specify 'expiresAt' or 'ttl', but not both");
+    } else if (values.contains("expiresAt")) {
+        Try<Time> expiresAt = parseTime(values.at("expiresAt"));
+        if (expiresAt.isError()) {
+            return Error("Invalid 'expiresAt': " + expiresAt.error());
+        }
+        schedule.expiresAt = expiresAt.get();
+    } else if (values.contains("ttl")) {
+        Try<Duration> ttl = Duration::parse(values.at("ttl"));
+        if (ttl.isError()) {
+            return Error("Invalid 'ttl': " + ttl.error());
+        }
+        schedule.expiresAt = schedule.startsAt.getOrElse(Clock::now()) + ttl.get();
+    }
+
+    if (schedule.expiresAt.isSome()) {
+        if (schedule.expiresAt.get() <= Clock::now()) {
+            return Error("The filter would already have expired");
+        } else if (schedule.startsAt.isSome() &&
+                schedule.expiresAt.get() <= schedule.startsAt.get()) {
+            return Error("'expiresAt' must be after 'startsAt'");
+        }
+    }
+    return schedule;
+}
+
+// Records when the filter starts and expires; a filter which starts later is
+// held until then, in which case this returns true and the caller must not
+// apply it.
+bool OfferFilteringHierarchicalDRFAllocatorProcess::scheduleFilter(
+    const string& key,
+    const JSON::Object& filter,
+    FilterSchedule schedule)
+{
+    // A filter which is already in effect has started
+    bool active = hasActiveFilter(key);
+    if (schedule.startsAt.isSome() && (schedule.startsAt.get() <= Clock::now() || active)) {
+        schedule.startsAt = None();
+    }
+
+    string before = stringify(describeFilter(filter, key));
+    removeScheduledFilter(key);
+    filterSchedules.erase(key);
+    if (schedule.startsAt.isSome() || schedule.expiresAt.isSome()) {
+        filterSchedules.put(key, schedule);
+    }
+
+    if (active && stringify(describeFilter(filter, key)) != before) {
+        filtersChanged(FILTER_UPDATED, describeFilter(filter, key));
+    }
+    markDirty(key);
+
+    if (schedule.startsAt.isNone() && schedule.expiresAt.isNone()) {
+        return false;
+    }
+
+    if (schedule.startsAt.isSome()) {
+        filterDeadlines.push(std::make_pair(schedule.startsAt.get(), key));
+    }
+    if (schedule.expiresAt.isSome()) {
+        filterDeadlines.push(std::make_pair(schedule.expiresAt.get(), key));
+    }
+    armFilterTimer();
+
+    if (schedule.startsAt.isSome()) {
+        scheduledFilters.put(key, filter);
+        filtersChanged(FILTER_ADDED, describeFilter(filter, key));
+        LOG(INFO) << "Scheduled filter " << key << " to start at " << formatTime(schedule.startsAt.get());
+        return true;
+    }
+    return false;
+}
+
+// Whether the filter is in effect (including filters pending their agent)
+bool OfferFilteringHierarchicalDRFAllocatorProcess::hasActiveFilter(const string& key) const
+{
+    if (strings::startsWith(key, AGENT_FILTER_KEY_PREFIX)) {
+        string agentId = key.substr(AGENT_FILTER_KEY_PREFIX.size());
+        Option<SlaveID> slaveId = agentIdsByString.get(agentId);
+        return (slaveId.isSome() && filteredAgents.contains(slaveId.get())) ||
+            pendingFilters.contains(agentId);
+    } else if (strings::startsWith(key, HOSTNAME_FILTER_KEY_PREFIX)) {
+        return pendingHostnameFilters.contains(key.substr(HOSTNAME_FILTER_KEY_PREFIX.size()));
+    }
+    return selectors.contains(key);
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::markDirty(const string& key)
+{
+    if (strings::startsWith(key, AGENT_FILTER_KEY_PREFIX)) {
+        dirtyAgentFilters.insert(key.substr(AGENT_FILTER_KEY_PREFIX.size()));
+    } else if (strings::startsWith(key, HOSTNAME_FILTER_KEY_PREFIX)) {
+        dirtyHostnameFilters.insert(key.substr(HOSTNAME_FILTER_KEY_PREFIX.size()));
+    } else {
+        dirtySelectors.insert(key);
+    }
+}
+
+// Drops a filter which has not yet started; returns whether there was one
+bool OfferFilteringHierarchicalDRFAllocatorProcess::removeScheduledFilter(const string& key)
+{
+    Option<JSON::Object> filter = scheduledFilters.get(key);
+    if (filter.isNone()) {
+        return false;
+    }
+
+    filtersChanged(FILTER_REMOVED, describeFilter(filter.get(), key));
+    scheduledFilters.erase(key);
+    forgetFilter(key);
+    markDirty(key);
+    return true;
+}
+
+bool OfferFilteringHierarchicalDRFAllocatorProcess::removePendingFilter(const string& agentId)
+{
+    auto it = pendingFilters.find(agentId);
+    if (it == pendingFilters.end()) {
+        return false;
+    }
+
+    filtersChanged(FILTER_REMOVED, filterJSON(it->first, it->second));
+    pendingFilters.erase(it);
+    forgetFilter(agentFilterKey(agentId));
+    dirtyAgentFilters.insert(agentId);
+    return true;
+}
+
+bool OfferFilteringHierarchicalDRFAllocatorProcess::removePendingHostnameFilter(const string& hostname)
+{
+    if (pendingHostnameFilters.erase(hostname) == 0) {
+        return false;
+    }
+
+    filtersChanged(FILTER_REMOVED, filterJSON("", hostname));
+    forgetFilter(hostnameFilterKey(hostname));
+    dirtyHostnameFilters.insert(hostname);
+    return true;
+}
+
+// Arms the single timer driving every filter start and expiry for the earliest
+// deadline; deadlines are kept in a min-heap, where those of filters which were
+// since removed or re-scheduled are skipped as they come up.
+void OfferFilteringHierarchicalDRFAllocatorProcess::armFilterTimer()
+{
+    if (filterDeadlines.empty()) {
+        return;
+    }
+
+    Time deadline = filterDeadlines.top().first;
+    if (filterTimerDeadline.isSome() && filterTimerDeadline.get() <= deadline) {
+        return;
+    }
+
+    filterTimerDeadline = deadline;
+    Duration wait = std::max(deadline - Clock::now(), Duration::zero());
+    delay(wait, self(), &OfferFilteringHierarchicalDRFAllocatorProcess::applyFilterSchedules, ++filterTimer);
+}
+
+// Starts and expires every filter whose time has come, as one batch
+void OfferFilteringHierarchicalDRFAllocatorProcess::applyFilterSchedules(uint64_t timer)
+{
+    // Superseded by a timer armed for an earlier deadline
+    if (timer != filterTimer) {
+        return;
+    }
+    filterTimerDeadline = None();
+
+    Time now = Clock::now();
+    hashset<SlaveID> added;
+    hashset<SlaveID> removed;
+    size_t started = 0;
+    size_t expired = 0;
+
+    // The capacity withheld by the agent filters started so far, which are
+    // applied along with the batch
+    Capacity starting;
+
+    while (!filterDeadlines.empty() && filterDeadlines.top().first <= now) {
+        Time deadline = filterDeadlines.top().first;
+        string key = filterDeadlines.top().second;
+        filterDeadlines.pop();
+
+        Option<FilterSchedule> schedule = filterSchedules.get(key);
+        if (schedule.isNone()) {
+            continue;
+        } else if (schedule.get().startsAt == deadline && scheduledFilters.contains(key)) {
+            hashset<SlaveID> agents = startingAgents(key);
+            foreach (const SlaveID& slaveId, added) {
+                agents.erase(slaveId);
+            }
+            Capacity change = filteringCapacity(agents);
+            addCapacity(&change, starting, 1);
+            Option<string> violation = checkGuardRails(change);
+            if (violation.isSome()) {
+                deferFilterStart(key, violation.get());
+                continue;
+            }
+
+            if (strings::startsWith(key, AGENT_FILTER_KEY_PREFIX) ||
+                    strings::startsWith(key, HOSTNAME_FILTER_KEY_PREFIX)) {
+                starting = change;
+            }
+            startFilter(key, &added);
+            ++started;
+        } else if (schedule.get().expiresAt == deadline) {
+            expireFilter(key, &removed);
+            ++expired;
+        }
+    }
+
+    if (started > 0 || expired > 0) {
+        // Agents with a filter both starting and expiring end up unfiltered
+        foreach (const SlaveID& slaveId, removed) {
+            added.erase(slaveId);
+        }
+
+        LOG(INFO) << "Started " << started << " and expired " << expired << " filter(s)";
+        applyFilterDelta(added, removed);
+        persistFilteredAgents();
+    }
+
+    armFilterTimer();
+}
+
+// Agents filtered by a scoped filter, or already filtered, withhold no more
+hashset<SlaveID> OfferFilteringHierarchicalDRFAllocatorProcess::startingAgents(const string& key)
+{
+    hashset<SlaveID> agents;
+    if (filterScopes.contains(key)) {
+        return agents;
+    }
+
+    hashmap<string, string> values = stringValues(scheduledFilters.at(key));
+    Result<FilterSelector> selector = findSelector(values);
+    if (selector.isSome()) {
+        agents = matchingAgents(selector.get());
+    } else if (selector.isNone()) {
+        Option<SlaveID> slaveId = findSlaveID(
+            values.get("agentId").getOrElse(""), values.get("hostname").getOrElse(""));
+        if (slaveId.isSome()) {
+            agents.insert(slaveId.get());
+        }
+    }
+    return agents;
+}
+
+// Holds back the start of a filter which would exceed a guard rail, retrying it
+// later; one which would expire by then is dropped
+void OfferFilteringHierarchicalDRFAllocatorProcess::deferFilterStart(
+    const string& key,
+    const string& violation)
+{
+    FilterSchedule schedule = filterSchedules.at(key);
+    Time retry = Clock::now() + GUARD_RAIL_RETRY_INTERVAL;
+    if (schedule.expiresAt.isSome() && schedule.expiresAt.get() <= retry) {
+        LOG(WARNING) << "Dropped filter " << key << ", which expires before it could start: " << violation;
+        removeScheduledFilter(key);
+        persistFilteredAgents();
+        return;
+    }
+
+    LOG(WARNING) << "Deferred the start of filter " << key << " to " << formatTime(retry) << ": " << violation;
+    schedule.startsAt = retry;
+    filterSchedules.put(key, schedule);
+    filterDeadlines.push(std::make_pair(retry, key));
+    filtersChanged(FILTER_UPDATED, describeFilter(scheduledFilters.at(key), key));
+    markDirty(key);
+    persistFilteredAgents();
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::startFilter(
+    const string& key,
+    hashset<SlaveID>* added)
+{
+    JSON::Object filter = scheduledFilters.at(key);
+    FilterSchedule schedule = filterSchedules.at(key);
+    Option<FilterScope> scope = filterScopes.get(key);
+    removeScheduledFilter(key);
+
+    // The filter remains bounded by its expiry and scope, if any
+    schedule.startsAt = None();
+    if (schedule.expiresAt.isSome()) {
+        filterSchedules.put(key, schedule);
+    }
+    if (scope.isSome()) {
+        filterScopes.put(key, scope.get());
+    }
+
+    hashmap<string, string> values = stringValues(filter);
+    Result<FilterSelector> selector = findSelector(values);
+    if (selector.isError()) {
+        LOG(ERROR) << "Failed to start filter " << key << ": " << selector.error();
+        return;
+    } else if (selector.isSome()) {
+        addSelector(selector.get());
+        return;
+    }
+
+    string agentId = values.get("agentId").getOrElse("");
+    string hostname = values.get("hostname").getOrElse("");
+    Option<SlaveID> slaveId = findSlaveID(agentId, hostname);
+    if (slaveId.isSome()) {
+        // The filter now names the agent it resolved to
+        moveFilter(key, agentFilterKey(slaveId.get().value()));
+        added->insert(slaveId.get());
+    } else if (!agentId.empty()) {
+        pendingFilters[agentId] = hostname;
+        dirtyAgentFilters.insert(agentId);
+        filtersChanged(FILTER_ADDED, describeFilter(filterJSON(agentId, hostname), key));
+    } else {
+        pendingHostnameFilters.insert(hostname);
+        dirtyHostnameFilters.insert(hostname);
+        filtersChanged(FILTER_ADDED, describeFilter(filterJSON("", hostname), key));
+    }
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::expireFilter(
+    const string& key,
+    hashset<SlaveID>* removed)
+{
+    LOG(INFO) << "Filter " << key << " expired";
+
+    if (strings::startsWith(key, AGENT_FILTER_KEY_PREFIX)) {
+        string agentId = key.substr(AGENT_FILTER_KEY_PREFIX.size());
+        Option<SlaveID> slaveId = agentIdsByString.get(agentId);
+        if (slaveId.isSome() && filteredAgents.contains(slaveId.get())) {
+            removed->insert(slaveId.get());
+        } else {
+            removePendingFilter(agentId);
+        }
+    } else if (strings::startsWith(key, HOSTNAME_FILTER_KEY_PREFIX)) {
+        removePendingHostnameFilter(key.substr(HOSTNAME_FILTER_KEY_PREFIX.size()));
+    } else {
+        removeSelector(key);
+    }
+    filterSchedules.erase(key);
+}
+
+// Drops the schedule and scope of a removed filter
+void OfferFilteringHierarchicalDRFAllocatorProcess::forgetFilter(const string& key)
+{
+    filterStarts.erase(key);
+    filterSchedules.erase(key);
+    filterScopes.erase(key);
+}
+
+// Carries the schedule, start and scope of a filter over to the key it now resolves to
+void OfferFilteringHierarchicalDRFAllocatorProcess::moveFilter(const string& from, const string& to)
+{
+    if (from == to) {
+        return;
+    }
+
+    Option<FilterSchedule> schedule = filterSchedules.get(from);
+    if (schedule.isSome()) {
+        filterSchedules.erase(from);
+        filterSchedules.put(to, schedule.get());
+        if (schedule.get().expiresAt.isSome()) {
+            filterDeadlines.push(std::make_pair(schedule.get().expiresAt.get(), to));
+        }
+    }
+
+    Option<Time> started = filterStarts.get(from);
+    if (started.isSome()) {
+        filterStarts.erase(from);
+        filterStarts.put(to, started.get());
+    }
+
+    Option<FilterScope> scope = filterScopes.get(from);
+    if (scope.isSome()) {
+        filterScopes.erase(from);
+        filterScopes.put(to, scope.get());
+    }
+}
+
+// Sets (or clears) the roles and frameworks a filter applies to, re-evaluating
+// the agents it currently covers
+void OfferFilteringHierarchicalDRFAllocatorProcess::scopeFilter(
+    const string& key,
+    const JSON::Object& filter,
+    const Option<FilterScope>& scope)
+{
+    if (sameScope(filterScopes.get(key), scope)) {
+        return;
+    }
+
+    if (scope.isSome()) {
+        filterScopes.put(key, scope.get());
+    } else {
+        filterScopes.erase(key);
+    }
+    markDirty(key);
+
+    if (hasActiveFilter(key) || scheduledFilters.contains(key)) {
+        filtersChanged(FILTER_UPDATED, describeFilter(filter, key));
+    }
+    refreshAgents(scopedAgents(key));
+}
+
+// The registered agents a filter currently covers
+hashset<SlaveID> OfferFilteringHierarchicalDRFAllocatorProcess::scopedAgents(const string& key) const
+{
+    if (strings::startsWith(key, AGENT_FILTER_KEY_PREFIX)) {
+        Option<SlaveID> slaveId = agentIdsByString.get(key.substr(AGENT_FILTER_KEY_PREFIX.size()));
+        hashset<SlaveID> agents;
+        if (slaveId.isSome() && filteredAgents.contains(slaveId.get())) {
+            agents.insert(slaveId.get());
+        }
+        return agents;
+    } else if (selectors.contains(key)) {
+        return selectors.at(key).agents;
+    }
+    return hashset<SlaveID>();
+}
+
+// Brings the activation state and exclusions of the agents in line with the
+// (scoped or unscoped) filters covering them
+void OfferFilteringHierarchicalDRFAllocatorProcess::refreshAgents(const hashset<SlaveID>& slaveIds)
+{
+    hashset<SlaveID> reactivated;
+    hashset<SlaveID> released;
+    foreach (const SlaveID& slaveId, slaveIds) {
+        if (updateExclusions(slaveId)) {
+            released.insert(slaveId);
+        }
+        updateCapacity(slaveId);
+
+        Slave& agent = this->slaves.at(slaveId);
+        if (isFiltered(slaveId)) {
+            if (agent.activated) {
+                HierarchicalDRFAllocatorProcess::deactivateSlave(slaveId);
+            }
+        } else if (!agent.activated && !deactivatedAgents.contains(slaveId)) {
+            reactivated.insert(slaveId);
+        }
+    }
+    activateSlaves(reactivated);
+    offerReleased(released);
+}
+
+size_t OfferFilteringHierarchicalDRFAllocatorProcess::exclusionBit(const string& name)
+{
+    Option<size_t> bit = exclusionBits.get(name);
+    if (bit.isNone()) {
+        bit = exclusionBits.size();
+        exclusionBits.put(name, bit.get());
+    }
+    return bit.get();
+}
+
+// Recomputes the roles and frameworks excluded from the agent by the scoped
+// filters covering it, and the registered frameworks the allocation pass skips
+// for it; returns whether any framework is no longer excluded.
+bool OfferFilteringHierarchicalDRFAllocatorProcess::updateExclusions(
+    const SlaveID& slaveId)
+{
+    vector<string> keys;
+    if (filteredAgents.contains(slaveId)) {
+        keys.push_back(agentFilterKey(slaveId.value()));
+    }
+    foreach (const string& key, agentSelectors.get(slaveId).getOrElse(hashset<string>())) {
+        keys.push_back(key);
+    }
+
+    std::vector<bool> exclusions;
+    foreach (const string& key, keys) {
+        Option<FilterScope> scope = filterScopes.get(key);
+        if (scope.isNone()) {
+            continue;
+        }
+
+        vector<size_t> bits;
+        foreach (const string& role, scope.get().roles) {
+            bits.push_back(exclusionBit(ROLE_EXCLUSION_PREFIX + role));
+        }
+        foreach (const string& frameworkId, scope.get().frameworks) {
+            bits.push_back(exclusionBit(FRAMEWORK_EXCLUSION_PREFIX + frameworkId));
+        }
+        foreach (size_t bit, bits) {
+            if (bit >= exclusions.size()) {
+                exclusions.resize(bit + 1);
+            }
+            exclusions[bit] = true;
+        }
+    }
+
+    if (exclusions.empty()) {
+        agentExclusions.erase(slaveId);
+    } else {
+        agentExclusions[slaveId] = exclusions;
+    }
+
+    hashset<FrameworkID> excluded;
+    if (!exclusions.empty()) {
+        foreachkey (const FrameworkID& frameworkId, this->frameworks) {
+            if (isExcluded(slaveId, frameworkId)) {
+                excluded.insert(frameworkId);
+            }
+        }
+    }
+
+    bool lifted = false;
+    foreach (const FrameworkID& frameworkId, excludedFrom.get(slaveId).getOrElse(hashset<FrameworkID>())) {
+        if (!excluded.contains(frameworkId)) {
+            excludeFramework(slaveId, frameworkId, false);
+            lifted = true;
+        }
+    }
+    foreach (const FrameworkID& frameworkId, excluded) {
+        excludeFramework(slaveId, frameworkId, true);
+    }
+
+    if (excluded.empty()) {
+        excludedFrom.erase(slaveId);
+    } else {
+        excludedFrom[slaveId] = excluded;
+    }
+    return lifted;
+}
+
+// Whether a scoped filter withholds the agent from the framework (or its role)
+bool OfferFilteringHierarchicalDRFAllocatorProcess::isExcluded(
+    const SlaveID& slaveId,
+    const FrameworkID& frameworkId) const
+{
+    auto exclusions = agentExclusions.find(slaveId);
+    if (exclusions == agentExclusions.end()) {
+        return false;
+    }
+
+    Option<size_t> roleBit;
+    if (this->frameworks.contains(frameworkId)) {
+        roleBit = exclusionBits.get(ROLE_EXCLUSION_PREFIX + this->frameworks.at(frameworkId).role);
+    }
+    return testBit(exclusions->second, roleBit) ||
+        testBit(exclusions->second, exclusionBits.get(FRAMEWORK_EXCLUSION_PREFIX + frameworkId.value()));
+}
+
+// Sets (or clears) the filter with which the allocation pass skips the agent
+// for the framework; the framework's own filters are left as they are
+void OfferFilteringHierarchicalDRFAllocatorProcess::excludeFramework(
+    const SlaveID& slaveId,
+    const FrameworkID& frameworkId,
+    bool excluded)
+{
+#ifdef MESOS__0_28_2
+    auto& offerFilters = this->offerFilters[frameworkId];
+#else
+    auto& offerFilters = this->frameworks.at(frameworkId).offerFilters;
+#endif
+    if (excluded) {
+        offerFilters[slaveId].insert(&EXCLUSION_FILTER);
+    } else if (offerFilters.contains(slaveId)) {
+        offerFilters.at(slaveId).erase(&EXCLUSION_FILTER);
+        if (offerFilters.at(slaveId).empty()) {
+            offerFilters.erase(slaveId);
+        }
+    }
+}
+
+// Sets the exclusions of the framework again, after the DRF allocator cleared
+// its filters
+void OfferFilteringHierarchicalDRFAllocatorProcess::restoreExclusions(const FrameworkID& frameworkId)
+{
+    foreachpair (const SlaveID& slaveId, const hashset<FrameworkID>& excluded, excludedFrom) {
+        if (excluded.contains(frameworkId)) {
+            excludeFramework(slaveId, frameworkId, true);
+        }
+    }
+}
+
+// Offers agents again in a single allocation pass, once frameworks which were
+// excluded from them no longer are
+void OfferFilteringHierarchicalDRFAllocatorProcess::offerReleased(const hashset<SlaveID>& released)
+{
+    if (!released.empty()) {
+        LOG(INFO) << "Offering " << released.size() << " agent(s) no longer excluded by filters";
+        allocate(released);
+    }
+}
+
+// Holds back the allocation pass which ends a call into the DRF allocator, until
+// the exclusions are brought in line; returns whether the pass is due (none is
+// while the allocator is paused for recovery).
+bool OfferFilteringHierarchicalDRFAllocatorProcess::holdAllocation()
+{
+    bool due = !this->paused;
+    this->pause();
+    return due;
+}
+
+// Wraps the master's offer callback: resources withheld by resource filters
+// are subtracted from the offers and recovered. (Agents excluded by scoped
+// filters are skipped within the allocation pass.)
+void OfferFilteringHierarchicalDRFAllocatorProcess::filterOffers(
+    const FrameworkID& frameworkId,
+    const hashmap<SlaveID, Resources>& offers)
+{
+    if (withheldResources.empty()) {
+        forwardOffers(frameworkId, offers);
+        return;
+    }
+
+    hashmap<SlaveID, Resources> offerable;
+    foreachpair (const SlaveID& slaveId, const Resources& resources, offers) {
+        // Resources withheld by a resource filter go straight back to the agent
+        auto withheld = withheldResources.find(slaveId);
+        if (withheld == withheldResources.end()) {
+            offerable[slaveId] = resources;
+            continue;
+        }
+
+        Resources offered = resources - withheld->second;
+        if (offered != resources) {
+            HierarchicalDRFAllocatorProcess::recoverResources(
+                frameworkId, slaveId, resources - offered, None());
+        }
+        if (!offered.empty()) {
+            offerable[slaveId] = offered;
+        }
+    }
+
+    if (!offerable.empty()) {
+        forwardOffers(frameworkId, offerable);
+    }
+}
+
+// Adds or replaces the resource filter of an agent
+void OfferFilteringHierarchicalDRFAllocatorProcess::setResourceFilter(
+    const string& agentId,
+    const ResourceFilter& filter)
+{
+    Option<ResourceFilter> previous = resourceFilters.get(agentId);
+    JSON::Object json = resourceFilterJSON(agentId, filter);
+    if (previous.isSome() && stringify(resourceFilterJSON(agentId, previous.get())) == stringify(json)) {
+        return;
+    }
+
+    resourceFilters.put(agentId, filter);
+    dirtyResourceFilters.insert(agentId);
+    filtersChanged(previous.isSome() ? FILTER_UPDATED : FILTER_ADDED, json);
+    updateWithheld(agentId);
+}
+
+bool OfferFilteringHierarchicalDRFAllocatorProcess::removeResourceFilter(const string& agentId)
+{
+    Option<ResourceFilter> filter = resourceFilters.get(agentId);
+    if (filter.isNone()) {
+        return false;
+    }
+
+    resourceFilters.erase(agentId);
+    dirtyResourceFilters.insert(agentId);
+    filtersChanged(FILTER_REMOVED, resourceFilterJSON(agentId, filter.get()));
+    updateWithheld(agentId);
+    return true;
+}
+
+// Caches the resources the agent's resource filter withholds from offers;
+// resources no longer withheld are offered right away
+void OfferFilteringHierarchicalDRFAllocatorProcess::updateWithheld(const string& agentId)
+{
+    Option<SlaveID> slaveId = agentIdsByString.get(agentId);
+    if (slaveId.isNone()) {
+        return;
+    }
+
+    Resources withheld;
+    Resources unavailable;
+    Option<ResourceFilter> filter = resourceFilters.get(agentId);
+    if (filter.isSome()) {
+        withheld = resourcesToWithhold(filter.get(), this->slaves.at(slaveId.get()).total, &unavailable);
+    }
+
+    Option<Resources> previous = withheldResources.get(slaveId.get());
+    if (withheld.empty()) {
+        withheldResources.erase(slaveId.get());
+    } else {
+        withheldResources.put(slaveId.get(), withheld);
+    }
+
+    if (withheld != previous.getOrElse(Resources())) {
+        LOG(INFO) << "Withholding " << (withheld.empty() ? "no resources" : stringify(withheld))
+                  << " of agent " << slaveId.get();
+        if (!unavailable.empty()) {
+            LOG(WARNING) << "The resource filter of agent " << slaveId.get() << " cannot withhold "
+                         << unavailable << ", which the agent does not have (e.g., as reserved since)";
+        }
+    }
+    if (previous.isSome() && !withheld.contains(previous.get()) && this->slaves.at(slaveId.get()).activated) {
+        hashset<SlaveID> released;
+        released.insert(slaveId.get());
+        allocate(released);
+    }
+    updateCapacity(slaveId.get());
+}
+
+Capacity OfferFilteringHierarchicalDRFAllocatorProcess::withheldCapacity(
+    const SlaveID& slaveId,
+    bool filtered,
+    const Option<ResourceFilter>& resourceFilter) const
+{
+    const Resources& total = this->slaves.at(slaveId).total;
+    if (filtered) {
+        return capacityOf(total);
+    } else if (resourceFilter.isSome()) {
+        return capacityOf(resourcesToWithhold(resourceFilter.get(), total));
+    }
+    return Capacity();
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::updateCapacity(const SlaveID& slaveId)
+{
+    Option<Capacity> previous = agentCapacities.get(slaveId);
+    if (previous.isSome()) {
+        addCapacity(&totalCapacity, previous.get(), -1);
+        agentCapacities.erase(slaveId);
+    }
+    Option<Capacity> withheld = withheldCapacities.get(slaveId);
+    if (withheld.isSome()) {
+        addCapacity(&filteredCapacity, withheld.get(), -1);
+        withheldCapacities.erase(slaveId);
+    }
+    fullyFilteredAgents.erase(slaveId);
+
+    if (!this->slaves.contains(slaveId)) {
+        return;
+    }
+
+    Capacity capacity = capacityOf(this->slaves.at(slaveId).total);
+    addCapacity(&totalCapacity, capacity, 1);
+    agentCapacities.put(slaveId, capacity);
+
+    bool filtered = isFiltered(slaveId);
+    if (filtered) {
+        fullyFilteredAgents.insert(slaveId);
+    }
+
+    Capacity withheld_ = withheldCapacity(slaveId, filtered, resourceFilters.get(slaveId.value()));
+    if (!withheld_.empty()) {
+        addCapacity(&filteredCapacity, withheld_, 1);
+        withheldCapacities.put(slaveId, withheld_);
+    }
+}
+
+bool OfferFilteringHierarchicalDRFAllocatorProcess::startsNow(
+    const string& key,
+    const FilterSchedule& schedule) const
+{
+    return schedule.startsAt.isNone() || schedule.startsAt.get() <= Clock::now() || hasActiveFilter(key);
+}
+
+Option<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::assessImpact(
+    const hashmap<SlaveID, Capacity>& proposed,
+    bool dryRun) const
+{
+    Capacity change;
+    size_t filtered = 0;
+    size_t lifted = 0;
+    foreachpair (const SlaveID& slaveId, const Capacity& capacity, proposed) {
+        Capacity current = withheldCapacities.get(slaveId).getOrElse(Capacity());
+        if (current.empty() && !capacity.empty()) {
+            ++filtered;
+        } else if (!current.empty() && capacity.empty()) {
+            ++lifted;
+        }
+        addCapacity(&change, capacity, 1);
+        addCapacity(&change, current, -1);
+    }
+
+    Option<string> violation = checkGuardRails(change);
+    if (dryRun) {
+        Capacity after = filteredCapacity;
+        addCapacity(&after, change, 1);
+
+        JSON::Object agents;
+        agents.values["filtered"] = JSON::Number(static_cast<double>(filtered));
+        agents.values["lifted"] = JSON::Number(static_cast<double>(lifted));
+
+        JSON::Object impact;
+        impact.values["dryRun"] = true;
+        impact.values["agents"] = agents;
+        impact.values["change"] = capacityJSON(change);
+        impact.values["filtered"] = capacityJSON(after);
+        impact.values["total"] = capacityJSON(totalCapacity);
+        if (violation.isSome()) {
+            impact.values["rejected"] = violation.get();
+        }
+        return http::OK(impact);
+    } else if (violation.isSome()) {
+        LOG(WARNING) << "Rejected filter request: " << violation.get();
+        return http::Conflict(violation.get());
+    }
+    return None();
+}
+
+Capacity OfferFilteringHierarchicalDRFAllocatorProcess::filteringCapacity(
+    const hashset<SlaveID>& slaveIds) const
+{
+    Capacity change;
+    foreach (const SlaveID& slaveId, slaveIds) {
+        if (this->slaves.contains(slaveId) && !isFiltered(slaveId)) {
+            addCapacity(&change, withheldCapacity(slaveId, true, None()), 1);
+            addCapacity(&change, withheldCapacities.get(slaveId).getOrElse(Capacity()), -1);
+        }
+    }
+    return change;
+}
+
+// Checks a change to the withheld capacity against the guard rails; only
+// increases are checked, so that filters can always be lifted
+Option<string> OfferFilteringHierarchicalDRFAllocatorProcess::checkGuardRails(
+    const Capacity& change) const
+{
+    foreach (const string& name, CAPACITY_RESOURCES) {
+        double added = clusterAmount(change, name);
+        double total = clusterAmount(totalCapacity, name);
+        if (guardRails.maxFilteredFraction.isSome() && added > 0 && total > 0) {
+            double fraction = (clusterAmount(filteredCapacity, name) + added) / total;
+            if (fraction > guardRails.maxFilteredFraction.get()) {
+                return "Filtering " + stringify(fraction * 100) + "% of the cluster's " + name +
+                    " exceeds the limit of " + stringify(guardRails.maxFilteredFraction.get() * 100) + "%";
+            }
+        }
+
+        if (guardRails.maxQuotaHeadroomFraction.isNone()) {
+            continue;
+        }
+        foreachpair (const string& role, const Resources& guarantee, quotaGuarantees) {
+            // The role may be offered unreserved resources and its own reservations
+            double lost = capacityAmount(change, UNRESERVED_ROLE, name) + capacityAmount(change, role, name);
+            if (lost <= 0) {
+                continue;
+            }
+            double available =
+                capacityAmount(totalCapacity, UNRESERVED_ROLE, name) -
+                capacityAmount(filteredCapacity, UNRESERVED_ROLE, name) +
+                capacityAmount(totalCapacity, role, name) -
+                capacityAmount(filteredCapacity, role, name);
+            double headroom = available - capacityAmount(capacityOf(guarantee.flatten()), UNRESERVED_ROLE, name);
+            if (lost > guardRails.maxQuotaHeadroomFraction.get() * std::max(headroom, 0.0)) {
+                return "Filtering " + stringify(lost) + " " + name + " exceeds the limit of " +
+                    stringify(guardRails.maxQuotaHeadroomFraction.get() * 100) + "% of the headroom (" +
+                    stringify(std::max(headroom, 0.0)) + ") of role '" + role + "'";
+            }
+        }
+    }
+    return None();
+}
+
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::updateOfferFilters(
+    const FilterRequest& request)
+{
+    hashmap<string, FilterSelector> selectors_;
+    hashmap<string, FilterSchedule> schedules;
+    hashmap<string, FilterScope> scopes;
+    hashmap<string, ResourceFilter> partial;
+    auto filters = resolveFilters(request.filters, &selectors_, &schedules, &scopes, &partial);
+    if (!filters.second.empty()) {
+        return http::BadRequest("One or more agents specified do not exist: " + filters.second);
+    }
+
+    // The agents withholding capacity now, or once the filters are replaced
+    hashset<SlaveID> filtering;
+    foreach (const SlaveID& agentId, filters.first) {
+        string key = agentFilterKey(agentId.value());
+        if (!scopes.contains(key) && startsNow(key, schedules.at(key))) {
+            filtering.insert(agentId);
+        }
+    }
+    foreachpair (const string& key, const FilterSelector& selector, selectors_) {
+        if (!scopes.contains(key) && startsNow(key, schedules.at(key))) {
+            foreach (const SlaveID& slaveId, matchingAgents(selector)) {
+                filtering.insert(slaveId);
+            }
+        }
+    }
+
+    hashset<SlaveID> affected = filtering;
+    foreachkey (const SlaveID& slaveId, withheldCapacities) {
+        affected.insert(slaveId);
+    }
+    foreachkey (const string& agentId, partial) {
+        affected.insert(agentIdsByString.at(agentId));
+    }
+
+    hashmap<SlaveID, Capacity> proposed;
+    foreach (const SlaveID& slaveId, affected) {
+        proposed.put(slaveId, withheldCapacity(
+            slaveId, filtering.contains(slaveId), partial.get(slaveId.value())));
+    }
+
+    Option<http::Response> rejected = assessImpact(proposed, isDryRun(request.request));
+    if (rejected.isSome()) {
+        return rejected.get();
+    }
+
+    // The request replaces every filter, including those still pending
+    // their agent or their start
+    foreach (const string& agentId, pendingFilters.keys()) {
+        removePendingFilter(agentId);
+    }
+    foreach (const string& hostname, hashset<string>(pendingHostnameFilters)) {
+        removePendingHostnameFilter(hostname);
+    }
+    foreach (const string& key, scheduledFilters.keys()) {
+        if (!schedules.contains(key)) {
+            removeScheduledFilter(key);
+        }
+    }
+
+    // Filters with a later start are held until then
+    hashset<SlaveID> agentIds;
+    foreach (const SlaveID& agentId, filters.first) {
+        string key = agentFilterKey(agentId.value());
+        JSON::Object filter = filterJSON(agentId.value(), this->slaves.at(agentId).hostname);
+        bool deferred = scheduleFilter(key, filter, schedules.at(key));
+        scopeFilter(key, filter, scopes.get(key));
+        if (!deferred) {
+            agentIds.insert(agentId);
+        }
+    }
+
+    // Stale selectors are removed last, so that agents which remain
+    // filtered are not re-activated in between
+    foreachpair (const string& key, const FilterSelector& selector, selectors_) {
+        bool deferred = scheduleFilter(key, selectorJSON(selector), schedules.at(key));
+        scopeFilter(key, selectorJSON(selector), scopes.get(key));
+        if (!deferred) {
+            addSelector(selector);
+        }
+    }
+    applyFilters(agentIds);
+    foreach (const string& key, selectors.keys()) {
+        if (!selectors_.contains(key)) {
+            removeSelector(key);
+        }
+    }
+
+    foreach (const string& agentId, resourceFilters.keys()) {
+        if (!partial.contains(agentId)) {
+            removeResourceFilter(agentId);
+        }
+    }
+    foreachpair (const string& agentId, const ResourceFilter& filter, partial) {
+        setResourceFilter(agentId, filter);
+    }
+
+    return persistAndReportOfferFilters();
+}
+
+// Adds and removes filters as a single change: all of them are validated and
+// assessed before any is applied, and they are persisted by a single write
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::patchOfferFilters(
+    const FilterRequest& request)
+{
+    hashmap<string, FilterSelector> selectors_;
+    hashmap<string, FilterSchedule> schedules;
+    hashmap<string, FilterScope> scopes;
+    hashmap<string, ResourceFilter> partial;
+    auto filters = resolveFilters(request.filters, &selectors_, &schedules, &scopes, &partial);
+    if (!filters.second.empty()) {
+        return http::BadRequest("One or more agents specified do not exist: " + filters.second);
+    }
+
+    hashset<string> removedKeys;
+    hashset<string> removedResources;
+    string missing = resolveRemovals(request.removals, &removedKeys, &removedResources);
+    if (!missing.empty()) {
+        return http::NotFound("No filter exists for: " + missing);
+    }
+
+    // A filter both removed and added is replaced by the addition
+    foreachkey (const string& key, schedules) {
+        removedKeys.erase(key);
+    }
+    foreachkey (const string& agentId, partial) {
+        removedResources.erase(agentId);
+    }
+
+    // The agents withholding capacity once the filters are added
+    hashset<SlaveID> filtering;
+    foreach (const SlaveID& agentId, filters.first) {
+        string key = agentFilterKey(agentId.value());
+        if (!scopes.contains(key) && startsNow(key, schedules.at(key))) {
+            filtering.insert(agentId);
+        }
+    }
+    foreachpair (const string& key, const FilterSelector& selector, selectors_) {
+        if (!scopes.contains(key) && startsNow(key, schedules.at(key))) {
+            foreach (const SlaveID& slaveId, matchingAgents(selector)) {
+                filtering.insert(slaveId);
+            }
+        }
+    }
+
+    hashset<SlaveID> affected = filtering;
+    foreachkey (const string& agentId, partial) {
+        affected.insert(agentIdsByString.at(agentId));
+    }
+    foreach (const string& agentId, removedResources) {
+        Option<SlaveID> slaveId = agentIdsByString.get(agentId);
+        if (slaveId.isSome()) {
+            affected.insert(slaveId.get());
+        }
+    }
+    foreach (const string& key, removedKeys) {
+        if (strings::startsWith(key, AGENT_FILTER_KEY_PREFIX)) {
+            Option<SlaveID> slaveId = agentIdsByString.get(key.substr(AGENT_FILTER_KEY_PREFIX.size()));
+            if (slaveId.isSome()) {
+                affected.insert(slaveId.get());
+            }
+        } else if (selectors.contains(key)) {
+            foreach (const SlaveID& slaveId, selectors.at(key).agents) {
+                affected.insert(slaveId);
+            }
+        }
+    }
+
+    // Filters replaced by an addition no longer apply as they were
+    hashset<string> replaced = removedKeys;
+    foreachkey (const string& key, schedules) {
+        replaced.insert(key);
+    }
+
+    hashmap<SlaveID, Capacity> proposed;
+    foreach (const SlaveID& slaveId, affected) {
+        Option<ResourceFilter> resourceFilter = partial.get(slaveId.value());
+        if (resourceFilter.isNone() && !removedResources.contains(slaveId.value())) {
+            resourceFilter = resourceFilters.get(slaveId.value());
+        }
+        proposed.put(slaveId, withheldCapacity(
+            slaveId, filtering.contains(slaveId) || isFiltered(slaveId, replaced), resourceFilter));
+    }
+
+    Option<http::Response> rejected = assessImpact(proposed, isDryRun(request.request));
+    if (rejected.isSome()) {
+        return rejected.get();
+    }
+
+    // The response lists the changes of this patch only, however many: the
+    // watch buffer may no longer reach back to its first
+    recordedEvents = JSON::Array();
+
+    // Filters with a later start are held until then
+    hashset<SlaveID> added;
+    foreach (const SlaveID& agentId, filters.first) {
+        string key = agentFilterKey(agentId.value());
+        JSON::Object filter = filterJSON(agentId.value(), this->slaves.at(agentId).hostname);
+        bool deferred = scheduleFilter(key, filter, schedules.at(key));
+        scopeFilter(key, filter, scopes.get(key));
+        if (!deferred) {
+            added.insert(agentId);
+        }
+    }
+    foreachpair (const string& key, const FilterSelector& selector, selectors_) {
+        bool deferred = scheduleFilter(key, selectorJSON(selector), schedules.at(key));
+        scopeFilter(key, selectorJSON(selector), scopes.get(key));
+        if (!deferred) {
+            addSelector(selector);
+        }
+    }
+    foreachpair (const string& agentId, const ResourceFilter& filter, partial) {
+        setResourceFilter(agentId, filter);
+    }
+
+    // Removals come last, so that agents which remain filtered are not
+    // re-activated in between
+    hashset<SlaveID> lifted;
+    foreach (const string& key, removedKeys) {
+        if (strings::startsWith(key, AGENT_FILTER_KEY_PREFIX)) {
+            string agentId = key.substr(AGENT_FILTER_KEY_PREFIX.size());
+            Option<SlaveID> slaveId = agentIdsByString.get(agentId);
+            if (slaveId.isSome() && filteredAgents.contains(slaveId.get())) {
+                lifted.insert(slaveId.get());
+            } else {
+                removePendingFilter(agentId);
+            }
+        } else if (strings::startsWith(key, HOSTNAME_FILTER_KEY_PREFIX)) {
+            removePendingHostnameFilter(key.substr(HOSTNAME_FILTER_KEY_PREFIX.size()));
+        }
+        if (!selectors.contains(key)) {
+            removeScheduledFilter(key);
+        }
+    }
+    applyFilterDelta(added, lifted);
+    foreach (const string& key, removedKeys) {
+        removeSelector(key);
+    }
+    foreach (const string& agentId, removedResources) {
+        removeResourceFilter(agentId);
+    }
+
+    LOG(INFO) << "Patched filters (+" << request.filters.size() << "/-"
+              << request.removals.size() << ")";
+    http::Response response = reportEvents(recordedEvents.get());
+    recordedEvents = None();
+    return persistAndRespond(response);
+}
+
+
+
+// Queues a write of the filter set; mutations arriving within the commit window,
+// or while a commit is in flight, are collapsed into a single store.
+Future<Nothing> OfferFilteringHierarchicalDRFAllocatorProcess::persistFilteredAgents()
+{
+    if (state == NULL) {
+        return Nothing();
+    }
+
+    Owned<Promise<Nothing>> promise(new Promise<Nothing>());
+    pendingCommits.push_back(promise);
+    scheduleCommit();
+
+    // The change stays applied, and is committed once the store is reachable
+    // (and reconciled with the local snapshot)
+    return promise->future()
+        .after(PERSIST_TIMEOUT, [](const Future<Nothing>&) -> Future<Nothing> {
+            return process::Failure("Timed out after " + stringify(PERSIST_TIMEOUT) +
+                " waiting for the store; the change is committed once it is reachable");
+        });
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::scheduleCommit()
+{
+    // Nothing is written until the store has been reconciled with the local snapshot
+    if (!commitScheduled && !committing && snapshotEntries.isNone() &&
+            (!pendingCommits.empty() || !dirtyAgentFilters.empty() ||
+             !dirtyHostnameFilters.empty() || !dirtySelectors.empty() ||
+             !dirtyResourceFilters.empty() || !dirtyDrains.empty())) {
+        commitScheduled = true;
+        delay(PERSIST_COMMIT_WINDOW, self(),
+            &OfferFilteringHierarchicalDRFAllocatorProcess::commitFilteredAgents);
+    }
+}
+
+// Store each changed filter as its own entry, followed by the manifest
+void OfferFilteringHierarchicalDRFAllocatorProcess::commitFilteredAgents()
+{
+    commitScheduled = false;
+
+    std::vector<Owned<Promise<Nothing>>> committed;
+    committed.swap(pendingCommits);
+
+    hashset<string> agentIds;
+    agentIds.swap(dirtyAgentFilters);
+
+    hashset<string> hostnames;
+    hostnames.swap(dirtyHostnameFilters);
+
+    hashset<string> selectorKeys;
+    selectorKeys.swap(dirtySelectors);
+
+    hashset<string> resourceAgentIds;
+    resourceAgentIds.swap(dirtyResourceFilters);
+
+    hashset<string> drainIds;
+    drainIds.swap(dirtyDrains);
+
+    std::list<Future<Nothing>> writes;
+    std::vector<string> changed;
+    foreach (const string& agentId, agentIds) {
+        string name = FILTER_AGENT_PREFIX + agentId;
+        Option<string> value = serializeAgentFilter(agentId);
+        if (!isPersisted(name, value)) {
+            writes.push_back(writeFilterEntry(name, value));
+            changed.push_back(name);
+        }
+    }
+    foreach (const string& hostname, hostnames) {
+        string name = FILTER_HOSTNAME_PREFIX + hostname;
+        Option<string> value = serializeHostnameFilter(hostname);
+        if (!isPersisted(name, value)) {
+            writes.push_back(writeFilterEntry(name, value));
+            changed.push_back(name);
+        }
+    }
+    foreach (const string& key, selectorKeys) {
+        // Selector values may contain characters which are not valid in entry names
+        string name = FILTER_SELECTOR_PREFIX + http::encode(key);
+        Option<string> value = serializeSelectorFilter(key);
+        if (!isPersisted(name, value)) {
+            writes.push_back(writeFilterEntry(name, value));
+            changed.push_back(name);
+        }
+    }
+    foreach (const string& agentId, resourceAgentIds) {
+        string name = FILTER_RESOURCES_PREFIX + agentId;
+        Option<string> value = serializeResourceFilter(agentId);
+        if (!isPersisted(name, value)) {
+            writes.push_back(writeFilterEntry(name, value));
+            changed.push_back(name);
+        }
+    }
+    foreach (const string& id, drainIds) {
+        string name = DRAIN_PREFIX + id;
+        Option<string> value = serializeDrain(id);
+        if (!isPersisted(name, value)) {
+            writes.push_back(writeFilterEntry(name, value));
+            changed.push_back(name);
+        }
+    }
+
+    if (writes.empty() && legacyVariable.isNone()) {
+        foreach (const Owned<Promise<Nothing>>& promise, committed) {
+            promise->set(Nothing());
+        }
+        return;
+    }
+
+    if (legacyVariable.isSome()) {
+        State* state = this->state;
+        writes.push_back(state->expunge(legacyVariable.get())
+            .then([](bool) { return Nothing(); }));
+    }
+
+    committing = true;
+    filterMetrics.persist_latency.start();
+    process::collect(writes)
+        .then(defer(self(), [this, changed](const std::list<Nothing>&) {
+            return writeManifest(changed);
+        }))
+        .onAny(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::_commitFilteredAgents,
+            committed, agentIds, hostnames, selectorKeys, resourceAgentIds, drainIds, lambda::_1));
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::_commitFilteredAgents(
+    const std::vector<Owned<Promise<Nothing>>>& committed,
+    const hashset<string>& agentIds,
+    const hashset<string>& hostnames,
+    const hashset<string>& selectorKeys,
+    const hashset<string>& resourceAgentIds,
+    const hashset<string>& drainIds,
+    const Future<Nothing>& written)
+{
+    committing = false;
+
+    if (written.isReady()) {
+        legacyVariable = None();
+        Duration latency = filterMetrics.persist_latency.stop();
+        VLOG(1) << "Committed "
+                << (agentIds.size() + hostnames.size() + selectorKeys.size() + resourceAgentIds.size() +
+                    drainIds.size())
+                << " filter(s) for "
+                << committed.size() << " request(s) in " << latency;
+        foreach (const Owned<Promise<Nothing>>& promise, committed) {
+            promise->set(Nothing());
+        }
+        scheduleCommit();
+        saveSnapshot();
+    } else {
+        string message = written.isFailed() ? written.failure() : "discarded";
+        LOG(ERROR) << "Failed to persist filtered agents: " << message;
+        ++filterMetrics.persist_failures;
+
+        // Keep the filters dirty so that they are written by a later commit
+        foreach (const string& agentId, agentIds) {
+            dirtyAgentFilters.insert(agentId);
+        }
+        foreach (const string& hostname, hostnames) {
+            dirtyHostnameFilters.insert(hostname);
+        }
+        foreach (const string& key, selectorKeys) {
+            dirtySelectors.insert(key);
+        }
+        foreach (const string& agentId, resourceAgentIds) {
+            dirtyResourceFilters.insert(agentId);
+        }
+        foreach (const string& id, drainIds) {
+            dirtyDrains.insert(id);
+        }
+        foreach (const Owned<Promise<Nothing>>& promise, committed) {
+            promise->fail(message);
+        }
+        delay(PERSIST_RETRY_INTERVAL, self(),
+            &OfferFilteringHierarchicalDRFAllocatorProcess::scheduleCommit);
+    }
+}
+
+Option<string> OfferFilteringHierarchicalDRFAllocatorProcess::serializeAgentFilter(const string& agentId)
+{
+    string key = agentFilterKey(agentId);
+    string hostname;
+    Option<SlaveID> slaveId = agentIdsByString.get(agentId);
+    if (slaveId.isSome() && filteredAgents.contains(slaveId.get())) {
+        hostname = this->slaves.at(slaveId.get()).hostname;
+    } else if (pendingFilters.contains(agentId)) {
+        hostname = pendingFilters.at(agentId);
+    } else if (scheduledFilters.contains(key)) {
+        return encodeEntry(storedFilter(storedIdentity(scheduledFilters.at(key)), key));
+    } else {
+        return None();
+    }
+
+    StoredFilter filter;
+    filter.set_agent_id(agentId);
+    filter.set_hostname(hostname);
+    return encodeEntry(storedFilter(filter, key));
+}
+
+Option<string> OfferFilteringHierarchicalDRFAllocatorProcess::serializeHostnameFilter(const string& hostname)
+{
+    string key = hostnameFilterKey(hostname);
+    if (scheduledFilters.contains(key)) {
+        return encodeEntry(storedFilter(storedIdentity(scheduledFilters.at(key)), key));
+    } else if (!pendingHostnameFilters.contains(hostname)) {
+        return None();
+    }
+
+    StoredFilter filter;
+    filter.set_hostname(hostname);
+    return encodeEntry(storedFilter(filter, key));
+}
+
+Option<string> OfferFilteringHierarchicalDRFAllocatorProcess::serializeSelectorFilter(const string& key)
+{
+    Option<FilterSelector> selector = selectors.get(key);
+    if (scheduledFilters.contains(key)) {
+        return encodeEntry(storedFilter(storedIdentity(scheduledFilters.at(key)), key));
+    } else if (selector.isNone()) {
+        return None();
+    }
+
+    StoredFilter filter;
+    filter.set_selector_type(selector.get().type);
+    filter.set_selector_value(selector.get().value);
+    return encodeEntry(storedFilter(filter, key));
+}
+
+Option<string> OfferFilteringHierarchicalDRFAllocatorProcess::serializeResourceFilter(const string& agentId)
+{
+    Option<ResourceFilter> filter = resourceFilters.get(agentId);
+    if (filter.isNone()) {
+        return None();
+    }
+    return encodeEntry(storedResourceFilter(agentId, filter.get()));
+}
+
+// Whether the entry is already stored with the specified value (None: absent);
+// every stored entry is cached once the filters have been restored.
+bool OfferFilteringHierarchicalDRFAllocatorProcess::isPersisted(
+    const string& name,
+    const Option<string>& value)
+{
+    Option<Variable> variable = filterVariables.get(name);
+    if (value.isNone()) {
+        return variable.isNone();
+    }
+    return variable.isSome() && variable.get().value() == value.get();
+}
+
+// Stores (or expunges, when value is None) a single filter entry
+Future<Nothing> OfferFilteringHierarchicalDRFAllocatorProcess::writeFilterEntry(
+    const string& name,
+    const Option<string>& value)
+{
+    State* state = this->state;
+    Option<Variable> cached = filterVariables.get(name);
+    Future<Variable> variable = cached.isSome() ? Future<Variable>(cached.get()) : state->fetch(name);
+
+    if (value.isSome()) {
+        string serialized = value.get();
+        return variable
+            .then([state, serialized](const Variable& current) {
+                return state->store(current.mutate(serialized));
+            })
+            .then(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::_writeFilterEntry,
+                name, lambda::_1));
+    }
+
+    return variable
+        .then([state](const Variable& current) {
+            return state->expunge(current);
+        })
+        .then(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::_expungeFilterEntry,
+            name, lambda::_1));
+}
+
+Future<Nothing> OfferFilteringHierarchicalDRFAllocatorProcess::_writeFilterEntry(
+    const string& name,
+    const Option<Variable>& stored)
+{
+    snapshotChanged.insert(name);
+    if (stored.isNone()) {
+        filterVariables.erase(name);
+        return process::Failure("Version conflict writing filter entry '" + name + "'");
+    }
+    filterVariables.put(name, stored.get());
+    return Nothing();
+}
+
+Future<Nothing> OfferFilteringHierarchicalDRFAllocatorProcess::_expungeFilterEntry(
+    const string& name,
+    bool expunged)
+{
+    snapshotChanged.insert(name);
+    filterVariables.erase(name);
+    return Nothing();
+}
+
+// The manifest identifies the storage layout, and counts the commits made to it
+Future<Nothing> OfferFilteringHierarchicalDRFAllocatorProcess::writeManifest(
+    const std::vector<string>& changed)
+{
+    // The entries changed by the latest commits, so that standby masters fetch
+    // only those; a commit changing more than the log holds clears it
+    ChangeLog log = changeLog;
+    if (changed.size() > MANIFEST_CHANGE_LOG_SIZE) {
+        log.clear();
+    } else {
+        log.push_back(std::make_pair(filtersGeneration + 1, changed));
+        size_t logged = 0;
+        foreach (const auto& change, log) {
+            logged += change.second.size();
+        }
+        while (logged > MANIFEST_CHANGE_LOG_SIZE) {
+            logged -= log.front().second.size();
+            log.pop_front();
+        }
+    }
+
+    JSON::Array changes;
+    foreach (const auto& change, log) {
+        JSON::Array entries;
+        foreach (const string& name, change.second) {
+            entries.values.push_back(name);
+        }
+        JSON::Object json;
+        json.values["generation"] = stringify(change.first);
+        json.values["entries"] = std::move(entries);
+        changes.values.push_back(std::move(json));
+    }
+
+    // Kept as strings so that 64-bit values survive any JSON number handling
+    JSON::Object manifest;
+    manifest.values["format"] = FILTERS_FORMAT_VERSION;
+    manifest.values["generation"] = stringify(filtersGeneration + 1);
+    manifest.values["version"] = stringify(filtersVersion);
+    manifest.values["epoch"] = filtersEpoch;
+    manifest.values["changes"] = std::move(changes);
+    string serialized = stringify(manifest);
+
+    State* state = this->state;
+    Future<Variable> variable = manifestVariable.isSome()
+        ? Future<Variable>(manifestVariable.get())
+        : state->fetch(FILTERS_MANIFEST);
+
+    return variable
+        .then([state, serialized](const Variable& current) {
+            return state->store(current.mutate(serialized));
+        })
+        .then(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::_writeManifest,
+            log, lambda::_1));
+}
+
+Future<Nothing> OfferFilteringHierarchicalDRFAllocatorProcess::_writeManifest(
+    const ChangeLog& log,
+    const Option<Variable>& stored)
+{
+    if (stored.isNone()) {
+        manifestVariable = None();
+        return process::Failure("Version conflict writing the filter manifest");
+    }
+    manifestVariable = stored.get();
+    changeLog = log;
+    ++filtersGeneration;
+    return Nothing();
+}
+
+double OfferFilteringHierarchicalDRFAllocatorProcess::_persist_queue_depth()
+{
+    return static_cast<double>(pendingCommits.size());
+}
+
+double OfferFilteringHierarchicalDRFAllocatorProcess::_filtered_agents()
+{
+    return static_cast<double>(fullyFilteredAgents.size());
+}
+
+// Read agent filters from the state store once the allocator has been recovered;
+// filters for agents which have not (yet) re-registered are held as pending
+// filters, and applied as those agents are added in addSlave.
+void OfferFilteringHierarchicalDRFAllocatorProcess::restoreFilteredAgents() {
+
+    if (state != NULL) {
+        state->fetch(FILTERS_MANIFEST)
+            .onAny(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::_restoreFilteredAgents,
+                lambda::_1));
+    } else {
+        LOG(WARNING) << "State not initialized";
+        applyRestoredFilters();
+    }
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::_restoreFilteredAgents(
+    const Future<Variable>& manifest)
+{
+    if (!manifest.isReady()) {
+        LOG(ERROR) << "Failed to fetch the filter manifest: "
+                   << (manifest.isFailed() ? manifest.failure() : "discarded");
+        delay(RESTORE_RETRY_INTERVAL, self(),
+            &OfferFilteringHierarchicalDRFAllocatorProcess::restoreFilteredAgents);
+        return;
+    }
+
+    manifestVariable = manifest.get();
+
+    if (manifest.get().value().empty()) {
+        // No manifest: either there are no filters, or they are still stored
+        // in the legacy single-document layout
+        state->fetch(FILTERED_AGENTS)
+            .onAny(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::restoreLegacyFilteredAgents,
+                lambda::_1));
+        return;
+    }
+
+    Option<uint64_t> generation = manifestCounter(manifest.get().value(), "generation");
+    if (generation.isSome()) {
+        filtersGeneration = generation.get();
+    }
+
+    // The entries held while standing by were read at this generation, along
+    // with their variables: nothing has been committed since
+    if (snapshotEntries.isSome() && promotedGeneration.isSome() && promotedGeneration == generation) {
+        LOG(INFO) << "The filters held while standing by are current (generation "
+                  << filtersGeneration << ")";
+        snapshotEntries = None();
+        promotedGeneration = None();
+        applyRestoredFilters();
+        return;
+    }
+
+    state->names()
+        .onAny(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::restoreFilterEntries,
+            lambda::_1));
+}
+
+// Fetches every filter entry in parallel
+void OfferFilteringHierarchicalDRFAllocatorProcess::restoreFilterEntries(
+    const Future<std::set<string>>& names)
+{
+    if (!names.isReady()) {
+        LOG(ERROR) << "Failed to list the filter entries: "
+                   << (names.isFailed() ? names.failure() : "discarded");
+        delay(RESTORE_RETRY_INTERVAL, self(),
+            &OfferFilteringHierarchicalDRFAllocatorProcess::restoreFilteredAgents);
+        return;
+    }
+
+    std::vector<string> entries;
+    std::list<Future<Variable>> fetches;
+    foreach (const string& name, names.get()) {
+        if (isFilterEntry(name)) {
+            entries.push_back(name);
+            fetches.push_back(state->fetch(name));
+        }
+    }
+
+    process::collect(fetches)
+        .onAny(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::_restoreFilterEntries,
+            entries, lambda::_1));
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::_restoreFilterEntries(
+    const std::vector<string>& names,
+    const Future<std::list<Variable>>& entries)
+{
+    if (!entries.isReady()) {
+        LOG(ERROR) << "Failed to fetch the filter entries: "
+                   << (entries.isFailed() ? entries.failure() : "discarded");
+        delay(RESTORE_RETRY_INTERVAL, self(),
+            &OfferFilteringHierarchicalDRFAllocatorProcess::restoreFilteredAgents);
+        return;
+    }
+
+    // collect() preserves the order of the fetches
+    hashmap<string, string> stored;
+    std::vector<string>::const_iterator name = names.begin();
+    foreach (const Variable& entry, entries.get()) {
+        if (!entry.value().empty()) {
+            filterVariables.put(*name, entry);
+            if (snapshotEntries.isSome()) {
+                stored.put(*name, entry.value());
+            } else {
+                restoreEntry(*name, entry.value());
+            }
+        }
+        ++name;
+    }
+
+    if (snapshotEntries.isSome()) {
+        reconcileSnapshot(stored);
+    }
+    applyRestoredFilters();
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::restoreEntry(
+    const string& name,
+    const string& value)
+{
+    Try<StoredEntry> entry = decodeEntry(value);
+    if (entry.isError()) {
+        LOG(ERROR) << "Failed to parse filter entry '" << name << "': " << entry.error();
+        return;
+    }
+
+    restoreEntry(name, entry.get());
+    if (isJSONEntry(value)) {
+        migrateEntry(name);
+    }
+}
+
+// Marks the filter (or drain job) of an entry stored in an earlier format
+// dirty, so that it is rewritten in the current one
+void OfferFilteringHierarchicalDRFAllocatorProcess::migrateEntry(const string& name)
+{
+    if (strings::startsWith(name, FILTER_AGENT_PREFIX)) {
+        dirtyAgentFilters.insert(name.substr(FILTER_AGENT_PREFIX.size()));
+    } else if (strings::startsWith(name, FILTER_HOSTNAME_PREFIX)) {
+        dirtyHostnameFilters.insert(name.substr(FILTER_HOSTNAME_PREFIX.size()));
+    } else if (strings::startsWith(name, FILTER_SELECTOR_PREFIX)) {
+        Try<string> key = http::decode(name.substr(FILTER_SELECTOR_PREFIX.size()));
+        if (key.isSome()) {
+            dirtySelectors.insert(key.get());
+        }
+    } else if (strings::startsWith(name, FILTER_RESOURCES_PREFIX)) {
+        dirtyResourceFilters.insert(name.substr(FILTER_RESOURCES_PREFIX.size()));
+    } else if (strings::startsWith(name, DRAIN_PREFIX)) {
+        dirtyDrains.insert(name.substr(DRAIN_PREFIX.size()));
+    }
+}
+
+// Filters are restored from their stored form; only drain jobs (and entries
+// of earlier formats) go through JSON
+void OfferFilteringHierarchicalDRFAllocatorProcess::restoreEntry(
+    const string& name,
+    const StoredEntry& entry)
+{
+    if (entry.has_filter()) {
+        Try<FilterSpec> filter = parseStoredFilter(entry.filter());
+        if (filter.isError()) {
+            LOG(ERROR) << "Ignoring invalid filter entry '" << name << "': " << filter.error();
+        } else {
+            addPendingFilter(filter.get(), false);
+        }
+        return;
+    }
+
+    Try<JSON::Object> json = JSON::parse<JSON::Object>(entry.json());
+    if (json.isError()) {
+        LOG(ERROR) << "Failed to parse filter entry '" << name << "': " << json.error();
+    } else if (strings::startsWith(name, DRAIN_PREFIX)) {
+        restoreDrain(json.get());
+    } else {
+        addPendingFilter(json.get(), false);
+    }
+}
+
+// Polls the manifest while this master stands by, and reads the entries anew
+// whenever its generation changes; stops once the master is elected
+void OfferFilteringHierarchicalDRFAllocatorProcess::pollStandby()
+{
+    if (!recovered) {
+        state->fetch(FILTERS_MANIFEST)
+            .onAny(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::_pollStandby, lambda::_1));
+    }
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::_pollStandby(const Future<Variable>& manifest)
+{
+    if (recovered) {
+        return;
+    } else if (!manifest.isReady()) {
+        VLOG(1) << "Failed to poll the filter manifest: "
+                << (manifest.isFailed() ? manifest.failure() : "discarded");
+        delay(STANDBY_POLL_INTERVAL, self(), &OfferFilteringHierarchicalDRFAllocatorProcess::pollStandby);
+        return;
+    }
+
+    // Filters still in the legacy layout are left to the elected master to migrate
+    Option<uint64_t> generation;
+    if (!manifest.get().value().empty()) {
+        generation = manifestCounter(manifest.get().value(), "generation");
+    }
+    if (generation.isNone() || generation == standbyGeneration) {
+        delay(STANDBY_POLL_INTERVAL, self(), &OfferFilteringHierarchicalDRFAllocatorProcess::pollStandby);
+        return;
+    }
+
+    // Only the entries changed since the held generation are fetched again,
+    // as long as the manifest still logs every commit since
+    Option<hashset<string>> changed;
+    if (standbyGeneration.isSome()) {
+        changed = manifestChanges(manifest.get().value(), standbyGeneration.get(), generation.get());
+    }
+    if (changed.isSome()) {
+        std::vector<string> entries;
+        std::list<Future<Variable>> fetches;
+        foreach (const string& name, changed.get()) {
+            if (isFilterEntry(name)) {
+                entries.push_back(name);
+                fetches.push_back(state->fetch(name));
+            }
+        }
+
+        process::collect(fetches)
+            .onAny(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::holdStandbyFilters,
+                manifest.get(), generation.get(), entries, true, lambda::_1));
+        return;
+    }
+
+    state->names()
+        .onAny(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::__pollStandby,
+            manifest.get(), generation.get(), lambda::_1));
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::__pollStandby(
+    const Variable& manifest,
+    uint64_t generation,
+    const Future<std::set<string>>& names)
+{
+    if (recovered) {
+        return;
+    } else if (!names.isReady()) {
+        VLOG(1) << "Failed to list the filter entries: "
+                << (names.isFailed() ? names.failure() : "discarded");
+        delay(STANDBY_POLL_INTERVAL, self(), &OfferFilteringHierarchicalDRFAllocatorProcess::pollStandby);
+        return;
+    }
+
+    std::vector<string> entries;
+    std::list<Future<Variable>> fetches;
+    foreach (const string& name, names.get()) {
+        if (isFilterEntry(name)) {
+            entries.push_back(name);
+            fetches.push_back(state->fetch(name));
+        }
+    }
+
+    process::collect(fetches)
+        .onAny(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::holdStandbyFilters,
+            manifest, generation, entries, false, lambda::_1));
+}
+
+// Holds the fetched entries: all of them, or (when 'changed') only those changed
+// since the held generation, the rest being kept as they are
+void OfferFilteringHierarchicalDRFAllocatorProcess::holdStandbyFilters(
+    const Variable& manifest,
+    uint64_t generation,
+    const std::vector<string>& names,
+    bool changed,
+    const Future<std::list<Variable>>& entries)
+{
+    if (recovered) {
+        return;
+    }
+
+    if (!entries.isReady()) {
+        VLOG(1) << "Failed to fetch the filter entries: "
+                << (entries.isFailed() ? entries.failure() : "discarded");
+    } else {
+        if (!changed) {
+            standbyVariables.clear();
+            standbyFilters.clear();
+        }
+
+        // The entries are parsed now, rather than on the failover path; an
+        // expunged entry is fetched empty
+        std::vector<string>::const_iterator name = names.begin();
+        foreach (const Variable& entry, entries.get()) {
+            standbyVariables.erase(*name);
+            standbyFilters.erase(*name);
+            if (!entry.value().empty()) {
+                Try<StoredEntry> filter = decodeEntry(entry.value());
+                if (filter.isError()) {
+                    LOG(ERROR) << "Failed to parse filter entry '" << *name << "': " << filter.error();
+                } else {
+                    standbyVariables.put(*name, entry);
+                    standbyFilters.put(*name, filter.get());
+                }
+            }
+            ++name;
+        }
+
+        VLOG(1) << "Holding " << standbyFilters.size() << " filter entries of generation " << generation
+                << " while standing by (" << names.size() << " fetched)";
+        standbyManifest = manifest;
+        standbyGeneration = generation;
+        snapshotStandby(names, changed);
+    }
+
+    delay(STANDBY_POLL_INTERVAL, self(), &OfferFilteringHierarchicalDRFAllocatorProcess::pollStandby);
+}
+
+// Keeps the local snapshot at the generation held while standing by, so that a
+// master restarting later does not apply filters from an earlier term
+void OfferFilteringHierarchicalDRFAllocatorProcess::snapshotStandby(
+    const std::vector<string>& names,
+    bool changed)
+{
+    if (snapshotter.get() == nullptr) {
+        return;
+    }
+
+    if (!changed) {
+        hashmap<string, string> entries;
+        foreachpair (const string& name, const Variable& variable, standbyVariables) {
+            entries.put(name, variable.value());
+        }
+        process::dispatch(snapshotter.get(), &OfferFilterSnapshotProcess::reset,
+                          standbyGeneration.get(), entries);
+        return;
+    }
+
+    hashmap<string, Option<string>> updated;
+    foreach (const string& name, names) {
+        Option<Variable> variable = standbyVariables.get(name);
+        updated.put(name, variable.isSome() ? Option<string>(variable.get().value()) : None());
+    }
+    process::dispatch(snapshotter.get(), &OfferFilterSnapshotProcess::update,
+                      standbyGeneration.get(), updated);
+}
+
+// Applies the entries held while standing by, if any; returns whether they were applied
+bool OfferFilteringHierarchicalDRFAllocatorProcess::applyStandbyFilters()
+{
+    if (standbyGeneration.isNone()) {
+        return false;
+    }
+
+    LOG(INFO) << "Applying " << standbyFilters.size() << " filter entries of generation "
+              << standbyGeneration.get() << " held while standing by";
+
+    hashmap<string, string> entries;
+    foreachpair (const string& name, const StoredEntry& filter, standbyFilters) {
+        const Variable& variable = standbyVariables.at(name);
+        filterVariables.put(name, variable);
+        entries.put(name, variable.value());
+        restoreEntry(name, filter);
+        if (isJSONEntry(variable.value())) {
+            migrateEntry(name);
+        }
+    }
+    manifestVariable = standbyManifest;
+    filtersGeneration = standbyGeneration.get();
+
+    snapshotEntries = entries;
+    promotedGeneration = standbyGeneration;
+
+    standbyGeneration = None();
+    standbyManifest = None();
+    standbyVariables.clear();
+    standbyFilters.clear();
+
+    applyRestoredFilters();
+    return true;
+}
+
+// Applies the local snapshot, if any, ahead of the store; returns whether it was applied
+bool OfferFilteringHierarchicalDRFAllocatorProcess::loadSnapshot()
+{
+    if (snapshotPath.isNone() || state == NULL || !os::exists(snapshotPath.get())) {
+        return false;
+    }
+
+    Try<string> contents = os::read(snapshotPath.get());
+    if (contents.isError()) {
+        LOG(WARNING) << "Failed to read the local filter snapshot at " << snapshotPath.get() << ": "
+                     << contents.error();
+        return false;
+    }
+
+    Try<FilterSnapshot> snapshot = decodeSnapshot(contents.get());
+    if (snapshot.isError()) {
+        LOG(WARNING) << "Ignoring the local filter snapshot at " << snapshotPath.get() << ": "
+                     << snapshot.error();
+        return false;
+    }
+
+    // However long ago it was written, the snapshot is as stale as the store's
+    // generations since, which reconciliation makes up for
+    LOG(INFO) << "Applying " << snapshot.get().entries_size() << " filter entries of generation "
+              << snapshot.get().generation() << " from the local snapshot at " << snapshotPath.get()
+              << " (written at " << formatTime(Time::create(snapshot.get().written_at()).get()) << ")";
+    hashmap<string, string> entries;
+    foreach (const FilterSnapshot::Entry& entry, snapshot.get().entries()) {
+        entries[entry.name()] = entry.value();
+        restoreEntry(entry.name(), entry.value());
+    }
+    snapshotEntries = entries;
+    snapshotGeneration = snapshot.get().generation();
+    applyRestoredFilters();
+    return true;
+}
+
+// The store wins: entries it no longer holds are removed, and those it holds
+// which differ from the snapshot are applied over it. Changes made through
+// the API meanwhile are kept, and committed once reconciled.
+void OfferFilteringHierarchicalDRFAllocatorProcess::reconcileSnapshot(
+    const hashmap<string, string>& stored)
+{
+    hashmap<string, string> applied = snapshotEntries.get();
+    snapshotEntries = None();
+    promotedGeneration = None();
+
+    if (snapshotGeneration.isSome() && snapshotGeneration.get() != filtersGeneration) {
+        LOG(WARNING) << "The local filter snapshot (generation " << snapshotGeneration.get()
+                     << ") is " << (filtersGeneration - std::min(filtersGeneration, snapshotGeneration.get()))
+                     << " generation(s) behind generation " << filtersGeneration << " of the store";
+    }
+    snapshotGeneration = None();
+
+    size_t removed = 0;
+    foreachkey (const string& name, applied) {
+        if (!stored.contains(name)) {
+            removeFilterEntry(name, stored);
+            ++removed;
+        }
+    }
+
+    size_t updated = 0;
+    foreachpair (const string& name, const string& value, stored) {
+        Option<string> previous = applied.get(name);
+        if (previous.isNone() || previous.get() != value) {
+            restoreEntry(name, value);
+            ++updated;
+        }
+    }
+
+    LOG(INFO) << "Reconciled the local filter snapshot with generation " << filtersGeneration
+              << " of the store: " << removed << " entries removed, " << updated << " applied";
+}
+
+// Removes the filter (or drain job) of a persisted entry
+void OfferFilteringHierarchicalDRFAllocatorProcess::removeFilterEntry(
+    const string& name,
+    const hashmap<string, string>& stored)
+{
+    if (strings::startsWith(name, FILTER_AGENT_PREFIX)) {
+        string agentId = name.substr(FILTER_AGENT_PREFIX.size());
+        Option<SlaveID> slaveId = agentIdsByString.get(agentId);
+        if (slaveId.isSome() && filteredAgents.contains(slaveId.get())) {
+            hashset<SlaveID> removed;
+            removed.insert(slaveId.get());
+            applyFilterDelta(hashset<SlaveID>(), removed);
+        }
+        removePendingFilter(agentId);
+        removeScheduledFilter(agentFilterKey(agentId));
+    } else if (strings::startsWith(name, FILTER_HOSTNAME_PREFIX)) {
+        string hostname = name.substr(FILTER_HOSTNAME_PREFIX.size());
+        removePendingHostnameFilter(hostname);
+        removeScheduledFilter(hostnameFilterKey(hostname));
+
+        // The filter may have matched its agent since the snapshot was applied
+        Option<SlaveID> slaveId = agentIdsByHostname.get(hostname);
+        if (slaveId.isSome() && filteredAgents.contains(slaveId.get()) &&
+                !stored.contains(FILTER_AGENT_PREFIX + slaveId.get().value())) {
+            hashset<SlaveID> removed;
+            removed.insert(slaveId.get());
+            applyFilterDelta(hashset<SlaveID>(), removed);
+        }
+    } else if (strings::startsWith(name, FILTER_SELECTOR_PREFIX)) {
+        Try<string> key = http::decode(name.substr(FILTER_SELECTOR_PREFIX.size()));
+        if (key.isError()) {
+            LOG(ERROR) << "Failed to decode filter entry '" << name << "': " << key.error();
+        } else if (selectors.contains(key.get())) {
+            removeSelector(key.get());
+        } else {
+            removeScheduledFilter(key.get());
+        }
+    } else if (strings::startsWith(name, FILTER_RESOURCES_PREFIX)) {
+        removeResourceFilter(name.substr(FILTER_RESOURCES_PREFIX.size()));
+    } else if (strings::startsWith(name, DRAIN_PREFIX)) {
+        drains.erase(name.substr(DRAIN_PREFIX.size()));
+    }
+}
+
+// Sends the entries written or expunged since the last call to the snapshotter,
+// which encodes and writes the snapshot on its own actor. Only the first call
+// after the filters are restored copies every entry.
+void OfferFilteringHierarchicalDRFAllocatorProcess::saveSnapshot()
+{
+    if (snapshotter.get() == nullptr || snapshotEntries.isSome()) {
+        return;
+    }
+
+    if (!snapshotSeeded) {
+        hashmap<string, string> entries;
+        foreachpair (const string& name, const Variable& variable, filterVariables) {
+            entries.put(name, variable.value());
+        }
+        snapshotSeeded = true;
+        snapshotChanged.clear();
+        process::dispatch(snapshotter.get(), &OfferFilterSnapshotProcess::reset, filtersGeneration, entries);
+        return;
+    }
+
+    if (snapshotChanged.empty()) {
+        return;
+    }
+
+    hashmap<string, Option<string>> changed;
+    foreach (const string& name, snapshotChanged) {
+        Option<Variable> variable = filterVariables.get(name);
+        changed.put(name, variable.isSome() ? Option<string>(variable.get().value()) : None());
+    }
+    snapshotChanged.clear();
+    process::dispatch(snapshotter.get(), &OfferFilterSnapshotProcess::update, filtersGeneration, changed);
+}
+
+void OfferFilterSnapshotProcess::reset(uint64_t generation, const hashmap<string, string>& entries)
+{
+    this->generation = generation;
+    this->entries = entries;
+    scheduleWrite();
+}
+
+void OfferFilterSnapshotProcess::update(
+    uint64_t generation,
+    const hashmap<string, Option<string>>& changed)
+{
+    this->generation = generation;
+    foreachpair (const string& name, const Option<string>& value, changed) {
+        if (value.isSome()) {
+            entries.put(name, value.get());
+        } else {
+            entries.erase(name);
+        }
+    }
+    scheduleWrite();
+}
+
+// Updates queued behind the write are applied before it runs
+void OfferFilterSnapshotProcess::scheduleWrite()
+{
+    if (!writeScheduled) {
+        writeScheduled = true;
+        process::dispatch(self(), &OfferFilterSnapshotProcess::write);
+    }
+}
+
+void OfferFilterSnapshotProcess::write()
+{
+    writeScheduled = false;
+    Try<Nothing> written = writeSnapshot(path, encodeSnapshot(generation, entries));
+    if (written.isError()) {
+        LOG(WARNING) << "Failed to write the local filter snapshot: " << written.error();
+    }
+}
+
+// Reads filters stored as one JSON document by earlier versions of the module;
+// they are migrated to per-filter entries by the next commit
+void OfferFilteringHierarchicalDRFAllocatorProcess::restoreLegacyFilteredAgents(
+    const Future<Variable>& variable)
+{
+    if (!variable.isReady()) {
+        LOG(ERROR) << "Failed to fetch filtered agents: "
+                   << (variable.isFailed() ? variable.failure() : "discarded");
+        delay(RESTORE_RETRY_INTERVAL, self(),
+            &OfferFilteringHierarchicalDRFAllocatorProcess::restoreFilteredAgents);
+        return;
+    }
+
+    // Only the legacy filters are stored, none of the entries the snapshot had
+    if (snapshotEntries.isSome()) {
+        reconcileSnapshot(hashmap<string, string>());
+    }
+
+    string serialized = variable.get().value();
+    if (!serialized.empty()) {
+        LOG(INFO) << "Attepting to restore filtered agents: " << serialized;
+        Try<JSON::Object> body_ = JSON::parse<JSON::Object>(serialized);
+        if (body_.isError()) {
+            LOG(ERROR) << "Failed to parse serialized filters '" << serialized << "': " << body_.error();
+        } else {
+            auto body = body_.get();
+            if (body.values.count("filters") == 1) {
+                auto filters = body.values["filters"].as<JSON::Array>();
+                for ( auto const &filter : filters.values) {
+                    addPendingFilter(filter.as<JSON::Object>(), true);
+                }
+            }
+            legacyVariable = variable.get();
+        }
+    }
+
+    applyRestoredFilters();
+}
+
+// Restores a filter stored in the JSON form of earlier formats
+void OfferFilteringHierarchicalDRFAllocatorProcess::addPendingFilter(
+    const JSON::Object& filter,
+    bool migrate)
+{
+    hashmap<string, string> values = stringValues(filter);
+
+    FilterSpec spec;
+    spec.agentId = values.get("agentId").getOrElse("");
+    spec.hostname = values.get("hostname").getOrElse("");
+
+    Try<Option<ResourceFilter>> resourceFilter = parseResourceFilter(filter);
+    if (resourceFilter.isError()) {
+        LOG(ERROR) << "Ignoring invalid filter " << stringify(filter) << ": " << resourceFilter.error();
+        return;
+    }
+    spec.resourceFilter = resourceFilter.get();
+
+    Result<FilterSelector> selector = findSelector(values);
+    if (selector.isError()) {
+        LOG(ERROR) << "Ignoring invalid filter " << stringify(filter) << ": " << selector.error();
+        return;
+    } else if (selector.isSome()) {
+        spec.selector = selector.get();
+    }
+
+    Try<Option<FilterScope>> scope = parseScope(filter);
+    if (scope.isError()) {
+        LOG(ERROR) << "Ignoring invalid filter " << stringify(filter) << ": " << scope.error();
+        return;
+    }
+    spec.scope = scope.get();
+
+    // Filters which expired while no master was leading are dropped (and expunged)
+    Try<FilterSchedule> schedule = parseSchedule(values);
+    if (schedule.isError() && spec.resourceFilter.isNone()) {
+        string key = selector.isSome()
+            ? selectorKey(selector.get())
+            : (!spec.agentId.empty() ? agentFilterKey(spec.agentId) : hostnameFilterKey(spec.hostname));
+        LOG(INFO) << "Dropping filter " << key << ": " << schedule.error();
+        markDirty(key);
+        return;
+    } else if (schedule.isSome()) {
+        spec.schedule = schedule.get();
+    }
+
+    addPendingFilter(spec, migrate);
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::addPendingFilter(
+    const FilterSpec& filter,
+    bool migrate)
+{
+    const string& agentId = filter.agentId;
+    const string& hostname = filter.hostname;
+
+    // Resource filters withhold resources of the agent once it re-registers
+    if (filter.resourceFilter.isSome()) {
+        if (agentId.empty()) {
+            LOG(ERROR) << "Ignoring resource filter of '" << hostname << "': no 'agentId'";
+            return;
+        }
+        ResourceFilter resourceFilter = filter.resourceFilter.get();
+        resourceFilter.hostname = hostname;
+        resourceFilters.put(agentId, resourceFilter);
+        if (migrate) {
+            dirtyResourceFilters.insert(agentId);
+        }
+        filtersChanged(FILTER_ADDED, resourceFilterJSON(agentId, resourceFilter));
+        updateWithheld(agentId);
+        return;
+    }
+
+    string key = filter.selector.isSome()
+        ? selectorKey(filter.selector.get())
+        : (!agentId.empty() ? agentFilterKey(agentId) : hostnameFilterKey(hostname));
+
+    // Filters which expired while no master was leading are dropped (and expunged)
+    if (filter.schedule.expiresAt.isSome() && filter.schedule.expiresAt.get() <= Clock::now()) {
+        LOG(INFO) << "Dropping filter " << key << ": expired at " << formatTime(filter.schedule.expiresAt.get());
+        markDirty(key);
+        return;
+    }
+
+    JSON::Object described = filter.selector.isSome()
+        ? selectorJSON(filter.selector.get())
+        : filterJSON(agentId, hostname);
+    bool deferred = scheduleFilter(key, described, filter.schedule);
+    scopeFilter(key, described, filter.scope);
+    if (deferred) {
+        return;
+    }
+
+    // The filter keeps the time it took effect with the previous leader
+    if (filter.startedAt.isSome()) {
+        filterStarts.put(key, filter.startedAt.get());
+    }
+
+    if (filter.selector.isSome()) {
+        // Selectors apply to the agents registered so far, and to those yet to register
+        addSelector(filter.selector.get());
+    } else if (!agentId.empty()) {
+        pendingFilters[agentId] = hostname;
+        if (migrate) {
+            dirtyAgentFilters.insert(agentId);
+        }
+        filtersChanged(FILTER_ADDED, describeFilter(filterJSON(agentId, hostname), key));
+    } else if (!hostname.empty()) {
+        pendingHostnameFilters.insert(hostname);
+        if (migrate) {
+            dirtyHostnameFilters.insert(hostname);
+        }
+        filtersChanged(FILTER_ADDED, describeFilter(filterJSON("", hostname), key));
+    }
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::applyRestoredFilters()
+{
+    // Normally no agent has re-registered yet, but the fetch may have raced
+    // with some of them
+    hashset<SlaveID> added;
+    foreachkey (const SlaveID& agentId, this->slaves) {
+        if (matchPendingFilter(agentId)) {
+            added.insert(agentId);
+        }
+    }
+    applyFilterDelta(added, hashset<SlaveID>());
+
+    // Restored (and reconciled) as committed: the versions carry on from the manifest
+    if (snapshotEntries.isNone() && manifestVariable.isSome() && !manifestVariable.get().value().empty()) {
+        restoreFiltersVersion(manifestVariable.get().value());
+    }
+
+    // Called again once the store has been reconciled with the local snapshot
+    if (!restored) {
+        restored = true;
+        restoration.set(Nothing());
+        filterMetrics.restore_duration.stop();
+    }
+
+    // Running drain jobs resume where the previous leader left off, once the
+    // store has confirmed them: a job finished or cancelled there takes no step
+    if (!drainsResumed && snapshotEntries.isNone()) {
+        drainsResumed = true;
+        foreachvalue (const DrainJob& job, drains) {
+            if (job.state == DRAIN_RUNNING) {
+                LOG(INFO) << "Resuming drain job " << job.id;
+                delay(job.interval, self(), &OfferFilteringHierarchicalDRFAllocatorProcess::advanceDrain, job.id);
+            }
+        }
+    }
+    LOG(INFO) << "Restored " << added.size() << " filter(s); "
+              << (pendingFilters.size() + pendingHostnameFilters.size())
+              << " filter(s) pending agent re-registration";
+
+    scheduleCommit();
+    saveSnapshot();
+}
+
+Future<Nothing> OfferFilteringHierarchicalDRFAllocatorProcess::filtersRestored()
+{
+    return restoration.future();
+}
+
+// Consumes the pending filter (if any) matching the specified agent
+bool OfferFilteringHierarchicalDRFAllocatorProcess::matchPendingFilter(const SlaveID& slaveId)
+{
+    const string& hostname = this->slaves.at(slaveId).hostname;
+
+    auto it = pendingFilters.find(slaveId.value());
+    if (it != pendingFilters.end() && (it->second.empty() || it->second == hostname)) {
+        filtersChanged(FILTER_REMOVED, filterJSON(it->first, it->second));
+        pendingFilters.erase(it);
+        return true;
+    }
+
+    if (pendingHostnameFilters.erase(hostname) > 0) {
+        dirtyHostnameFilters.insert(hostname);
+        filtersChanged(FILTER_REMOVED, filterJSON("", hostname));
+
+        // The filter's expiry and scope (if any) now apply to the agent it matched
+        moveFilter(hostnameFilterKey(hostname), agentFilterKey(slaveId.value()));
+        return true;
+    }
+    return false;
+}
+
+
+// Responds to requests which must be served by another (leading) master
+Option<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::redirectToLeader(
+    const http::Request &request)
+{
+    filterMetrics.leader_lookup_latency.start();
+    Option<string> leader = getLeader();
+    filterMetrics.leader_lookup_latency.stop();
+
+    if (leader.isNone()) {
+        // No leader; punt!
+        return http::ServiceUnavailable("No leader elected");
+    } else if (leader.get() != CURRENT_MASTER) {
+        // Redirect the request to the current leader
+        return http::TemporaryRedirect("//" + leader.get() + stringify(request.url));
+    }
+    return None();
+}
+
+Try<FilterRequest> OfferFilteringHierarchicalDRFAllocatorProcess::parseFilterRequest(
+    const http::Request& request)
+{
+    FilterRequest parsed;
+    parsed.request = request;
+    parsed.request.body.clear();
+
+    if (request.method != "POST" && request.method != "PUT" && request.method != "PATCH") {
+        return parsed;
+    }
+
+    Try<JSON::Object> body = JSON::parse<JSON::Object>(request.body);
+    if (body.isError()) {
+        return Error(body.error());
+    }
+
+    if (request.method == "POST") {
+        Try<FilterSpec> filter = parseFilterSpec(body.get());
+        if (filter.isError()) {
+            return Error(filter.error());
+        }
+        parsed.filters.push_back(filter.get());
+        return parsed;
+    }
+
+    ostringstream errMsg;
+    if (request.method == "PATCH") {
+        Result<JSON::Array> add = body.get().find<JSON::Array>("add");
+        Result<JSON::Array> remove = body.get().find<JSON::Array>("remove");
+        if (add.isError() || remove.isError() || (add.isNone() && remove.isNone())) {
+            return Error("body requires an 'add' and/or a 'remove' array");
+        }
+        if (add.isSome()) {
+            parseFilterSpecs(add.get(), &parsed.filters, &errMsg);
+        }
+        if (remove.isSome()) {
+            parseFilterSpecs(remove.get(), &parsed.removals, &errMsg);
+        }
+    } else {
+        Result<JSON::Array> filters = body.get().find<JSON::Array>("filters");
+        if (!filters.isSome()) {
+            return Error("body requires a 'filters' array");
+        }
+        parseFilterSpecs(filters.get(), &parsed.filters, &errMsg);
+    }
+
+    if (!errMsg.str().empty()) {
+        return Error("One or more filters are invalid: " + errMsg.str().substr(2));
+    }
+    return parsed;
+}
+
+// Parses the request before handing it to the allocator; GET and DELETE carry
+// only parameters, and are forwarded as they are
+Future<http::Response> OfferFilterFrontendProcess::offerFilters(const http::Request &request)
+{
+    if (request.method != "GET" && request.method != "POST" && request.method != "PUT" &&
+            request.method != "PATCH" && request.method != "DELETE") {
+        return http::MethodNotAllowed({"GET","POST","PUT","PATCH","DELETE"}, request.method);
+    }
+
+    auto contentType = request.headers.get("Content-Type");
+    if ((request.method == "POST" || request.method == "PUT" || request.method == "PATCH") &&
+            contentType.isSome() && contentType.get() != "application/json") {
+        return http::UnsupportedMediaType("expected: application/json");
+    }
+
+    Try<FilterRequest> parsed = OfferFilteringHierarchicalDRFAllocatorProcess::parseFilterRequest(request);
+    if (parsed.isError()) {
+        return http::BadRequest(parsed.error());
+    }
+
+    return process::dispatch(allocator, &OfferFilteringHierarchicalDRFAllocatorProcess::offerFilters,
+        parsed.get());
+}
+
+Future<http::Response> OfferFilterFrontendProcess::drainJobs(const http::Request &request)
+{
+    return process::dispatch(allocator, &OfferFilteringHierarchicalDRFAllocatorProcess::drainJobs,
+        request);
+}
+
+// Handles a request, timing how long it holds the allocator actor
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::offerFilters(
+    const FilterRequest& request)
+{
+    filterMetrics.request_latency.start();
+    Future<http::Response> response = _offerFilters(request);
+    filterMetrics.request_latency.stop();
+    return response;
+}
+
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::_offerFilters(
+    const FilterRequest& request)
+{
+    Option<http::Response> redirect = redirectToLeader(request.request);
+    if (redirect.isSome()) {
+        return redirect.get();
+    }
+
+    const string& method = request.request.method;
+    if (method == "GET") {
+        ++filterMetrics.requests_get;
+        return getOfferFilters(request.request);
+    }
+
+    Option<http::Response> precondition = checkIfMatch(request.request);
+    if (method == "POST") {
+        ++filterMetrics.mutations_post;
+        return precondition.isSome() ? precondition.get() : addOfferFilter(request);
+    } else if (method == "PUT") {
+        ++filterMetrics.mutations_put;
+        return precondition.isSome() ? precondition.get() : updateOfferFilters(request);
+    } else if (method == "PATCH") {
+        ++filterMetrics.mutations_patch;
+        return precondition.isSome() ? precondition.get() : patchOfferFilters(request);
+    } else if (method == "DELETE") {
+        ++filterMetrics.mutations_delete;
+        return precondition.isSome() ? precondition.get() : removeOfferFilter(request.request);
+    } else {
+        return http::MethodNotAllowed({"GET","POST","PUT","PATCH","DELETE"}, method);
+    }
+}
+
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::drainJobs(
+    const http::Request &request)
+{
+    filterMetrics.request_latency.start();
+    Future<http::Response> response = _drainJobs(request);
+    filterMetrics.request_latency.stop();
+    return response;
+}
+
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::_drainJobs(
+    const http::Request &request)
+{
+    Option<http::Response> redirect = redirectToLeader(request);
+    if (redirect.isSome()) {
+        return redirect.get();
+    }
+
+    if (request.method == "GET") {
+        return reportDrains(request);
+    } else if (request.method == "POST") {
+        return startDrain(request);
+    } else if (request.method == "DELETE") {
+        return cancelDrain(request);
+    } else {
+        return http::MethodNotAllowed({"GET","POST","DELETE"}, request.method);
+    }
+}
+
+http::Response OfferFilteringHierarchicalDRFAllocatorProcess::reportDrains(
+    const http::Request &request)
+{
+    Option<string> id = request.url.query.get("id");
+    if (id.isSome()) {
+        if (!drains.contains(id.get())) {
+            return http::NotFound("No drain job " + id.get());
+        }
+        return http::OK(drainJSON(drains.at(id.get())));
+    }
+
+    JSON::Array jobs;
+    foreachvalue (const DrainJob& job, drains) {
+        jobs.values.push_back(drainJSON(job));
+    }
+
+    JSON::Object body;
+    body.values["drains"] = std::move(jobs);
+    return http::OK(body);
+}
+
+// Starts a drain job over the agents named in 'agents' and/or matched by a selector
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::startDrain(
+    const http::Request &request)
+{
+    auto contentType = request.headers.get("Content-Type");
+    if (contentType.isSome() && contentType.get() != "application/json") {
+        return http::UnsupportedMediaType("expected: application/json");
+    }
+
+    Try<JSON::Object> body_ = JSON::parse<JSON::Object>(request.body);
+    if (body_.isError()) {
+        return http::BadRequest(body_.error());
+    }
+    JSON::Object body = body_.get();
+
+    DrainJob job;
+    job.id = UUID::random().toString();
+    job.state = DRAIN_RUNNING;
+    job.next = 0;
+    hashset<string> seen;
+
+    Result<FilterSelector> selector = findSelector(stringValues(body));
+    if (selector.isError()) {
+        return http::BadRequest(selector.error());
+    } else if (selector.isSome()) {
+        foreachpair (const SlaveID& slaveId, const Slave& agent, this->slaves) {
+            if (matchesSelector(selector.get(), slaveId)) {
+                job.agents.push_back(std::make_pair(slaveId.value(), agent.hostname));
+                seen.insert(slaveId.value());
+            }
+        }
+        std::sort(job.agents.begin(), job.agents.end(),
+            [](const pair<string, string>& left, const pair<string, string>& right) {
+                return left.second < right.second;
+            });
+    }
+
+    if (body.values.count("agents") > 0) {
+        if (!body.values["agents"].is<JSON::Array>()) {
+            return http::BadRequest("'agents' must be an array of filters naming an 'agentId' and/or 'hostname'");
+        }
+        foreach (const JSON::Value& item, body.values["agents"].as<JSON::Array>().values) {
+            if (!item.is<JSON::Object>()) {
+                return http::BadRequest("'agents' must be an array of filters naming an 'agentId' and/or 'hostname'");
+            }
+            hashmap<string, string> values = stringValues(item.as<JSON::Object>());
+            Option<SlaveID> slaveId = findSlaveID(
+                values.get("agentId").getOrElse(""), values.get("hostname").getOrElse(""));
+            if (slaveId.isNone()) {
+                return http::BadRequest("No such agent matching " + stringify(item));
+            } else if (seen.insert(slaveId.get().value()).second) {
+                job.agents.push_back(std::make_pair(slaveId.get().value(), this->slaves.at(slaveId.get()).hostname));
+            }
+        }
+    }
+
+    if (job.agents.empty()) {
+        return http::BadRequest("No agents to drain; specify 'agents' and/or a selector");
+    }
+
+    Result<double> maxConcurrent = numberValue(body, "maxConcurrent");
+    if (maxConcurrent.isError()) {
+        return http::BadRequest(maxConcurrent.error());
+    } else if (maxConcurrent.isSome()) {
+        if (maxConcurrent.get() < 1 || maxConcurrent.get() != static_cast<size_t>(maxConcurrent.get())) {
+            return http::BadRequest("'maxConcurrent' must be a positive integer");
+        }
+        job.maxConcurrent = static_cast<size_t>(maxConcurrent.get());
+    }
+
+    Result<double> maxCapacityFraction = numberValue(body, "maxCapacityFraction");
+    if (maxCapacityFraction.isError()) {
+        return http::BadRequest(maxCapacityFraction.error());
+    } else if (maxCapacityFraction.isSome()) {
+        if (maxCapacityFraction.get() <= 0 || maxCapacityFraction.get() > 1) {
+            return http::BadRequest("'maxCapacityFraction' must be within (0, 1]");
+        }
+        job.maxCapacityFraction = maxCapacityFraction.get();
+    }
+
+    if (job.maxConcurrent.isNone() && job.maxCapacityFraction.isNone()) {
+        return http::BadRequest("Specify 'maxConcurrent' and/or 'maxCapacityFraction'");
+    }
+
+    job.interval = DRAIN_DEFAULT_INTERVAL;
+    Option<string> interval = stringValues(body).get("interval");
+    if (interval.isSome()) {
+        Try<Duration> interval_ = Duration::parse(interval.get());
+        if (interval_.isError() || interval_.get() <= Duration::zero()) {
+            return http::BadRequest("'interval' must be a positive duration, e.g., '1mins'");
+        }
+        job.interval = interval_.get();
+    }
+
+    Result<double> batchSize = numberValue(body, "batchSize");
+    if (batchSize.isError()) {
+        return http::BadRequest(batchSize.error());
+    } else if (batchSize.isSome() &&
+            (batchSize.get() < 1 || batchSize.get() != static_cast<size_t>(batchSize.get()))) {
+        return http::BadRequest("'batchSize' must be a positive integer");
+    }
+    job.batchSize = batchSize.isSome() ? static_cast<size_t>(batchSize.get()) : 1;
+
+    LOG(INFO) << "Starting drain job " << job.id << " over " << job.agents.size() << " agent(s)";
+    drains.put(job.id, job);
+    dirtyDrains.insert(job.id);
+
+    // Until the restored jobs are confirmed by the store, new ones are resumed along with them
+    if (drainsResumed) {
+        advanceDrain(job.id);
+    }
+
+    return persistAndRespond(http::OK(drainJSON(drains.at(job.id))));
+}
+
+// Cancels a running drain job, leaving its agents filtered so far filtered;
+// a job which is no longer running is forgotten
+Future<http::Response> OfferFilteringHierarchicalDRFAllocatorProcess::cancelDrain(
+    const http::Request &request)
+{
+    Option<string> id = request.url.query.get("id");
+    if (id.isNone()) {
+        return http::BadRequest("Parameter 'id' is required");
+    } else if (!drains.contains(id.get())) {
+        return http::NotFound("No drain job " + id.get());
+    }
+
+    DrainJob& job = drains.at(id.get());
+    JSON::Object status;
+    if (job.state == DRAIN_RUNNING) {
+        LOG(INFO) << "Cancelling drain job " << job.id;
+        job.state = DRAIN_CANCELLED;
+        status = drainJSON(job);
+    } else {
+        status = drainJSON(job);
+        drains.erase(id.get());
+    }
+    dirtyDrains.insert(id.get());
+    return persistAndRespond(http::OK(status));
+}
+
+// Takes one step of a running drain job: agents which no longer run tasks
+// are drained, and the next agents are filtered within the job's limits
+void OfferFilteringHierarchicalDRFAllocatorProcess::advanceDrain(const string& id)
+{
+    if (!drains.contains(id) || drains.at(id).state != DRAIN_RUNNING) {
+        return;
+    }
+    DrainJob& job = drains.at(id);
+    bool changed = false;
+
+    foreach (const string& agentId, hashset<string>(job.draining)) {
+        Option<SlaveID> slaveId = agentIdsByString.get(agentId);
+        if (slaveId.isSome() && !filteredAgents.contains(slaveId.get()) && !isFiltered(slaveId.get())) {
+            job.draining.erase(agentId);
+            job.lifted.insert(agentId);
+            changed = true;
+        } else if (slaveId.isNone() || this->slaves.at(slaveId.get()).allocated.empty()) {
+            job.draining.erase(agentId);
+            job.drained.insert(agentId);
+            changed = true;
+        }
+    }
+
+    hashset<SlaveID> added;
+    size_t batch = 0;
+    while (job.next < job.agents.size() && batch < job.batchSize) {
+        if (job.maxConcurrent.isSome() && job.draining.size() >= job.maxConcurrent.get()) {
+            break;
+        }
+
+        // At least one agent drains at a time, however large
+        const pair<string, string>& agent = job.agents[job.next];
+        if (job.maxCapacityFraction.isSome() && !job.draining.empty()) {
+            hashset<string> candidates = job.draining;
+            candidates.insert(agent.first);
+            if (capacityShare(candidates) > job.maxCapacityFraction.get()) {
+                break;
+            }
+        }
+
+        // The job pauses, to retry at its next step, while the guard rails forbid going further
+        Option<SlaveID> slaveId = agentIdsByString.get(agent.first);
+        if (slaveId.isSome()) {
+            hashset<SlaveID> candidates = added;
+            candidates.insert(slaveId.get());
+            Option<string> violation = checkGuardRails(filteringCapacity(candidates));
+            if (violation.isSome()) {
+                LOG(WARNING) << "Drain job " << id << " paused: " << violation.get();
+                break;
+            }
+        }
+
+        ++job.next;
+        ++batch;
+        if (slaveId.isSome()) {
+            added.insert(slaveId.get());
+            job.draining.insert(agent.first);
+        } else {
+            // Filtered as it re-registers, with nothing left to drain
+            if (!pendingFilters.contains(agent.first)) {
+                pendingFilters[agent.first] = agent.second;
+                dirtyAgentFilters.insert(agent.first);
+                filtersChanged(FILTER_ADDED, describeFilter(
+                    filterJSON(agent.first, agent.second), agentFilterKey(agent.first)));
+            }
+            job.drained.insert(agent.first);
+        }
+    }
+
+    if (!added.empty()) {
+        LOG(INFO) << "Drain job " << id << " filtering " << added.size() << " agent(s)";
+        applyFilterDelta(added, hashset<SlaveID>());
+    }
+
+    if (job.next == job.agents.size() && job.draining.empty()) {
+        LOG(INFO) << "Drain job " << id << " completed; " << job.drained.size() << " agent(s) drained";
+        job.state = DRAIN_COMPLETED;
+        changed = true;
+    }
+
+    if (changed || batch > 0) {
+        dirtyDrains.insert(id);
+        scheduleCommit();
+    }
+
+    if (job.state == DRAIN_RUNNING) {
+        delay(job.interval, self(), &OfferFilteringHierarchicalDRFAllocatorProcess::advanceDrain, id);
+    }
+}
+
+// The larger of the shares of the cluster's cpus and mem held by the agents, from
+// the capacity aggregates (so at the cost of the given agents only)
+double OfferFilteringHierarchicalDRFAllocatorProcess::capacityShare(
+    const hashset<string>& agentIds) const
+{
+    double totalCpus = clusterAmount(totalCapacity, "cpus");
+    double totalMem = clusterAmount(totalCapacity, "mem");
+
+    double cpus = 0;
+    double mem = 0;
+    foreach (const string& agentId, agentIds) {
+        Option<SlaveID> slaveId = agentIdsByString.get(agentId);
+        if (slaveId.isSome() && agentCapacities.contains(slaveId.get())) {
+            const Capacity& capacity = agentCapacities.at(slaveId.get());
+            cpus += clusterAmount(capacity, "cpus");
+            mem += clusterAmount(capacity, "mem");
+        }
+    }
+
+    return std::max(totalCpus > 0 ? cpus / totalCpus : 0, totalMem > 0 ? mem / totalMem : 0);
+}
+
+// The persisted form of a drain job: its status, along with its agents
+Option<string> OfferFilteringHierarchicalDRFAllocatorProcess::serializeDrain(const string& id)
+{
+    Option<DrainJob> job = drains.get(id);
+    if (job.isNone()) {
+        return None();
+    }
+
+    JSON::Array agents;
+    foreach (const pair<string, string>& agent, job.get().agents) {
+        agents.values.push_back(filterJSON(agent.first, agent.second));
+    }
+
+    JSON::Object json = drainJSON(job.get());
+    json.values["agentList"] = agents;
+    json.values["drainingAgents"] = stringArray(job.get().draining);
+    json.values["drainedAgents"] = stringArray(job.get().drained);
+    json.values["liftedAgents"] = stringArray(job.get().lifted);
+    return encodeEntry(json);
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::restoreDrain(const JSON::Object& json)
+{
+    Result<JSON::String> id = json.find<JSON::String>("id");
+    Result<JSON::String> state = json.find<JSON::String>("state");
+    Result<JSON::String> interval = json.find<JSON::String>("interval");
+    Result<JSON::Array> agents = json.find<JSON::Array>("agentList");
+    Result<double> next = numberValue(json, "filtered");
+    Result<double> batchSize = numberValue(json, "batchSize");
+    Result<double> maxConcurrent = numberValue(json, "maxConcurrent");
+    Result<double> maxCapacityFraction = numberValue(json, "maxCapacityFraction");
+    Try<Duration> interval_ = interval.isSome()
+        ? Duration::parse(interval.get().value)
+        : Try<Duration>(Error("missing"));
+
+    if (!id.isSome() || !state.isSome() || !agents.isSome() || !next.isSome() || !batchSize.isSome() ||
+            interval_.isError() || maxConcurrent.isError() || maxCapacityFraction.isError()) {
+        LOG(ERROR) << "Ignoring invalid drain job " << stringify(json);
+        return;
+    }
+
+    DrainJob job;
+    job.id = id.get().value;
+    job.state = state.get().value;
+    foreach (const JSON::Value& agent, agents.get().values) {
+        if (agent.is<JSON::Object>()) {
+            hashmap<string, string> values = stringValues(agent.as<JSON::Object>());
+            job.agents.push_back(std::make_pair(
+                values.get("agentId").getOrElse(""), values.get("hostname").getOrElse("")));
+        }
+    }
+    if (maxConcurrent.isSome()) {
+        job.maxConcurrent = static_cast<size_t>(maxConcurrent.get());
+    }
+    if (maxCapacityFraction.isSome()) {
+        job.maxCapacityFraction = maxCapacityFraction.get();
+    }
+    job.interval = interval_.get();
+    job.batchSize = static_cast<size_t>(batchSize.get());
+    job.next = std::min(static_cast<size_t>(next.get()), job.agents.size());
+    job.draining = stringSet(json, "drainingAgents");
+    job.drained = stringSet(json, "drainedAgents");
+    job.lifted = stringSet(json, "liftedAgents");
+
+    drains.put(job.id, job);
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::recover(
+      const int _expectedAgentCount,
+      const hashmap<std::string, Quota>& quotas)
+{
+
+    HierarchicalDRFAllocatorProcess::recover(_expectedAgentCount, quotas);
+
+    foreachpair (const string& role, const Quota& quota, quotas) {
+        quotaGuarantees.put(role, Resources(quota.info.guarantee()));
+    }
+
+    // Scoped filters are enforced on the offers of each allocation pass; the
+    // callback is wrapped here since initialize() differs across Mesos versions
+    if (!forwardOffers) {
+        forwardOffers = this->offerCallback;
+        this->offerCallback = lambda::bind(
+            &OfferFilteringHierarchicalDRFAllocatorProcess::filterOffers, this, lambda::_1, lambda::_2);
+    }
+
+    // The master only recovers the allocator once it has been elected
+    recovered = true;
+    filterMetrics.restore_duration.start();
+
+    // The store is still read, in the background when the filters held while
+    // standing by, or else the local snapshot, were applied
+    if (!applyStandbyFilters()) {
+        loadSnapshot();
+    }
+    restoreFilteredAgents();
+}
+
+// Gets {ip}:{port} of the current leader; returns ":" when the current master is leader;
+// returns None when no leader has been elected, or when this master has been elected
+// but has not yet recovered (and restored its filters). Served from the state cached
+// by the leader detector, so this never blocks the allocator.
+Option<string> OfferFilteringHierarchicalDRFAllocatorProcess::getLeader() const
+{
+    if (recovered) {
+        return restored ? Some(CURRENT_MASTER) : Option<string>::none();
+    } else if (leader.isSome() && leader.get() == CURRENT_MASTER) {
+        return None();
+    }
+    return leader;
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::detectLeader(
+    const Option<zookeeper::Group::Membership>& previous)
+{
+    masterDetector->detect(previous)
+        .onAny(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::_detectLeader, lambda::_1));
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::_detectLeader(
+    const Future<Option<zookeeper::Group::Membership>>& membership)
+{
+    if (!membership.isReady()) {
+        LOG(WARNING) << "Failed to detect the leading master: "
+                     << (membership.isFailed() ? membership.failure() : "discarded");
+        leader = None();
+        delay(MASTER_DETECTION_RETRY_INTERVAL, self(),
+            &OfferFilteringHierarchicalDRFAllocatorProcess::detectLeader,
+            Option<zookeeper::Group::Membership>::none());
+    } else if (membership.get().isNone()) {
+        LOG(INFO) << "No leading master detected";
+        leader = None();
+        detectLeader(None());
+    } else {
+        masterGroup->data(membership.get().get())
+            .onAny(defer(self(), &OfferFilteringHierarchicalDRFAllocatorProcess::__detectLeader,
+                membership.get().get(), lambda::_1));
+    }
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::__detectLeader(
+    const zookeeper::Group::Membership& membership,
+    const Future<Option<string>>& data)
+{
+    if (!data.isReady() || data.get().isNone()) {
+        LOG(WARNING) << "Failed to read the leading master's info: "
+                     << (data.isFailed() ? data.failure() : "not available");
+        leader = None();
+        delay(MASTER_DETECTION_RETRY_INTERVAL, self(),
+            &OfferFilteringHierarchicalDRFAllocatorProcess::detectLeader,
+            Option<zookeeper::Group::Membership>::none());
+        return;
+    }
+
+    Option<string> pid;
+    Option<string> label = membership.label();
+    if (label.isSome() && label.get() == MASTER_INFO_JSON_LABEL) {
+        Try<JSON::Object> info = JSON::parse<JSON::Object>(data.get().get());
+        if (info.isSome()) {
+            Result<JSON::String> pid_ = info.get().find<JSON::String>("pid");
+            if (pid_.isSome()) {
+                pid = pid_.get().value;
+            }
+        }
+    } else if (label.isSome() && label.get() == MASTER_INFO_LABEL) {
+        MasterInfo info;
+        if (info.ParseFromString(data.get().get())) {
+            pid = info.pid();
+        }
+    }
+
+    if (pid.isNone()) {
+        LOG(WARNING) << "Failed to parse the leading master's info (label: "
+                     << (label.isSome() ? label.get() : "none") << ")";
+        leader = None();
+    } else if (pid.get() == "master@" + stringify(process::address())) {
+        leader = CURRENT_MASTER;
+    } else {
+        vector<string> parts = strings::split(pid.get(), "@");
+        leader = parts.back();
+    }
+
+    LOG(INFO) << "Detected leading master: " << (leader.isSome() ? leader.get() : "none");
+    detectLeader(membership);
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::addSlave(
+      const SlaveID& slaveId,
+      const SlaveInfo& slaveInfo,
+      const Option<Unavailability>& unavailability,
+      const Resources& total,
+      const hashmap<FrameworkID, Resources>& used)
+{
+    // The agent is offered once the filters it matches are applied
+    bool due = holdAllocation();
+    HierarchicalDRFAllocatorProcess::addSlave(slaveId, slaveInfo, unavailability, total, used);
+    indexAgent(slaveId);
+    indexSelectable(slaveId, slaveInfo);
+    matchSelectors(slaveId);
+    updateWithheld(slaveId.value());
+
+    if (matchPendingFilter(slaveId)) {
+        hashset<SlaveID> added;
+        added.insert(slaveId);
+        applyFilterDelta(added, hashset<SlaveID>());
+    }
+
+    if (due) {
+        this->resume();
+        allocate(slaveId);
+    }
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::removeSlave(const SlaveID& slaveId)
+{
+    unindexAgent(slaveId);
+    if (filteredAgents.erase(slaveId) > 0) {
+        dirtyAgentFilters.insert(slaveId.value());
+        filtersChanged(FILTER_REMOVED, filterJSON(slaveId.value(), this->slaves.at(slaveId).hostname));
+        forgetFilter(agentFilterKey(slaveId.value()));
+    }
+    deactivatedAgents.erase(slaveId);
+    agentExclusions.erase(slaveId);
+    foreach (const FrameworkID& frameworkId, excludedFrom.get(slaveId).getOrElse(hashset<FrameworkID>())) {
+        excludeFramework(slaveId, frameworkId, false);
+    }
+    excludedFrom.erase(slaveId);
+    withheldResources.erase(slaveId);
+
+    Option<ResourceFilter> resourceFilter = resourceFilters.get(slaveId.value());
+    if (resourceFilter.isSome()) {
+        resourceFilters.erase(slaveId.value());
+        dirtyResourceFilters.insert(slaveId.value());
+        filtersChanged(FILTER_REMOVED, resourceFilterJSON(slaveId.value(), resourceFilter.get()));
+    }
+    HierarchicalDRFAllocatorProcess::removeSlave(slaveId);
+    updateCapacity(slaveId);
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::updateSlave(
+      const SlaveID& slaveId,
+      const Resources& oversubscribedResources)
+{
+    HierarchicalDRFAllocatorProcess::updateSlave(slaveId, oversubscribedResources);
+    indexAgent(slaveId);
+
+    // The agent's total changed
+    updateWithheld(slaveId.value());
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::addFramework(
+      const FrameworkID& frameworkId,
+      const FrameworkInfo& frameworkInfo,
+      const hashmap<SlaveID, Resources>& used)
+{
+    if (agentExclusions.empty()) {
+        HierarchicalDRFAllocatorProcess::addFramework(frameworkId, frameworkInfo, used);
+        return;
+    }
+
+    // The framework is offered agents once excluded from those withheld from it
+    bool due = holdAllocation();
+    HierarchicalDRFAllocatorProcess::addFramework(frameworkId, frameworkInfo, used);
+    foreachkey (const SlaveID& slaveId, agentExclusions) {
+        if (isExcluded(slaveId, frameworkId)) {
+            excludeFramework(slaveId, frameworkId, true);
+            excludedFrom[slaveId].insert(frameworkId);
+        }
+    }
+
+    if (due) {
+        this->resume();
+        allocate();
+    }
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::removeFramework(
+      const FrameworkID& frameworkId)
+{
+    HierarchicalDRFAllocatorProcess::removeFramework(frameworkId);
+
+    vector<SlaveID> emptied;
+    foreachkey (const SlaveID& slaveId, excludedFrom) {
+        hashset<FrameworkID>& excluded = excludedFrom.at(slaveId);
+        if (excluded.erase(frameworkId) > 0 && excluded.empty()) {
+            emptied.push_back(slaveId);
+        }
+    }
+    foreach (const SlaveID& slaveId, emptied) {
+        excludedFrom.erase(slaveId);
+    }
+}
+
+// Deactivating a framework clears its filters, exclusions included
+void OfferFilteringHierarchicalDRFAllocatorProcess::deactivateFramework(
+      const FrameworkID& frameworkId)
+{
+    HierarchicalDRFAllocatorProcess::deactivateFramework(frameworkId);
+    restoreExclusions(frameworkId);
+}
+
+// Reviving offers clears the framework's filters, exclusions included, before
+// an allocation pass
+void OfferFilteringHierarchicalDRFAllocatorProcess::reviveOffers(
+      const FrameworkID& frameworkId)
+{
+    if (excludedFrom.empty()) {
+        HierarchicalDRFAllocatorProcess::reviveOffers(frameworkId);
+        return;
+    }
+
+    bool due = holdAllocation();
+    HierarchicalDRFAllocatorProcess::reviveOffers(frameworkId);
+    restoreExclusions(frameworkId);
+
+    if (due) {
+        this->resume();
+        allocate();
+    }
+}
+
+// Reservations and persistent volumes move the agent's total between roles
+void OfferFilteringHierarchicalDRFAllocatorProcess::updateAllocation(
+      const FrameworkID& frameworkId,
+      const SlaveID& slaveId,
+      const std::vector<Offer::Operation>& operations)
+{
+    HierarchicalDRFAllocatorProcess::updateAllocation(frameworkId, slaveId, operations);
+    updateWithheld(slaveId.value());
+}
+
+Future<Nothing> OfferFilteringHierarchicalDRFAllocatorProcess::updateAvailable(
+      const SlaveID& slaveId,
+      const std::vector<Offer::Operation>& operations)
+{
+    Future<Nothing> updated = HierarchicalDRFAllocatorProcess::updateAvailable(slaveId, operations);
+    if (updated.isReady()) {
+        updateWithheld(slaveId.value());
+    }
+    return updated;
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::activateSlave(const SlaveID& slaveId)
+{
+    deactivatedAgents.erase(slaveId);
+
+    // A filtered agent stays deactivated until its filter is removed
+    if (isFiltered(slaveId)) {
+        LOG(INFO) << "Suppressed activation of filtered agent " << slaveId;
+        return;
+    }
+    HierarchicalDRFAllocatorProcess::activateSlave(slaveId);
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::deactivateSlave(const SlaveID& slaveId)
+{
+    deactivatedAgents.insert(slaveId);
+    HierarchicalDRFAllocatorProcess::deactivateSlave(slaveId);
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::finalize()
+{
+    if (frontend.get() != nullptr) {
+        process::terminate(frontend.get());
+        process::wait(frontend.get());
+    }
+    if (snapshotter.get() != nullptr) {
+        process::terminate(snapshotter.get());
+        process::wait(snapshotter.get());
+    }
+    HierarchicalDRFAllocatorProcess::finalize();
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::setQuota(
+      const string& role,
+      const Quota& quota)
+{
+    HierarchicalDRFAllocatorProcess::setQuota(role, quota);
+    quotaGuarantees.put(role, Resources(quota.info.guarantee()));
+}
+
+void OfferFilteringHierarchicalDRFAllocatorProcess::removeQuota(const string& role)
+{
+    HierarchicalDRFAllocatorProcess::removeQuota(role);
+    quotaGuarantees.erase(role);
+}
+
+
+} // namespace modules
+} // namespace mesos
+} // namespace gettyimages
+
+namespace {
 
 using gettyimages::mesos::modules::OfferFilteringHierarchicalDRFAllocatorProcess;
 using gettyimages::mesos::modules::OfferFilteringHierarchicalDRFAllocator;
 using gettyimages::mesos::modules::DEFAULT_ZK_URL;
+using gettyimages::mesos::modules::MASTER_ZK_ENV;
+using gettyimages::mesos::modules::MASTER_WORK_DIR_ENV;
+using gettyimages::mesos::modules::SNAPSHOT_FILE;
+using gettyimages::mesos::modules::ZOOKEEPER_STORAGE;
+using gettyimages::mesos::modules::LEVELDB_STORAGE;
+using gettyimages::mesos::modules::IN_MEMORY_STORAGE;
+using gettyimages::mesos::modules::DEFAULT_STORAGE_PATH;
+using gettyimages::mesos::modules::ZK_STORAGE_SESSION_TIMEOUT;
+
+// Creates the storage selected by the 'storage' parameter; returns NULL when
+// the filters cannot be persisted
+Storage* createStorage(const hashmap<string, string>& parameters)
+{
+    string storage = parameters.get("storage").getOrElse(ZOOKEEPER_STORAGE);
+
+    if (storage == ZOOKEEPER_STORAGE) {
+        string zk_url = parameters.get("zk_url").getOrElse(DEFAULT_ZK_URL);
+        Try<zookeeper::URL> url = zookeeper::URL::parse(zk_url);
+        if (url.isError()) {
+            LOG(ERROR)
+                << "Failed to parse 'zk_url' parameter: '" << zk_url << "'; "
+                << "multi-master failover state will be unavailable for offer filters";
+            return nullptr;
+        }
+        LOG(INFO) << "Using ZooKeeper storage at 'zk_url': " << zk_url;
+        return new ZooKeeperStorage(url.get().servers, ZK_STORAGE_SESSION_TIMEOUT, url.get().path);
+    } else if (storage == LEVELDB_STORAGE) {
+        string path = parameters.get("storage_path").getOrElse(DEFAULT_STORAGE_PATH);
+        Try<Nothing> mkdir = os::mkdir(path);
+        if (mkdir.isError()) {
+            LOG(ERROR) << "Failed to create 'storage_path' " << path << ": " << mkdir.error();
+            return nullptr;
+        }
+        LOG(INFO) << "Using LevelDB storage at 'storage_path': " << path;
+        return new LevelDBStorage(path);
+    } else if (storage == IN_MEMORY_STORAGE) {
+        LOG(WARNING) << "Using in-memory storage; offer filters will not survive failover";
+        return new InMemoryStorage();
+    }
+
+    LOG(ERROR) << "Unknown 'storage' parameter: '" << storage << "'; expected one of "
+               << ZOOKEEPER_STORAGE << ", " << LEVELDB_STORAGE << ", " << IN_MEMORY_STORAGE;
+    return nullptr;
+}
 
 // Called by the main() of master at startup
 Allocator* create(const Parameters& parameters)
 {
-    string zk_url = DEFAULT_ZK_URL;
+    hashmap<string, string> parameters_;
     for (int i = 0; i < parameters.parameter_size(); ++i) {
-        Parameter parameter = parameters.parameter(i);
-        if (parameter.key() == "zk_url") {
-            zk_url = parameter.value();
-            break;
+        parameters_[parameters.parameter(i).key()] = parameters.parameter(i).value();
+    }
+
+    Storage* storage = createStorage(parameters_);
+
+    Option<string> master_zk = parameters_.get("master_zk");
+    if (master_zk.isNone()) {
+        master_zk = os::getenv(MASTER_ZK_ENV);
+    }
+
+    Option<zookeeper::URL> master_zk_url;
+    if (master_zk.isSome()) {
+        Try<zookeeper::URL> url_ = zookeeper::URL::parse(master_zk.get());
+        if (url_.isError()) {
+            LOG(ERROR)
+                << "Failed to parse 'master_zk' parameter: '" << master_zk.get() << "'; "
+                << "filter requests will only be served by the recovered master";
+        } else {
+            master_zk_url = url_.get();
+        }
+    }
+
+    GuardRails guardRails;
+    Option<string> maxFilteredFraction = parameters_.get("max_filtered_fraction");
+    if (maxFilteredFraction.isSome()) {
+        Try<double> fraction = numify<double>(maxFilteredFraction.get());
+        if (fraction.isError() || fraction.get() <= 0 || fraction.get() > 1) {
+            LOG(ERROR)
+                << "Failed to parse 'max_filtered_fraction' parameter: '" << maxFilteredFraction.get() << "'; "
+                << "expected a fraction within (0, 1]";
+        } else {
+            guardRails.maxFilteredFraction = fraction.get();
+        }
+    }
+    Option<string> maxQuotaHeadroomFraction = parameters_.get("max_quota_headroom_fraction");
+    if (maxQuotaHeadroomFraction.isSome()) {
+        Try<double> fraction = numify<double>(maxQuotaHeadroomFraction.get());
+        if (fraction.isError() || fraction.get() < 0 || fraction.get() > 1) {
+            LOG(ERROR)
+                << "Failed to parse 'max_quota_headroom_fraction' parameter: '"
+                << maxQuotaHeadroomFraction.get() << "'; expected a fraction within [0, 1]";
+        } else {
+            guardRails.maxQuotaHeadroomFraction = fraction.get();
         }
     }
 
-    Try<zookeeper::URL> url = zookeeper::URL::parse(zk_url);
-    if (url.isError()) {
-        LOG(ERROR)
-            << "Failed to parse 'zk_url' parameter: '" << zk_url << "'; "
-            << "multi-master failover state will be unavailable for offer filters";
+    // Snapshots go to the master's work dir unless placed elsewhere; an empty path disables them
+    Option<string> snapshotPath = parameters_.get("snapshot_path");
+    if (snapshotPath.isNone() && os::getenv(MASTER_WORK_DIR_ENV).isSome()) {
+        snapshotPath = path::join(os::getenv(MASTER_WORK_DIR_ENV).get(), SNAPSHOT_FILE);
+    }
+    if (snapshotPath.isSome() && snapshotPath.get().empty()) {
+        snapshotPath = None();
+    }
+    if (snapshotPath.isSome()) {
+        LOG(INFO) << "Keeping a local snapshot of the offer filters at 'snapshot_path': " << snapshotPath.get();
     } else {
-        LOG(INFO) << "Using 'zk_url': " << zk_url;
+        LOG(WARNING) << "No 'snapshot_path' (or " << MASTER_WORK_DIR_ENV << ") configured; "
+                     << "restoring the offer filters will wait on the storage";
     }
 
     Try<Allocator*> allocator = OfferFilteringHierarchicalDRFAllocator::create();
     if (allocator.isError()) {
+        delete storage;
         return nullptr;
     }
 
@@ -499,7 +5536,7 @@ Allocator* create(const Parameters& parameters)
     pid.address = process::address();
 
     Try<Nothing> configured = process::dispatch(pid, &OfferFilteringHierarchicalDRFAllocatorProcess::configure,
-        const_cast<zookeeper::URL*>(&(url.get()))).get();
+        storage, master_zk_url, guardRails, snapshotPath).get();
     if (configured.isError()) {
          LOG(ERROR) << "Failed to configure " MODULE_NAME_STRING ": " << configured.error();
         return nullptr;
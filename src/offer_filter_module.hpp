@@ -9,6 +9,10 @@
 #include <mesos/master/allocator.hpp>
 #include <master/allocator/mesos/allocator.hpp>
 #include <zookeeper/zookeeper.hpp>
+#include <zookeeper/detector.hpp>
+#include <zookeeper/group.hpp>
+#include <state/in_memory.hpp>
+#include <state/leveldb.hpp>
 #include <state/state.hpp>
 #include <state/zookeeper.hpp>
 
@@ -18,6 +22,10 @@
 #include <mesos/allocator/allocator.hpp>
 #include <mesos/zookeeper/zookeeper.hpp>
 #include <mesos/zookeeper/contender.hpp>
+#include <mesos/zookeeper/detector.hpp>
+#include <mesos/zookeeper/group.hpp>
+#include <mesos/state/in_memory.hpp>
+#include <mesos/state/leveldb.hpp>
 #include <mesos/state/state.hpp>
 #include <mesos/state/zookeeper.hpp>
 
@@ -30,13 +38,29 @@
 #include <stout/json.hpp>
 #include <stout/os.hpp>
 #include <stout/hashmap.hpp>
+#include <stout/lambda.hpp>
+#include <stout/uuid.hpp>
 
 #include <stout/protobuf.hpp>
 
 #include <process/help.hpp>
 #include <process/owned.hpp>
+#include <process/process.hpp>
+#include <process/future.hpp>
+#include <process/time.hpp>
+
+#include <regex.h>
+
+#include <deque>
+#include <list>
+#include <queue>
+#include <memory>
+#include <set>
+#include <vector>
 
 #include "config.h"
+#include "metrics.hpp"
+#include "offer_filter.pb.h"
 
 #ifdef MESOS__0_28_2
 // backports from mesos 1.0.x
@@ -62,6 +86,7 @@ inline std::string AUTHENTICATION(bool required)
 
 using mesos::internal::state::State;
 using mesos::internal::state::Storage;
+using mesos::internal::state::Variable;
 
 #else
 
@@ -71,6 +96,7 @@ using process::AUTHENTICATION;
 
 using mesos::state::State;
 using mesos::state::Storage;
+using mesos::state::Variable;
 
 #endif
 
@@ -78,6 +104,7 @@ using std::string;
 using std::pair;
 
 using process::Future;
+using process::Promise;
 using process::Process;
 using process::ProcessBase;
 using process::Owned;
@@ -90,6 +117,7 @@ using mesos::SlaveID;
 using mesos::SlaveInfo;
 using mesos::Unavailability;
 using mesos::FrameworkID;
+using mesos::FrameworkInfo;
 using mesos::Resources;
 using mesos::internal::master::allocator::HierarchicalDRFAllocatorProcess;
 using mesos::internal::master::allocator::DRFSorter;
@@ -103,19 +131,179 @@ namespace mesos {
 namespace modules {
 
 class OfferFilteringHierarchicalDRFAllocatorProcess;
+class OfferFilterFrontendProcess;
+class OfferFilterSnapshotProcess;
 
 typedef MesosAllocator<OfferFilteringHierarchicalDRFAllocatorProcess>
 OfferFilteringHierarchicalDRFAllocator;
 
-const char* ALLOCATOR_PROCESS_ID = "allocator";
+const char* const ALLOCATOR_PROCESS_ID = "offer-filtering-allocator";
 
+// Owns the /allocator/... endpoints
+const char* const FRONTEND_PROCESS_ID = "allocator";
 
-class OfferFilteringHierarchicalDRFAllocatorProcess : public HierarchicalDRFAllocatorProcess
+// Writes the local snapshot of the persisted filters
+const char* const SNAPSHOT_PROCESS_ID = "offer-filter-snapshot";
+
+// A change to the reported filter set, as delivered to watchers
+struct FilterEvent
+{
+  uint64_t version;
+  string type;
+  JSON::Object filter;
+};
+
+// Filters every agent with a given attribute ("NAME:VALUE"), in a given domain,
+// or with a hostname matching a glob (hostnamePattern) or regex (hostnameRegex),
+// including agents which register later.
+// A POSIX extended regular expression matching whole hostnames, compiled once
+// and freed along with the last selector holding it (std::regex cannot be used
+// with the libstdc++ of GCC 4.8).
+class HostnameRegex
 {
 public:
+  static Try<HostnameRegex> compile(const string& pattern);
 
-  OfferFilteringHierarchicalDRFAllocatorProcess()
-  : ProcessBase(ALLOCATOR_PROCESS_ID)
+  bool matches(const string& hostname) const;
+
+private:
+  explicit HostnameRegex(const std::shared_ptr<regex_t>& _regex) : regex(_regex) {}
+
+  std::shared_ptr<regex_t> regex;
+};
+
+struct FilterSelector
+{
+  string type;
+  string value;
+
+  // Compiled once, for hostnameRegex selectors
+  Option<HostnameRegex> regex;
+
+  // The agents currently matched
+  hashset<SlaveID> agents;
+};
+
+// When a filter takes effect, and when it is lifted; a filter without either
+// is in effect until removed.
+struct FilterSchedule
+{
+  Option<process::Time> startsAt;
+  Option<process::Time> expiresAt;
+};
+
+// The roles and frameworks (by id) a scoped filter withholds offers from; a
+// filter without a scope deactivates its agents for every framework.
+struct FilterScope
+{
+  std::set<string> roles;
+  std::set<string> frameworks;
+};
+
+// Withholds part of an agent from offers: the given resources (in the form of
+// Resources::parse) and/or every resource with one of the given names.
+struct ResourceFilter
+{
+  string hostname;
+  Option<string> text;
+  Resources resources;
+  std::set<string> names;
+};
+
+// Scalar capacity (cpus, mem and gpus) by role ('*' for unreserved resources),
+// then by resource name
+typedef hashmap<string, hashmap<string, double>> Capacity;
+
+// Limits on the capacity filters may withhold; requests exceeding them are
+// rejected before anything is applied.
+struct GuardRails
+{
+  // Of the cluster's cpus, mem or gpus
+  Option<double> maxFilteredFraction;
+
+  // Of the headroom of a role with quota: the capacity the role may still be
+  // offered (unreserved, or reserved for it) beyond its guarantee
+  Option<double> maxQuotaHeadroomFraction;
+};
+
+// A long-polling GET, parked until the filter set moves past its version
+struct FilterWatcher
+{
+  uint64_t since;
+  Owned<Promise<http::Response>> promise;
+};
+
+// Filters a set of agents a few at a time: every interval, up to batchSize
+// more agents are filtered, as long as the agents still draining (filtered,
+// but still running tasks) stay within maxConcurrent agents and/or
+// maxCapacityFraction of the cluster's cpus and mem.
+struct DrainJob
+{
+  string id;
+  string state;
+
+  // The agents to filter, in order, by id (mapped to their hostname)
+  std::vector<pair<string, string>> agents;
+
+  Option<size_t> maxConcurrent;
+  Option<double> maxCapacityFraction;
+  Duration interval;
+  size_t batchSize;
+
+  // Index of the next agent to filter
+  size_t next;
+
+  hashset<string> draining;
+  hashset<string> drained;
+
+  // Agents whose filter was removed while they were draining
+  hashset<string> lifted;
+};
+
+// A filter of a POST, PUT or PATCH, as parsed by the front end; the agent it names
+// (if any) is resolved by the allocator.
+struct FilterSpec
+{
+  string agentId;
+  string hostname;
+  Option<FilterSelector> selector;
+  FilterSchedule schedule;
+  Option<FilterScope> scope;
+  Option<ResourceFilter> resourceFilter;
+
+  // When a restored filter took effect, as stored
+  Option<process::Time> startedAt;
+};
+
+// A request to /allocator/filters, as forwarded by the front end: the
+// request without its body, and the filters parsed from the body.
+struct FilterRequest
+{
+  http::Request request;
+  std::vector<FilterSpec> filters;
+
+  // The filters a PATCH removes; its additions are held in 'filters'
+  std::vector<FilterSpec> removals;
+};
+
+
+// Encodes a stored entry, compressing it when large, and decodes a stored
+// entry of any format (one of an earlier format holds its JSON form)
+string encodeEntry(const StoredEntry& entry);
+
+Try<StoredEntry> decodeEntry(const string& value);
+
+
+// Owns the routes of the module, and parses and validates requests concurrently
+// with allocation; the allocator actor only resolves and applies them.
+class OfferFilterFrontendProcess : public Process<OfferFilterFrontendProcess>
+{
+public:
+
+  explicit OfferFilterFrontendProcess(
+      const process::PID<OfferFilteringHierarchicalDRFAllocatorProcess>& _allocator)
+  : ProcessBase(FRONTEND_PROCESS_ID),
+    allocator(_allocator)
   {
     route("/filters",
       HELP(
@@ -138,6 +326,46 @@ public:
               ">         ]",
               ">       }",
               "",
+              " *responses carry an `ETag`; a GET with a matching `If-None-Match`*",
+              " *header returns `304 NOT_MODIFIED` with no body* ",
+              "",
+              " *a POST, PUT, PATCH or DELETE with an `If-Match` header applies only if the filters* ",
+              " *are still those of the given `ETag`, else returns `412 PRECONDITION_FAILED`* ",
+              "",
+              "#### Drain progress of the filtered agents: ",
+              ">       GET /allocator/filters?usage=true ",
+              ">       GET /allocator/filters?drained=true    only agents with nothing allocated ",
+              "",
+              " *adds an `agents` array to the response, one entry per filtered agent:* ",
+              ">       {",
+              ">         \"agentId\": \"VALUE\", \"hostname\": \"VALUE\",",
+              ">         \"total\": \"cpus(*):8; mem(*):16384\", \"allocated\": \"cpus(*):0.5\",",
+              ">         \"drained\": false,",
+              ">         \"filteredSince\": \"2017-05-01T22:00:00Z\", \"filteredFor\": \"2hrs\"",
+              ">       }",
+              "",
+              "#### WATCH the allocator filters for changes: ",
+              ">       GET /allocator/filters?watch=true ",
+              ">              headers:",
+              ">                If-None-Match: ETAG   The ETag of the last response seen ",
+              ">              parameters:",
+              ">                timeout=DURATION      How long to wait for a change (default: 30secs) ",
+              "",
+              " *responds as soon as the filters differ from ETAG, with only the changes:* ",
+              ">       {",
+              ">         \"events\": [",
+              ">           {",
+              ">             \"type\": \"ADDED\",",
+              ">             \"filter\": { \"agentId\": \"VALUE\", \"hostname\": \"VALUE\" }",
+              ">           }",
+              ">         ],",
+              ">         \"version\": 42",
+              ">       }",
+              "",
+              " *`type` is one of `ADDED`, `UPDATED` or `REMOVED`; returns `304 NOT_MODIFIED` when* ",
+              " *nothing changed within the timeout, and the whole filter set when ETAG is* ",
+              " *missing or too old* ",
+              "",
               "---",
               "",
               "#### ADD/CREATE an allocator filter for the specified agent: ",
@@ -146,6 +374,57 @@ public:
               ">              body:  { \"agentId\": \"VALUE\"}",
               ">                or   { \"hostname\": \"VALUE\"}",
               "",
+              "#### ADD/CREATE an allocator filter for every agent matching a selector: ",
+              ">       POST /allocator/filters ",
+              ">       Content-Type: application/json ",
+              ">              body:  { \"attribute\": \"NAME:VALUE\"}        agents with the attribute ",
+              ">                or   { \"domain\": \"VALUE\"}                agents with hostnames in the domain ",
+              ">                or   { \"hostnamePattern\": \"GLOB\"}        agents with hostnames matching the glob ",
+              ">                or   { \"hostnameRegex\": \"REGEX\"}         agents with hostnames matching the regex ",
+              "",
+              " *a selector also filters agents which register after it was created;* ",
+              " *selectors may be used in place of agents in a bulk update, and are listed as given* ",
+              "",
+              "#### Time-bounded filters: ",
+              " *any filter (or selector) may also carry:* ",
+              ">              \"startsAt\": \"2017-05-01T22:00:00Z\"    UTC time at which the filter takes effect ",
+              ">              \"expiresAt\": \"2017-05-02T06:00:00Z\"   UTC time at which the filter is lifted ",
+              ">              \"ttl\": \"8hrs\"                         lifts the filter this long after it takes effect ",
+              "",
+              " *filters yet to start are listed with their schedule, but do not withhold offers* ",
+              "",
+              "#### Scoped filters: ",
+              " *any filter (or selector) may instead withhold its agents from some frameworks only:* ",
+              ">              \"roles\": [\"ROLE\", ...]                 frameworks in any of the roles ",
+              ">              \"frameworks\": [\"FRAMEWORK_ID\", ...]    the frameworks with any of the ids ",
+              "",
+              " *other frameworks keep receiving offers for the agents* ",
+              "",
+              "#### WITHHOLD some resources of an agent: ",
+              ">       POST /allocator/filters ",
+              ">       Content-Type: application/json ",
+              ">              body:  { \"agentId\": \"VALUE\", \"resources\": \"disk:1024;ports:[31000-31099]\" }",
+              ">                or   { \"hostname\": \"VALUE\", \"resourceNames\": [\"gpus\", ...] }",
+              "",
+              " *the rest of the agent keeps being offered; replaces any earlier resource filter of the agent* ",
+              "",
+              "#### Preview the capacity a POST, PUT or PATCH would withhold: ",
+              ">       POST /allocator/filters?dryRun=true ",
+              ">       PUT /allocator/filters?dryRun=true ",
+              ">       PATCH /allocator/filters?dryRun=true ",
+              "",
+              " *applies nothing, and responds with the change to the capacity withheld from each role:* ",
+              ">       {",
+              ">         \"dryRun\": true,",
+              ">         \"agents\": { \"filtered\": 2, \"lifted\": 0 },",
+              ">         \"change\": { \"*\": { \"cpus\": 16, \"mem\": 32768 } },",
+              ">         \"filtered\": { \"*\": { \"cpus\": 24, \"mem\": 49152 } },",
+              ">         \"total\": { \"*\": { \"cpus\": 320, \"mem\": 655360 } }",
+              ">       }",
+              "",
+              " *a request exceeding the configured guard rails is rejected with `409 CONFLICT`* ",
+              " *(a dry run reports why, as `rejected`)* ",
+              "",
               "---",
               "",
               "#### ADD/UPDATE/DELETE filters in bulk: ",
@@ -164,6 +443,19 @@ public:
               " *either of `agentId` or `hostname` may be omitted on an individual filter* ",
               " *set `filters` to an empty array to clear all filters* ",
               "",
+              "#### ADD and REMOVE filters in a single change: ",
+              ">       PATCH /allocator/filters ",
+              ">       Content-Type: application/json ",
+              ">              body:  { ",
+              ">                       \"add\": [ { \"agentId\": \"VALUE\" }, ... ], ",
+              ">                       \"remove\": [ { \"attribute\": \"NAME:VALUE\" }, ... ] ",
+              ">                     } ",
+              "",
+              " *`add` takes any filter a POST does, `remove` any filter or selector; either may* ",
+              " *be omitted. Applies all of them or, when one cannot be applied, none of them;* ",
+              " *a removal matching no filter returns `404 NOT_FOUND`. Responds with the changes* ",
+              " *made, as a watch does, and the new `version`* ",
+              "",
               "---",
               "",
               "#### REMOVE/DELETE an allocator filter: ",
@@ -171,7 +463,11 @@ public:
               ">              parameters:",
               ">                agentId=VALUE     The id of the agent for which to remove filters ",
               ">                hostname=VALUE    The hostname of the agent for which to remove filters ",
-              ">              (one of agentId or hostname is required) ",
+              ">                attribute=VALUE   The attribute selector to remove ",
+              ">                domain=VALUE      The domain selector to remove ",
+              ">                hostnamePattern=VALUE  The hostname glob selector to remove ",
+              ">                hostnameRegex=VALUE    The hostname regex selector to remove ",
+              ">              (exactly one parameter is required) ",
               "",
               "---",
               "",
@@ -192,9 +488,127 @@ public:
               ),
           AUTHENTICATION(true)
       ),
-      &OfferFilteringHierarchicalDRFAllocatorProcess::offerFilters);
+      &OfferFilterFrontendProcess::offerFilters);
+
+    route("/drains",
+      HELP(
+          TLDR("Filter a set of agents gradually, within limits on the capacity being drained at once"),
+          DESCRIPTION(
+              "---",
+              "#### LIST/GET drain jobs: ",
+              ">       GET /allocator/drains ",
+              ">       GET /allocator/drains?id=VALUE ",
+              "",
+              " *example response:*",
+              ">       {",
+              ">         \"drains\": [",
+              ">           {",
+              ">             \"id\": \"5f3b1e0e-...\", \"state\": \"RUNNING\",",
+              ">             \"agents\": 120, \"filtered\": 14, \"draining\": 4, \"drained\": 10, \"lifted\": 0,",
+              ">             \"maxConcurrent\": 5, \"interval\": \"1mins\", \"batchSize\": 1",
+              ">           }",
+              ">         ]",
+              ">       }",
+              "",
+              " *`state` is one of `RUNNING`, `COMPLETED` or `CANCELLED`* ",
+              "",
+              "---",
+              "",
+              "#### START a drain job: ",
+              ">       POST /allocator/drains ",
+              ">       Content-Type: application/json ",
+              ">              body:  { ",
+              ">                       \"agents\": [ { \"agentId\": \"VALUE\" }, { \"hostname\": \"VALUE\" }, ... ], ",
+              ">                         or a selector, e.g., \"domain\": \"VALUE\" ",
+              ">                       \"maxConcurrent\": 5,            agents draining at once ",
+              ">                       \"maxCapacityFraction\": 0.05,   and/or share of the cluster's cpus and mem ",
+              ">                       \"interval\": \"1mins\",          time between steps (default: 1mins) ",
+              ">                       \"batchSize\": 1                 agents filtered per step (default: 1) ",
+              ">                     } ",
+              "",
+              " *an agent is drained once it runs no more tasks; agents stay filtered once drained* ",
+              "",
+              "---",
+              "",
+              "#### CANCEL a drain job: ",
+              ">       DELETE /allocator/drains?id=VALUE ",
+              "",
+              " *the agents filtered so far stay filtered* ",
+              "",
+              "---",
+              "provided by: " MODULE_FILE_NAME_STRING
+              ),
+          AUTHENTICATION(true)
+      ),
+      &OfferFilterFrontendProcess::drainJobs);
+  }
+
+private:
+
+  Future<http::Response> offerFilters(const http::Request &request);
+
+  Future<http::Response> drainJobs(const http::Request &request);
+
+  process::PID<OfferFilteringHierarchicalDRFAllocatorProcess> allocator;
+};
+
+
+// Holds a copy of the persisted entries, and encodes and writes the local
+// snapshot from it; the allocator actor only sends the entries each commit
+// changed. Writes made while one is queued are collapsed into it.
+class OfferFilterSnapshotProcess : public Process<OfferFilterSnapshotProcess>
+{
+public:
+
+  explicit OfferFilterSnapshotProcess(const string& _path)
+  : ProcessBase(SNAPSHOT_PROCESS_ID),
+    path(_path),
+    generation(0),
+    writeScheduled(false) {}
+
+  // Replaces every entry, once the filters have been restored
+  void reset(uint64_t generation, const hashmap<string, string>& entries);
+
+  // Applies the entries changed by a commit; None for an expunged entry
+  void update(uint64_t generation, const hashmap<string, Option<string>>& changed);
+
+private:
+
+  void scheduleWrite();
+
+  void write();
+
+  const string path;
+
+  uint64_t generation;
+
+  hashmap<string, string> entries;
 
+  bool writeScheduled;
+};
+
+
+class OfferFilteringHierarchicalDRFAllocatorProcess : public HierarchicalDRFAllocatorProcess
+{
+public:
+
+  OfferFilteringHierarchicalDRFAllocatorProcess()
+  : ProcessBase(ALLOCATOR_PROCESS_ID),
+    filterMetrics(*this)
+  {
     state = NULL;
+    recovered = false;
+    commitScheduled = false;
+    committing = false;
+    filtersGeneration = 0;
+    restored = false;
+    filtersVersion = 0;
+    filtersEpoch = UUID::random().toString();
+    notifyScheduled = false;
+    nextWatcherId = 0;
+    filterTimer = 0;
+    snapshotSeeded = false;
+    drainsResumed = false;
   }
 
   virtual ~OfferFilteringHierarchicalDRFAllocatorProcess() {
@@ -206,7 +620,13 @@ public:
     return process::PID<OfferFilteringHierarchicalDRFAllocatorProcess>(this);
   }
 
-  Future<http::Response> offerFilters(const http::Request &request);
+  // Applies a request parsed by the front end; times how long it holds the allocator actor
+  Future<http::Response> offerFilters(const FilterRequest& request);
+
+  Future<http::Response> drainJobs(const http::Request &request);
+
+  // Parses a POST, PUT or PATCH body into the filters it specifies
+  static Try<FilterRequest> parseFilterRequest(const http::Request& request);
 
   virtual void recover(
       const int _expectedAgentCount,
@@ -219,44 +639,605 @@ public:
       const Resources& total,
       const hashmap<FrameworkID, Resources>& used);
 
+  virtual void removeSlave(
+      const SlaveID& slaveId);
+
+  virtual void updateSlave(
+      const SlaveID& slaveId,
+      const Resources& oversubscribedResources);
+
+  virtual void addFramework(
+      const FrameworkID& frameworkId,
+      const FrameworkInfo& frameworkInfo,
+      const hashmap<SlaveID, Resources>& used);
+
+  virtual void removeFramework(
+      const FrameworkID& frameworkId);
+
+  virtual void deactivateFramework(
+      const FrameworkID& frameworkId);
+
+  virtual void reviveOffers(
+      const FrameworkID& frameworkId);
+
+  virtual void updateAllocation(
+      const FrameworkID& frameworkId,
+      const SlaveID& slaveId,
+      const std::vector<Offer::Operation>& operations);
+
+  virtual process::Future<Nothing> updateAvailable(
+      const SlaveID& slaveId,
+      const std::vector<Offer::Operation>& operations);
+
   virtual void activateSlave(
       const SlaveID& slaveId);
 
-  Try<Nothing> configure(const zookeeper::URL* zk_url);
+  virtual void deactivateSlave(
+      const SlaveID& slaveId);
+
+  virtual void setQuota(
+      const string& role,
+      const Quota& quota);
+
+  virtual void removeQuota(
+      const string& role);
+
+  // Stops the front end along with the allocator
+  virtual void finalize();
+
+  // Takes ownership of the storage, and spawns the front end; filters are not
+  // persisted when the storage is NULL, nor snapshotted locally without a path
+  Try<Nothing> configure(
+      Storage* storage,
+      const Option<zookeeper::URL>& master_zk_url,
+      const GuardRails& guardRails = GuardRails(),
+      const Option<string>& snapshotPath = None());
 
 protected:
 
-  Future<http::Response> addOfferFilter(const http::Request &request);
+  Future<http::Response> addOfferFilter(const FilterRequest& request);
 
   Future<http::Response> getOfferFilters(const http::Request &request);
 
-  Future<http::Response> updateOfferFilters(const http::Request &request);
+  Future<http::Response> updateOfferFilters(const FilterRequest& request);
 
   Future<http::Response> removeOfferFilter(const http::Request &request);
 
+  Future<http::Response> patchOfferFilters(const FilterRequest& request);
+
+  Future<http::Response> addResourceFilter(const FilterSpec& filter, bool dryRun);
+
+  Future<http::Response> startDrain(const http::Request &request);
+
+  Future<http::Response> cancelDrain(const http::Request &request);
+
+  http::Response reportDrains(const http::Request &request);
+
+  size_t applyFilters(const hashset<SlaveID>& agentIds);
+
+  size_t applyFilterDelta(const hashset<SlaveID>& added, const hashset<SlaveID>& removed);
+
+  // Re-activates the given agents and runs a single allocation pass over all
+  // of them, rather than one pass per agent; returns the number re-activated.
+  size_t activateSlaves(const hashset<SlaveID>& slaveIds);
+
+  // Completes once the persisted filters have been restored after recovery
+  Future<Nothing> filtersRestored();
+
+  // Whether any filter without a scope, other than 'ignored', applies to the agent
+  bool isFiltered(const SlaveID& slaveId, const Option<string>& ignored = None()) const;
+
+  bool isFiltered(const SlaveID& slaveId, const hashset<string>& ignored) const;
+
+  size_t addSelector(FilterSelector selector);
+
+  size_t removeSelector(const string& key);
+
+  // Restores the filter (or drain job) of a stored entry
+  void restoreEntry(const string& name, const string& value);
+
 private:
 
+  friend struct Metrics;
+
   Future<http::Response> toHttpResponse(const hashmap<string, string>& filteredAgents);
 
   Future<http::Response> persistAndReportOfferFilters();
 
+  Future<http::Response> persistAndRespond(const http::Response& response);
+
+  http::Response reportOfferFilters();
+
+  string filtersETag() const;
+
+  void restoreFiltersVersion(const string& manifest);
+
+  Option<http::Response> checkIfMatch(const http::Request& request) const;
+
+  void filtersChanged(const string& type, const JSON::Object& filter);
+
+  Option<uint64_t> knownFiltersVersion(const http::Request& request) const;
+
+  http::Response notModified() const;
+
+  http::Response reportFilterEvents(uint64_t since);
+
+  http::Response reportEvents(JSON::Array events);
+
+  void notifyWatchers();
+
+  void expireWatcher(uint64_t id);
+
   JSON::Object getFilteredAgentsJSON();
 
-  Option<SlaveID> findSlaveID(const string& hostname, const string& agentId);
+  http::Response reportAgentUsage(bool drainedOnly);
+
+  Option<process::Time> filteredSince(const SlaveID& slaveId) const;
+
+  // The capacity the agent withholds from every role: all of it when filtered,
+  // otherwise whatever its resource filter withholds
+  Capacity withheldCapacity(
+      const SlaveID& slaveId,
+      bool filtered,
+      const Option<ResourceFilter>& resourceFilter) const;
+
+  // Keeps the capacity aggregates in line with the agent
+  void updateCapacity(const SlaveID& slaveId);
+
+  // The agents the selector matches, whether or not it is active
+  hashset<SlaveID> matchingAgents(const FilterSelector& selector) const;
+
+  // Whether a filter with this schedule would be in effect as soon as it is applied
+  bool startsNow(const string& key, const FilterSchedule& schedule) const;
+
+  // Rejects a request whose proposed withheld capacity (by agent) exceeds the
+  // guard rails; for a dry run, responds with the impact instead
+  Option<http::Response> assessImpact(
+      const hashmap<SlaveID, Capacity>& proposed,
+      bool dryRun) const;
 
-  void persistFilteredAgents(const JSON::Object& filteredAgents);
+  Option<string> checkGuardRails(const Capacity& change) const;
+
+  // The change to the withheld capacity were the agents filtered as a whole
+  Capacity filteringCapacity(const hashset<SlaveID>& slaveIds) const;
+
+  // The agents a scheduled filter would filter as a whole once started
+  hashset<SlaveID> startingAgents(const string& key);
+
+  void deferFilterStart(const string& key, const string& violation);
+  Option<SlaveID> findSlaveID(const string& agentId, const string& hostname);
+
+  void indexAgent(const SlaveID& slaveId);
+
+  void unindexAgent(const SlaveID& slaveId);
+
+  void indexSelectable(const SlaveID& slaveId, const SlaveInfo& slaveInfo);
+
+  static Try<FilterSelector> createSelector(const string& type, const string& value);
+
+  static Result<FilterSelector> findSelector(const hashmap<string, string>& values);
+
+  bool matchesSelector(const FilterSelector& selector, const SlaveID& slaveId) const;
+
+  bool selectAgent(const string& key, const SlaveID& slaveId);
+
+  void matchSelectors(const SlaveID& slaveId);
+
+  Future<Nothing> persistFilteredAgents();
+
+  void scheduleCommit();
+
+  void commitFilteredAgents();
+
+  void _commitFilteredAgents(
+      const std::vector<Owned<Promise<Nothing>>>& committed,
+      const hashset<string>& agentIds,
+      const hashset<string>& hostnames,
+      const hashset<string>& selectorKeys,
+      const hashset<string>& resourceAgentIds,
+      const hashset<string>& drainIds,
+      const Future<Nothing>& written);
+
+  double _persist_queue_depth();
+
+  double _filtered_agents();
 
   void restoreFilteredAgents();
 
-  Option<string> getLeader(const http::Request &request);
+  void _restoreFilteredAgents(const Future<Variable>& manifest);
+
+  void restoreFilterEntries(const Future<std::set<string>>& names);
+
+  void _restoreFilterEntries(
+      const std::vector<string>& names,
+      const Future<std::list<Variable>>& entries);
+
+  void restoreLegacyFilteredAgents(const Future<Variable>& variable);
+
+  void restoreEntry(const string& name, const StoredEntry& entry);
+
+  void migrateEntry(const string& name);
+
+  void pollStandby();
+
+  void _pollStandby(const Future<Variable>& manifest);
+
+  void __pollStandby(
+      const Variable& manifest,
+      uint64_t generation,
+      const Future<std::set<string>>& names);
+
+  void holdStandbyFilters(
+      const Variable& manifest,
+      uint64_t generation,
+      const std::vector<string>& names,
+      bool changed,
+      const Future<std::list<Variable>>& entries);
+
+  void snapshotStandby(const std::vector<string>& names, bool changed);
+
+  bool applyStandbyFilters();
+
+  bool loadSnapshot();
+
+  void reconcileSnapshot(const hashmap<string, string>& stored);
+
+  void removeFilterEntry(const string& name, const hashmap<string, string>& stored);
+
+  void saveSnapshot();
+
+  void addPendingFilter(const JSON::Object& filter, bool migrate);
+
+  void addPendingFilter(const FilterSpec& filter, bool migrate);
+
+  void applyRestoredFilters();
+
+  bool matchPendingFilter(const SlaveID& slaveId);
+
+  Option<string> serializeAgentFilter(const string& agentId);
+
+  Option<string> serializeHostnameFilter(const string& hostname);
+
+  Option<string> serializeSelectorFilter(const string& key);
+
+  Option<string> serializeResourceFilter(const string& agentId);
+
+  bool isPersisted(const string& name, const Option<string>& value);
+
+  Future<Nothing> writeFilterEntry(const string& name, const Option<string>& value);
+
+  Future<Nothing> _writeFilterEntry(const string& name, const Option<Variable>& stored);
+
+  Future<Nothing> _expungeFilterEntry(const string& name, bool expunged);
+
+  // The names of the entries changed by each commit, by generation
+  typedef std::deque<pair<uint64_t, std::vector<string>>> ChangeLog;
+
+  Future<Nothing> writeManifest(const std::vector<string>& changed);
+
+  Future<Nothing> _writeManifest(const ChangeLog& log, const Option<Variable>& stored);
+
+  Option<string> getLeader() const;
+
+  void detectLeader(const Option<zookeeper::Group::Membership>& previous);
+
+  void _detectLeader(const Future<Option<zookeeper::Group::Membership>>& membership);
+
+  void __detectLeader(
+      const zookeeper::Group::Membership& membership,
+      const Future<Option<string>>& data);
+
+  pair<hashset<SlaveID>, string> resolveFilters(
+      const std::vector<FilterSpec>& filters,
+      hashmap<string, FilterSelector>* selected,
+      hashmap<string, FilterSchedule>* schedules,
+      hashmap<string, FilterScope>* scopes,
+      hashmap<string, ResourceFilter>* partial);
+
+  string resolveRemovals(
+      const std::vector<FilterSpec>& removals,
+      hashset<string>* keys,
+      hashset<string>* resources);
+
+  JSON::Object describeFilter(JSON::Object filter, const string& key) const;
+
+  StoredFilter storedFilter(StoredFilter filter, const string& key) const;
+
+  static Try<FilterSpec> parseStoredFilter(const StoredFilter& stored);
+
+  static Try<FilterSchedule> parseSchedule(const hashmap<string, string>& values);
+
+  bool scheduleFilter(const string& key, const JSON::Object& filter, FilterSchedule schedule);
+
+  bool hasActiveFilter(const string& key) const;
+
+  void markDirty(const string& key);
+
+  bool removeScheduledFilter(const string& key);
+
+  bool removePendingFilter(const string& agentId);
+
+  bool removePendingHostnameFilter(const string& hostname);
+
+  void armFilterTimer();
+
+  void applyFilterSchedules(uint64_t timer);
+
+  void startFilter(const string& key, hashset<SlaveID>* added);
+
+  void expireFilter(const string& key, hashset<SlaveID>* removed);
+
+  void forgetFilter(const string& key);
+
+  void moveFilter(const string& from, const string& to);
 
-  void applyFilters(hashset<SlaveID> agentIds);
+  void scopeFilter(const string& key, const JSON::Object& filter, const Option<FilterScope>& scope);
 
-  pair<hashset<SlaveID>, string> parseFilters(JSON::Object json);
+  hashset<SlaveID> scopedAgents(const string& key) const;
+
+  void refreshAgents(const hashset<SlaveID>& slaveIds);
+
+  size_t exclusionBit(const string& name);
+
+  bool updateExclusions(const SlaveID& slaveId);
+
+  bool isExcluded(const SlaveID& slaveId, const FrameworkID& frameworkId) const;
+
+  void excludeFramework(const SlaveID& slaveId, const FrameworkID& frameworkId, bool excluded);
+
+  void restoreExclusions(const FrameworkID& frameworkId);
+
+  void offerReleased(const hashset<SlaveID>& released);
+
+  bool holdAllocation();
+
+  void filterOffers(const FrameworkID& frameworkId, const hashmap<SlaveID, Resources>& offers);
+
+  void setResourceFilter(const string& agentId, const ResourceFilter& filter);
+
+  bool removeResourceFilter(const string& agentId);
+
+  void updateWithheld(const string& agentId);
+
+  Option<http::Response> redirectToLeader(const http::Request& request);
+
+  Future<http::Response> _offerFilters(const FilterRequest& request);
+
+  Future<http::Response> _drainJobs(const http::Request &request);
+
+  void advanceDrain(const string& id);
+
+  double capacityShare(const hashset<string>& agentIds) const;
+
+  void restoreDrain(const JSON::Object& json);
+
+  Option<string> serializeDrain(const string& id);
 
   State* state;
 
-  const zookeeper::URL* zkUrl;
+  Owned<Storage> storage;
+
+  Owned<OfferFilterFrontendProcess> frontend;
+
+  Owned<OfferFilterSnapshotProcess> snapshotter;
+
+  // Lookup indexes over this->slaves by hostname and by stringified agent id,
+  // maintained in addSlave/removeSlave/updateSlave.
+  hashmap<string, SlaveID> agentIdsByHostname;
+
+  hashmap<string, SlaveID> agentIdsByString;
+
+  // Selector indexes: agents by attribute ("NAME:VALUE") and by domain, and
+  // the attributes of each agent, so that it can be unindexed.
+  hashmap<string, hashset<SlaveID>> agentsByAttribute;
+
+  hashmap<string, hashset<SlaveID>> agentsByDomain;
+
+  hashmap<SlaveID, std::vector<string>> agentAttributes;
+
+  // Active selectors by key ("TYPE:VALUE"); the hostname pattern selectors,
+  // which have to be evaluated against each new agent; and the selectors
+  // matching each agent, which filter it for as long as there is any.
+  hashmap<string, FilterSelector> selectors;
+
+  hashset<string> patternSelectors;
+
+  hashmap<SlaveID, hashset<string>> agentSelectors;
+
+  // The start and/or expiry of filters, by filter key (see agentFilterKey,
+  // hostnameFilterKey and selectorKey), and the filters yet to start.
+  hashmap<string, FilterSchedule> filterSchedules;
+
+  hashmap<string, JSON::Object> scheduledFilters;
+
+  // Every start and expiry, earliest first, driving a single timer; entries
+  // outdated by a later change are skipped when they come up.
+  std::priority_queue<
+      pair<process::Time, string>,
+      std::vector<pair<process::Time, string>>,
+      std::greater<pair<process::Time, string>>> filterDeadlines;
+
+  Option<process::Time> filterTimerDeadline;
+
+  // The scopes of scoped filters, by filter key
+  hashmap<string, FilterScope> filterScopes;
+
+  // The roles ("role:NAME") and frameworks ("framework:ID") excluded from
+  // each agent by the scoped filters covering it, as bitsets indexed by
+  // exclusionBits; bits are assigned on first use and never reused.
+  hashmap<string, size_t> exclusionBits;
+
+  hashmap<SlaveID, std::vector<bool>> agentExclusions;
+
+  // The registered frameworks each agent is excluded from, which the allocation
+  // pass skips for it
+  hashmap<SlaveID, hashset<FrameworkID>> excludedFrom;
+
+  // Resource filters by agent id (including agents yet to re-register), and
+  // the resources they withhold from each registered agent, computed once per
+  // change of the filter or of the agent's total
+  hashmap<string, ResourceFilter> resourceFilters;
+
+  hashmap<SlaveID, Resources> withheldResources;
+
+  // Drain jobs by id, each advanced by its own timer while running
+  hashmap<string, DrainJob> drains;
+
+  // The master's offer callback, wrapped by filterOffers
+  lambda::function<void(const FrameworkID&, const hashmap<SlaveID, Resources>&)> forwardOffers;
+
+  // Identifies the armed timer; earlier timers are ignored when they fire
+  uint64_t filterTimer;
+
+  // Agents for which a filter is currently active.
+  hashset<SlaveID> filteredAgents;
+
+  // Agents deactivated by the master itself (e.g., disconnected); lifting a
+  // filter must not re-activate these.
+  hashset<SlaveID> deactivatedAgents;
+
+  // Restored filters whose agents have not (yet) re-registered, keyed by agent
+  // id (mapped to the hostname it was filtered with), and by hostname for
+  // filters which name no agent id; matched in addSlave.
+  hashmap<string, string> pendingFilters;
+
+  hashset<string> pendingHostnameFilters;
+
+  // Tracks the leading master through the masters' ZooKeeper group so that
+  // request routing never has to ask the master for its state.
+  Owned<zookeeper::Group> masterGroup;
+
+  Owned<zookeeper::LeaderDetector> masterDetector;
+
+  // Cached address ({ip}:{port}) of the leading master, or CURRENT_MASTER;
+  // None when no leader is currently known.
+  Option<string> leader;
+
+  // Set once the master has recovered the allocator, i.e., this master
+  // has been elected and is ready to serve filter requests.
+  bool recovered;
+
+  // Group commit of the filter set: requests arriving while a commit is
+  // scheduled or in flight are collapsed into the next single store.
+  std::vector<Owned<Promise<Nothing>>> pendingCommits;
+
+  bool commitScheduled;
+
+  bool committing;
+
+  // Filters are persisted as one entry per filter plus a small manifest; these
+  // track the filters changed since the last commit, by agent id, by
+  // hostname (for filters which name no agent id), by selector key and by
+  // agent id for resource filters.
+  hashset<string> dirtyAgentFilters;
+
+  hashset<string> dirtyHostnameFilters;
+
+  hashset<string> dirtySelectors;
+
+  hashset<string> dirtyResourceFilters;
+
+  hashset<string> dirtyDrains;
+
+  // Capacity of the registered agents, and the part withheld from every role
+  // by filters; maintained as agents and filters change, so a request's impact
+  // is computed from the agents it changes only
+  Capacity totalCapacity;
+  Capacity filteredCapacity;
+  hashmap<SlaveID, Capacity> agentCapacities;
+  hashmap<SlaveID, Capacity> withheldCapacities;
+
+  // The agents withheld from every framework, as of their last capacity update
+  hashset<SlaveID> fullyFilteredAgents;
+
+  // When each active filter (by key) took effect on this master
+  hashmap<string, process::Time> filterStarts;
+
+  // Guaranteed resources by role
+  hashmap<string, Resources> quotaGuarantees;
+
+  GuardRails guardRails;
+
+  // Last known version of each persisted filter entry, by entry name
+  hashmap<string, Variable> filterVariables;
+
+  Option<Variable> manifestVariable;
+
+  // The latest commits, as logged in the manifest for standby masters
+  ChangeLog changeLog;
+
+  // Number of commits made to the persisted filter set
+  uint64_t filtersGeneration;
+
+  // The legacy single-document filter entry, expunged once migrated
+  Option<Variable> legacyVariable;
+
+  // Set once the persisted filters have been loaded after recovery, from the
+  // local snapshot or the store
+  bool restored;
+
+  // Local snapshot of the persisted entries, rewritten after each commit
+  Option<string> snapshotPath;
+
+  // Whether the snapshotter holds the restored entries; from then on, only
+  // the entries written or expunged since the last commit are sent to it
+  bool snapshotSeeded;
+
+  hashset<string> snapshotChanged;
+
+  // The entries applied from the snapshot (or held while standing by), until
+  // reconciled with the store
+  Option<hashmap<string, string>> snapshotEntries;
+
+  // The generation of the local snapshot applied, until reconciled
+  Option<uint64_t> snapshotGeneration;
+
+  // Drain jobs take no step until the store has confirmed them
+  bool drainsResumed;
+
+  // The generation of the entries held while standing by, once applied; a
+  // manifest of the same generation confirms them without reading them again
+  Option<uint64_t> promotedGeneration;
+
+  // While standing by, the store's latest manifest, and the entries (and
+  // parsed filters) of its generation, by entry name
+  Option<uint64_t> standbyGeneration;
+
+  Option<Variable> standbyManifest;
+
+  hashmap<string, Variable> standbyVariables;
+
+  hashmap<string, StoredEntry> standbyFilters;
+
+  Promise<Nothing> restoration;
+
+  // Version of the reported filter set (active and pending filters), and its
+  // serialized form, rebuilt by the first request after each change. Versions
+  // and the epoch qualifying them in ETags are committed with the manifest,
+  // and carried on by the next leader.
+  uint64_t filtersVersion;
+
+  Option<string> filtersDocument;
+
+  string filtersEpoch;
+
+  // The highest version whose ETag this process has handed out
+  mutable Option<uint64_t> reportedFiltersVersion;
+
+  // The most recent changes to the filter set, for watchers to catch up from
+  std::deque<FilterEvent> filterEvents;
+
+  // The changes of the PATCH being applied, which it responds with
+  Option<JSON::Array> recordedEvents;
+
+  // Long-polling watchers by id; answered together once per batch of changes
+  hashmap<uint64_t, FilterWatcher> watchers;
+
+  bool notifyScheduled;
+
+  uint64_t nextWatcherId;
+
+  Metrics filterMetrics;
 };
 
 } // namespace modules
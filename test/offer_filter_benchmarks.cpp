@@ -0,0 +1,658 @@
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <process/dispatch.hpp>
+#include <process/future.hpp>
+#include <process/http.hpp>
+#include <process/owned.hpp>
+#include <process/process.hpp>
+
+#include <stout/duration.hpp>
+#include <stout/foreach.hpp>
+#include <stout/hashset.hpp>
+#include <stout/json.hpp>
+#include <stout/os.hpp>
+#include <stout/stopwatch.hpp>
+#include <stout/stringify.hpp>
+#include <stout/uuid.hpp>
+
+#include "offer_filter_module.hpp"
+
+using std::cout;
+using std::endl;
+using std::set;
+using std::vector;
+
+using mesos::FrameworkInfo;
+
+#ifdef MESOS__0_28_2
+using mesos::internal::state::InMemoryStorage;
+#else
+using mesos::state::InMemoryStorage;
+#endif
+
+using gettyimages::mesos::modules::FilterRequest;
+using gettyimages::mesos::modules::StoredEntry;
+using gettyimages::mesos::modules::StoredFilter;
+using gettyimages::mesos::modules::decodeEntry;
+using gettyimages::mesos::modules::encodeEntry;
+using gettyimages::mesos::modules::OfferFilteringHierarchicalDRFAllocatorProcess;
+
+namespace {
+
+// When set, results are also appended (one JSON object per line) to this file.
+const char* const BENCHMARK_OUTPUT_ENV = "OFFER_FILTER_BENCHMARK_OUTPUT";
+
+// One in this many agents is filtered by the request benchmarks.
+const size_t FILTERED_AGENTS_DIVISOR = 10;
+
+// When the stored filters of the encoding benchmarks expire (2100-01-01).
+const int64_t STORED_FILTER_EXPIRY = 4102444800;
+
+
+// Accepts (and ignores) the allocator's offer and inverse offer callbacks.
+struct IgnoreCallback
+{
+  template <typename... T>
+  void operator()(const T&...) const {}
+};
+
+
+// Forwards to a storage which outlives the allocator processes, so that one
+// allocator process can restore the filters persisted by another.
+class SharedStorage : public Storage
+{
+public:
+  explicit SharedStorage(Storage* _storage) : storage(_storage) {}
+
+  virtual Future<Option<Entry>> get(const string& name)
+  {
+    return storage->get(name);
+  }
+
+  virtual Future<bool> set(const Entry& entry, const UUID& uuid)
+  {
+    return storage->set(entry, uuid);
+  }
+
+  virtual Future<bool> expunge(const Entry& entry)
+  {
+    return storage->expunge(entry);
+  }
+
+  virtual Future<set<string>> names()
+  {
+    return storage->names();
+  }
+
+private:
+  Storage* storage;
+};
+
+
+// Exposes the filter paths of the allocator process so they can be
+// driven and timed against a synthetic cluster.
+class BenchmarkAllocatorProcess : public OfferFilteringHierarchicalDRFAllocatorProcess
+{
+public:
+
+  process::PID<BenchmarkAllocatorProcess> pid() const
+  {
+    return process::PID<BenchmarkAllocatorProcess>(this);
+  }
+
+  // Initializes and recovers the allocator, as an elected master would.
+  Nothing setup(Storage* storage)
+  {
+    configure(new SharedStorage(storage), None());
+
+    initialize(
+        Hours(1),
+        IgnoreCallback(),
+        IgnoreCallback(),
+#ifdef MESOS__0_28_2
+        hashmap<string, mesos::master::RoleInfo>());
+#else
+        hashmap<string, double>());
+#endif
+
+    recover(0, hashmap<string, mesos::Quota>());
+    return Nothing();
+  }
+
+  Nothing addAgents(size_t agentCount)
+  {
+    FrameworkID frameworkId;
+    frameworkId.set_value("framework");
+
+    FrameworkInfo frameworkInfo;
+    frameworkInfo.set_name("benchmark");
+    frameworkInfo.set_user("benchmark");
+    frameworkInfo.set_role("*");
+    frameworkInfo.mutable_id()->CopyFrom(frameworkId);
+
+    addFramework(frameworkId, frameworkInfo, hashmap<SlaveID, Resources>());
+
+    Resources total = Resources::parse(
+        "cpus:8;mem:16384;disk:102400;ports:[31000-32000]").get();
+
+    for (size_t i = 0; i < agentCount; i++) {
+      SlaveID agentId;
+      agentId.set_value("agent-" + stringify(i));
+
+      SlaveInfo agentInfo;
+      agentInfo.set_hostname("host-" + stringify(i));
+      agentInfo.mutable_resources()->CopyFrom(total);
+      agentInfo.mutable_id()->CopyFrom(agentId);
+
+      addSlave(agentId, agentInfo, None(), total, hashmap<FrameworkID, Resources>());
+      agents.insert(agentId);
+    }
+    return Nothing();
+  }
+
+  Nothing filterAll()
+  {
+    applyFilters(agents);
+    return Nothing();
+  }
+
+  // Lifts every filter with a single delta, i.e., one allocation pass.
+  Duration liftBatched()
+  {
+    Stopwatch watch;
+    watch.start();
+    applyFilterDelta(hashset<SlaveID>(), agents);
+    return watch.elapsed();
+  }
+
+  // Lifts every filter one agent at a time, i.e., one allocation pass per agent.
+  Duration liftPerAgent()
+  {
+    Stopwatch watch;
+    watch.start();
+    foreach (const SlaveID& agentId, agents) {
+      hashset<SlaveID> removed;
+      removed.insert(agentId);
+      applyFilterDelta(hashset<SlaveID>(), removed);
+    }
+    return watch.elapsed();
+  }
+
+  // Runs one allocation pass over every agent.
+  Duration allocation()
+  {
+    Stopwatch watch;
+    watch.start();
+    allocate();
+    return watch.elapsed();
+  }
+
+  // Applies a request as parsed by the front end, and returns how long it
+  // held the allocator actor (excluding persistence).
+  Duration applyParsed(const FilterRequest& request)
+  {
+    Stopwatch watch;
+    watch.start();
+    offerFilters(request);
+    return watch.elapsed();
+  }
+
+  Future<Nothing> restoration()
+  {
+    return filtersRestored();
+  }
+
+  // Restores stored entries (named as in the store) as a newly elected
+  // allocator does, before any agent re-registers.
+  Duration restoreEntries(const vector<pair<string, string>>& entries)
+  {
+    Stopwatch watch;
+    watch.start();
+    foreach (const auto& entry, entries) {
+      restoreEntry(entry.first, entry.second);
+    }
+    return watch.elapsed();
+  }
+
+private:
+
+  hashset<SlaveID> agents;
+};
+
+
+// Prints one result as a JSON line, and appends it to the output file if set.
+void report(
+    const string& benchmark,
+    size_t agentCount,
+    size_t filterCount,
+    const Duration& elapsed,
+    const Option<size_t>& bytes = None())
+{
+  JSON::Object result;
+  result.values["benchmark"] = benchmark;
+  result.values["agents"] = JSON::Number(static_cast<double>(agentCount));
+  result.values["filters"] = JSON::Number(static_cast<double>(filterCount));
+  result.values["elapsed_ms"] = JSON::Number(elapsed.ms());
+  if (bytes.isSome()) {
+    result.values["bytes"] = JSON::Number(static_cast<double>(bytes.get()));
+  }
+
+  string line = stringify(result);
+  cout << line << endl;
+
+  Option<string> output = os::getenv(BENCHMARK_OUTPUT_ENV);
+  if (output.isSome()) {
+    std::ofstream file(output.get().c_str(), std::ios::app);
+    file << line << endl;
+  }
+}
+
+
+// Builds a PUT body filtering the hosts of the first `filterCount` agents.
+string filtersBody(size_t filterCount)
+{
+  JSON::Array filters;
+  for (size_t i = 0; i < filterCount; i++) {
+    JSON::Object filter;
+    filter.values["hostname"] = "host-" + stringify(i);
+    filters.values.push_back(filter);
+  }
+
+  JSON::Object body;
+  body.values["filters"] = filters;
+  return stringify(body);
+}
+
+
+// Builds the stored form of `filterCount` filters, half of them scheduled
+// and scoped.
+vector<StoredFilter> storedFilters(size_t filterCount)
+{
+  vector<StoredFilter> filters;
+  for (size_t i = 0; i < filterCount; i++) {
+    StoredFilter filter;
+    filter.set_agent_id("7532e174-d91a-49c4-85e6-389ea9fd73c3-S" + stringify(i));
+    filter.set_hostname("host-" + stringify(i) + ".dc1.example.com");
+    if (i % 2 == 0) {
+      filter.add_roles("batch");
+      filter.set_expires_at(STORED_FILTER_EXPIRY);
+    }
+    filters.push_back(filter);
+  }
+  return filters;
+}
+
+
+// The JSON form in which filters were stored up to format 2.
+JSON::Object legacyFilter(const StoredFilter& filter)
+{
+  JSON::Object json;
+  json.values["agentId"] = filter.agent_id();
+  json.values["hostname"] = filter.hostname();
+  if (filter.roles_size() > 0) {
+    JSON::Array roles;
+    foreach (const string& role, filter.roles()) {
+      roles.values.push_back(role);
+    }
+    json.values["roles"] = roles;
+    json.values["expiresAt"] = "2100-01-01T00:00:00Z";
+  }
+  return json;
+}
+
+
+// Names the entries as in the store.
+vector<pair<string, string>> namedEntries(
+    const vector<StoredFilter>& filters,
+    const vector<string>& values)
+{
+  vector<pair<string, string>> entries;
+  for (size_t i = 0; i < filters.size(); i++) {
+    entries.push_back(std::make_pair("filter-agent-" + filters[i].agent_id(), values[i]));
+  }
+  return entries;
+}
+
+
+size_t totalSize(const vector<string>& values)
+{
+  size_t size = 0;
+  foreach (const string& value, values) {
+    size += value.size();
+  }
+  return size;
+}
+
+} // namespace {
+
+
+class OfferFilterBenchmark : public ::testing::TestWithParam<size_t>
+{
+protected:
+
+  virtual void SetUp()
+  {
+    storage.reset(new InMemoryStorage());
+  }
+
+  // Spawns an allocator process over the shared storage, and waits until
+  // it has restored the persisted filters.
+  process::Owned<BenchmarkAllocatorProcess> start()
+  {
+    process::Owned<BenchmarkAllocatorProcess> process(new BenchmarkAllocatorProcess());
+    process::spawn(process.get());
+
+    process::dispatch(process->pid(), &BenchmarkAllocatorProcess::setup, storage.get()).await();
+    process::dispatch(process->pid(), &BenchmarkAllocatorProcess::restoration).await();
+    return process;
+  }
+
+  void stop(const process::Owned<BenchmarkAllocatorProcess>& process)
+  {
+    process::terminate(process.get());
+    process::wait(process.get());
+  }
+
+  // Sends a request to /allocator/filters and returns how long it took.
+  Duration request(
+      const string& method,
+      const hashmap<string, string>& query,
+      const Option<string>& body)
+  {
+    http::Request request;
+    request.method = method;
+    request.url = http::URL(
+        "http",
+        process::address().ip,
+        process::address().port,
+        "/allocator/filters");
+    request.url.query = query;
+    request.keepAlive = false;
+
+    if (body.isSome()) {
+      request.headers["Content-Type"] = "application/json";
+      request.body = body.get();
+    }
+
+    Stopwatch watch;
+    watch.start();
+    Future<http::Response> response = http::request(request);
+    response.await();
+    Duration elapsed = watch.elapsed();
+
+    EXPECT_TRUE(response.isReady());
+    if (response.isReady()) {
+      EXPECT_EQ(http::Status::OK, response.get().code) << response.get().body;
+    }
+    return elapsed;
+  }
+
+  process::Owned<Storage> storage;
+};
+
+
+// Only the smallest cluster runs by default; the larger ones take minutes, and
+// run with --gtest_also_run_disabled_tests (see the README).
+INSTANTIATE_TEST_CASE_P(
+    AgentCount,
+    OfferFilterBenchmark,
+    ::testing::Values(1000U));
+
+
+INSTANTIATE_TEST_CASE_P(
+    DISABLED_LargeAgentCount,
+    OfferFilterBenchmark,
+    ::testing::Values(10000U, 50000U));
+
+
+// Compares lifting all filters in one batch against lifting them one by one.
+TEST_P(OfferFilterBenchmark, LiftFilters)
+{
+  size_t agentCount = GetParam();
+
+  process::Owned<BenchmarkAllocatorProcess> process = start();
+  process::dispatch(process->pid(), &BenchmarkAllocatorProcess::addAgents, agentCount).await();
+  process::dispatch(process->pid(), &BenchmarkAllocatorProcess::filterAll).await();
+  report("lift_batched", agentCount, agentCount,
+      process::dispatch(process->pid(), &BenchmarkAllocatorProcess::liftBatched).get());
+  stop(process);
+
+  SetUp();
+  process = start();
+  process::dispatch(process->pid(), &BenchmarkAllocatorProcess::addAgents, agentCount).await();
+  process::dispatch(process->pid(), &BenchmarkAllocatorProcess::filterAll).await();
+  report("lift_per_agent", agentCount, agentCount,
+      process::dispatch(process->pid(), &BenchmarkAllocatorProcess::liftPerAgent).get());
+  stop(process);
+}
+
+
+// Measures the latency of each method of /allocator/filters, including
+// persisting the change.
+TEST_P(OfferFilterBenchmark, Requests)
+{
+  size_t agentCount = GetParam();
+  size_t filterCount = agentCount / FILTERED_AGENTS_DIVISOR;
+  string lastHostname = "host-" + stringify(agentCount - 1);
+
+  process::Owned<BenchmarkAllocatorProcess> process = start();
+  process::dispatch(process->pid(), &BenchmarkAllocatorProcess::addAgents, agentCount).await();
+
+  hashmap<string, string> none;
+
+  report("put", agentCount, filterCount,
+      request("PUT", none, filtersBody(filterCount)));
+
+  report("get", agentCount, filterCount,
+      request("GET", none, None()));
+
+  report("post", agentCount, filterCount,
+      request("POST", none, "{\"hostname\": \"" + lastHostname + "\"}"));
+
+  hashmap<string, string> query;
+  query["hostname"] = lastHostname;
+  report("delete", agentCount, filterCount,
+      request("DELETE", query, None()));
+
+  report("put_empty", agentCount, filterCount,
+      request("PUT", none, filtersBody(0)));
+
+  stop(process);
+}
+
+
+// Measures how long a newly elected allocator takes to restore the
+// persisted filters, and to match them as the agents re-register.
+TEST_P(OfferFilterBenchmark, RestoreFilters)
+{
+  size_t agentCount = GetParam();
+  size_t filterCount = agentCount / FILTERED_AGENTS_DIVISOR;
+
+  process::Owned<BenchmarkAllocatorProcess> process = start();
+  process::dispatch(process->pid(), &BenchmarkAllocatorProcess::addAgents, agentCount).await();
+  request("PUT", hashmap<string, string>(), filtersBody(filterCount));
+  stop(process);
+
+  Stopwatch watch;
+  watch.start();
+  process = start();
+  report("restore", agentCount, filterCount, watch.elapsed());
+
+  watch.start();
+  process::dispatch(process->pid(), &BenchmarkAllocatorProcess::addAgents, agentCount).await();
+  report("reregister_agents", agentCount, filterCount, watch.elapsed());
+
+  stop(process);
+}
+
+
+// Compares an allocation pass without filters against one with filters.
+TEST_P(OfferFilterBenchmark, AllocationPass)
+{
+  size_t agentCount = GetParam();
+  size_t filterCount = agentCount / FILTERED_AGENTS_DIVISOR;
+
+  process::Owned<BenchmarkAllocatorProcess> process = start();
+  process::dispatch(process->pid(), &BenchmarkAllocatorProcess::addAgents, agentCount).await();
+
+  report("allocation_unfiltered", agentCount, 0,
+      process::dispatch(process->pid(), &BenchmarkAllocatorProcess::allocation).get());
+
+  request("PUT", hashmap<string, string>(), filtersBody(filterCount));
+
+  report("allocation_filtered", agentCount, filterCount,
+      process::dispatch(process->pid(), &BenchmarkAllocatorProcess::allocation).get());
+
+  stop(process);
+}
+
+
+// Compares the time a PUT takes to parse, which the front end spends off the
+// allocator actor, against the time it then holds the allocator actor; before
+// the front end, the allocator actor spent both.
+TEST_P(OfferFilterBenchmark, ParsePut)
+{
+  size_t agentCount = GetParam();
+  size_t filterCount = agentCount / FILTERED_AGENTS_DIVISOR;
+
+  process::Owned<BenchmarkAllocatorProcess> process = start();
+  process::dispatch(process->pid(), &BenchmarkAllocatorProcess::addAgents, agentCount).await();
+
+  http::Request request;
+  request.method = "PUT";
+  request.headers["Content-Type"] = "application/json";
+  request.body = filtersBody(filterCount);
+
+  Stopwatch watch;
+  watch.start();
+  Try<FilterRequest> parsed = OfferFilteringHierarchicalDRFAllocatorProcess::parseFilterRequest(request);
+  report("put_parse", agentCount, filterCount, watch.elapsed());
+  ASSERT_TRUE(parsed.isSome());
+
+  report("put_apply", agentCount, filterCount,
+      process::dispatch(process->pid(), &BenchmarkAllocatorProcess::applyParsed, parsed.get()).get());
+
+  stop(process);
+}
+
+
+class OfferFilterEncodingBenchmark : public ::testing::TestWithParam<size_t>
+{
+protected:
+
+  // Spawns an allocator process without agents, over its own storage.
+  process::Owned<BenchmarkAllocatorProcess> start()
+  {
+    storage.reset(new InMemoryStorage());
+    process::Owned<BenchmarkAllocatorProcess> process(new BenchmarkAllocatorProcess());
+    process::spawn(process.get());
+
+    process::dispatch(process->pid(), &BenchmarkAllocatorProcess::setup, storage.get()).await();
+    process::dispatch(process->pid(), &BenchmarkAllocatorProcess::restoration).await();
+    return process;
+  }
+
+  void stop(const process::Owned<BenchmarkAllocatorProcess>& process)
+  {
+    process::terminate(process.get());
+    process::wait(process.get());
+  }
+
+  process::Owned<Storage> storage;
+};
+
+
+INSTANTIATE_TEST_CASE_P(
+    FilterCount,
+    OfferFilterEncodingBenchmark,
+    ::testing::Values(100U, 1000U));
+
+
+INSTANTIATE_TEST_CASE_P(
+    DISABLED_LargeFilterCount,
+    OfferFilterEncodingBenchmark,
+    ::testing::Values(10000U));
+
+
+// Compares the JSON form in which filter entries were stored up to format 2
+// against the protobuf form: the time to encode and decode every entry, and
+// the bytes written.
+TEST_P(OfferFilterEncodingBenchmark, StoredEntries)
+{
+  size_t filterCount = GetParam();
+  vector<StoredFilter> filters = storedFilters(filterCount);
+
+  vector<string> json;
+  Stopwatch watch;
+  watch.start();
+  foreach (const StoredFilter& filter, filters) {
+    json.push_back(stringify(legacyFilter(filter)));
+  }
+  report("encode_json", 0, filterCount, watch.elapsed(), totalSize(json));
+
+  vector<string> protobuf;
+  watch.start();
+  foreach (const StoredFilter& filter, filters) {
+    StoredEntry entry;
+    entry.mutable_filter()->CopyFrom(filter);
+    protobuf.push_back(encodeEntry(entry));
+  }
+  report("encode_protobuf", 0, filterCount, watch.elapsed(), totalSize(protobuf));
+
+  size_t decoded = 0;
+  watch.start();
+  foreach (const string& value, json) {
+    decoded += JSON::parse<JSON::Object>(value).isSome() ? 1 : 0;
+  }
+  report("decode_json", 0, filterCount, watch.elapsed());
+  EXPECT_EQ(filterCount, decoded);
+
+  decoded = 0;
+  watch.start();
+  foreach (const string& value, protobuf) {
+    decoded += decodeEntry(value).isSome() ? 1 : 0;
+  }
+  report("decode_protobuf", 0, filterCount, watch.elapsed());
+  EXPECT_EQ(filterCount, decoded);
+
+  // The protobuf form decodes to the filter it encodes
+  Try<StoredEntry> entry = decodeEntry(protobuf[0]);
+  ASSERT_TRUE(entry.isSome());
+  EXPECT_EQ(filters[0].SerializeAsString(), entry.get().filter().SerializeAsString());
+}
+
+
+// Compares restoring filter entries of either form, as an elected master does
+// for every stored entry: decoding them and applying the filters they hold.
+TEST_P(OfferFilterEncodingBenchmark, RestoreEntries)
+{
+  size_t filterCount = GetParam();
+  vector<StoredFilter> filters = storedFilters(filterCount);
+
+  vector<string> json;
+  vector<string> protobuf;
+  foreach (const StoredFilter& filter, filters) {
+    json.push_back(stringify(legacyFilter(filter)));
+    StoredEntry entry;
+    entry.mutable_filter()->CopyFrom(filter);
+    protobuf.push_back(encodeEntry(entry));
+  }
+
+  process::Owned<BenchmarkAllocatorProcess> process = start();
+  report("restore_json", 0, filterCount,
+      process::dispatch(process->pid(), &BenchmarkAllocatorProcess::restoreEntries,
+                        namedEntries(filters, json)).get());
+  stop(process);
+
+  process = start();
+  report("restore_protobuf", 0, filterCount,
+      process::dispatch(process->pid(), &BenchmarkAllocatorProcess::restoreEntries,
+                        namedEntries(filters, protobuf)).get());
+  stop(process);
+}
@@ -1,5 +1,40 @@
 #include <gtest/gtest.h>
 
+#include <set>
+#include <string>
+#include <vector>
+
+#include <process/clock.hpp>
+#include <process/dispatch.hpp>
+#include <process/future.hpp>
+#include <process/http.hpp>
+#include <process/owned.hpp>
+#include <process/process.hpp>
+
+#include <stout/duration.hpp>
+#include <stout/foreach.hpp>
+#include <stout/hashmap.hpp>
+#include <stout/json.hpp>
+#include <stout/lambda.hpp>
+#include <stout/numify.hpp>
+#include <stout/os.hpp>
+#include <stout/path.hpp>
+#include <stout/stopwatch.hpp>
+#include <stout/stringify.hpp>
+
+#include "offer_filter_module.hpp"
+
+using std::set;
+
+#ifdef MESOS__0_28_2
+using mesos::internal::state::InMemoryStorage;
+#else
+using mesos::state::InMemoryStorage;
+#endif
+
+using gettyimages::mesos::modules::GuardRails;
+using gettyimages::mesos::modules::OfferFilteringHierarchicalDRFAllocatorProcess;
+
 TEST(OfferFilter, CanQueryEndpoint)
 {
 
@@ -13,3 +48,779 @@ TEST(OfferFilter, CanQueryEndpoint)
 }
 
 
+namespace {
+
+// How long a test waits for a response.
+const Duration RESPONSE_TIMEOUT = Seconds(15);
+
+const char* const AGENT_RESOURCES = "cpus:4;mem:1024;ports:[31000-32000]";
+
+
+// Accepts (and ignores) the allocator's inverse offer callbacks.
+struct IgnoreCallback
+{
+  template <typename... T>
+  void operator()(const T&...) const {}
+};
+
+
+// Forwards to a storage which outlives the allocator processes, so that one
+// allocator process can restore the filters persisted by another.
+class SharedStorage : public Storage
+{
+public:
+  explicit SharedStorage(Storage* _storage) : storage(_storage) {}
+
+  virtual Future<Option<Entry>> get(const string& name)
+  {
+    return storage->get(name);
+  }
+
+  virtual Future<bool> set(const Entry& entry, const UUID& uuid)
+  {
+    return storage->set(entry, uuid);
+  }
+
+  virtual Future<bool> expunge(const Entry& entry)
+  {
+    return storage->expunge(entry);
+  }
+
+  virtual Future<std::set<string>> names()
+  {
+    return storage->names();
+  }
+
+private:
+  Storage* storage;
+};
+
+
+// Drives the allocator process as an elected master would, over agents and
+// frameworks registered by the tests, and records the offers it makes.
+class TestAllocatorProcess : public OfferFilteringHierarchicalDRFAllocatorProcess
+{
+public:
+
+  process::PID<TestAllocatorProcess> pid() const
+  {
+    return process::PID<TestAllocatorProcess>(this);
+  }
+
+  // Initializes and recovers the allocator.
+  Nothing setup(Storage* storage, const GuardRails& guardRails, const Option<string>& snapshotPath)
+  {
+    configure(new SharedStorage(storage), None(), guardRails, snapshotPath);
+
+    initialize(
+        Hours(1),
+        lambda::bind(&TestAllocatorProcess::offer, this, lambda::_1, lambda::_2),
+        IgnoreCallback(),
+#ifdef MESOS__0_28_2
+        hashmap<string, mesos::master::RoleInfo>());
+#else
+        hashmap<string, double>());
+#endif
+
+    recover(0, hashmap<string, mesos::Quota>());
+    return Nothing();
+  }
+
+  Nothing registerAgent(const string& agentId, const string& hostname, const string& resources)
+  {
+    SlaveID slaveId;
+    slaveId.set_value(agentId);
+
+    Resources total = Resources::parse(resources).get();
+
+    SlaveInfo agentInfo;
+    agentInfo.set_hostname(hostname);
+    agentInfo.mutable_resources()->CopyFrom(total);
+    agentInfo.mutable_id()->CopyFrom(slaveId);
+
+    addSlave(slaveId, agentInfo, None(), total, hashmap<FrameworkID, Resources>());
+    return Nothing();
+  }
+
+  Nothing registerFramework(const string& frameworkId, const string& role)
+  {
+    FrameworkID id;
+    id.set_value(frameworkId);
+
+    FrameworkInfo frameworkInfo;
+    frameworkInfo.set_name(frameworkId);
+    frameworkInfo.set_user("test");
+    frameworkInfo.set_role(role);
+    frameworkInfo.mutable_id()->CopyFrom(id);
+
+    addFramework(id, frameworkInfo, hashmap<SlaveID, Resources>());
+    return Nothing();
+  }
+
+  Future<Nothing> restoration()
+  {
+    return filtersRestored();
+  }
+
+  // The resources of the agent offered to the framework so far.
+  Resources offered(const string& frameworkId, const string& agentId)
+  {
+    if (!offers.contains(frameworkId)) {
+      return Resources();
+    }
+    return offers.at(frameworkId).get(agentId).getOrElse(Resources());
+  }
+
+private:
+
+  void offer(const FrameworkID& frameworkId, const hashmap<SlaveID, Resources>& resources)
+  {
+    foreachpair (const SlaveID& slaveId, const Resources& offered, resources) {
+      offers[frameworkId.value()][slaveId.value()] += offered;
+    }
+  }
+
+  hashmap<string, hashmap<string, Resources>> offers;
+};
+
+
+// A filter (or selector) body given by a single field.
+JSON::Object filter(const string& field, const string& value)
+{
+  JSON::Object body;
+  body.values[field] = value;
+  return body;
+}
+
+
+// The hostnames named by the objects of an array in a response body.
+set<string> hostnames(const http::Response& response, const string& field)
+{
+  set<string> names;
+  Try<JSON::Object> body = JSON::parse<JSON::Object>(response.body);
+  if (body.isError()) {
+    ADD_FAILURE() << "Invalid response body '" << response.body << "': " << body.error();
+    return names;
+  }
+
+  Result<JSON::Array> objects = body.get().find<JSON::Array>(field);
+  if (objects.isSome()) {
+    foreach (const JSON::Value& object, objects.get().values) {
+      if (object.is<JSON::Object>()) {
+        Result<JSON::String> hostname = object.as<JSON::Object>().find<JSON::String>("hostname");
+        if (hostname.isSome()) {
+          names.insert(hostname.get().value);
+        }
+      }
+    }
+  }
+  return names;
+}
+
+
+// The filters of a PUT body, one per hostname.
+JSON::Object filters(const std::vector<string>& hostnames)
+{
+  JSON::Array filters;
+  foreach (const string& hostname, hostnames) {
+    filters.values.push_back(filter("hostname", hostname));
+  }
+
+  JSON::Object body;
+  body.values["filters"] = filters;
+  return body;
+}
+
+
+// A number of a response body, at the given path.
+Option<double> number(const http::Response& response, const string& path)
+{
+  Try<JSON::Object> body = JSON::parse<JSON::Object>(response.body);
+  if (body.isError()) {
+    ADD_FAILURE() << "Invalid response body '" << response.body << "': " << body.error();
+    return None();
+  }
+
+  Result<JSON::Value> value = body.get().find<JSON::Value>(path);
+  if (!value.isSome()) {
+    return None();
+  }
+  Try<double> number = numify<double>(stringify(value.get()));
+  return number.isSome() ? Option<double>(number.get()) : None();
+}
+
+
+JSON::Array array(const string& value)
+{
+  JSON::Array values;
+  values.values.push_back(value);
+  return values;
+}
+
+} // namespace {
+
+
+class OfferFilterTest : public ::testing::Test
+{
+protected:
+
+  virtual void SetUp()
+  {
+    storage.reset(new InMemoryStorage());
+  }
+
+  virtual void TearDown()
+  {
+    if (process::Clock::paused()) {
+      process::Clock::resume();
+    }
+    if (allocator.get() != nullptr) {
+      stop();
+    }
+    if (directory.isSome()) {
+      os::rmdir(directory.get());
+    }
+  }
+
+  // Spawns an allocator process over the storage, and waits until it has
+  // restored the persisted filters.
+  void start(
+      const GuardRails& guardRails = GuardRails(),
+      const Option<string>& snapshotPath = None())
+  {
+    allocator.reset(new TestAllocatorProcess());
+    process::spawn(allocator.get());
+
+    process::dispatch(
+        allocator->pid(), &TestAllocatorProcess::setup, storage.get(), guardRails, snapshotPath).await();
+    process::dispatch(allocator->pid(), &TestAllocatorProcess::restoration).await();
+  }
+
+  void stop()
+  {
+    process::terminate(allocator.get());
+    process::wait(allocator.get());
+    allocator.reset();
+  }
+
+  void registerAgent(
+      const string& agentId,
+      const string& hostname,
+      const string& resources = AGENT_RESOURCES)
+  {
+    process::dispatch(
+        allocator->pid(), &TestAllocatorProcess::registerAgent, agentId, hostname, resources).await();
+  }
+
+  void registerFramework(const string& frameworkId, const string& role = "*")
+  {
+    process::dispatch(
+        allocator->pid(), &TestAllocatorProcess::registerFramework, frameworkId, role).await();
+  }
+
+  Resources offered(const string& frameworkId, const string& agentId)
+  {
+    return process::dispatch(
+        allocator->pid(), &TestAllocatorProcess::offered, frameworkId, agentId).get();
+  }
+
+  // Sends a request to /allocator/filters, and waits for its response.
+  http::Response request(
+      const string& method,
+      const Option<JSON::Object>& body = None(),
+      const hashmap<string, string>& query = hashmap<string, string>(),
+      const http::Headers& headers = http::Headers())
+  {
+    http::Request request;
+    request.method = method;
+    request.url = http::URL(
+        "http",
+        process::address().ip,
+        process::address().port,
+        "/allocator/filters");
+    request.url.query = query;
+    request.headers = headers;
+    request.keepAlive = false;
+
+    if (body.isSome()) {
+      request.headers["Content-Type"] = "application/json";
+      request.body = stringify(body.get());
+    }
+
+    Future<http::Response> response = http::request(request);
+    response.await(RESPONSE_TIMEOUT);
+
+    EXPECT_TRUE(response.isReady()) << method << " /allocator/filters did not respond";
+    return response.isReady() ? response.get() : http::InternalServerError("No response");
+  }
+
+  // The hostnames of the agents withheld from every framework.
+  set<string> withheldHostnames()
+  {
+    hashmap<string, string> query;
+    query["usage"] = "true";
+    return hostnames(request("GET", None(), query), "agents");
+  }
+
+  // The path of a local snapshot, in a directory removed after the test.
+  string snapshotPath()
+  {
+    if (directory.isNone()) {
+      Try<string> created = os::mkdtemp();
+      EXPECT_TRUE(created.isSome()) << created.error();
+      directory = created.get();
+    }
+    return path::join(directory.get(), "offer_filters.snapshot");
+  }
+
+  // Waits until the filters name exactly the given hostnames.
+  bool awaitFilters(const set<string>& expected)
+  {
+    Stopwatch watch;
+    watch.start();
+    do {
+      if (hostnames(request("GET"), "filters") == expected) {
+        return true;
+      }
+      os::sleep(Milliseconds(10));
+    } while (watch.elapsed() < RESPONSE_TIMEOUT);
+    return false;
+  }
+
+  // Waits until the snapshot holds the entry of the given name.
+  bool awaitSnapshot(const string& path, const string& name)
+  {
+    Stopwatch watch;
+    watch.start();
+    do {
+      Try<string> contents = os::read(path);
+      if (contents.isSome() && contents.get().find(name) != string::npos) {
+        return true;
+      }
+      os::sleep(Milliseconds(10));
+    } while (watch.elapsed() < RESPONSE_TIMEOUT);
+    return false;
+  }
+
+  process::Owned<Storage> storage;
+  process::Owned<TestAllocatorProcess> allocator;
+  Option<string> directory;
+};
+
+
+// A hostnameRegex selector matches whole hostnames, including those of the
+// agents registering later.
+TEST_F(OfferFilterTest, HostnameRegexSelector)
+{
+  start();
+  registerAgent("agent-1", "web-1.dc1.example.com");
+  registerAgent("agent-2", "web-22.dc1.example.com");
+  registerAgent("agent-3", "web-x.dc1.example.com");
+  registerAgent("agent-4", "old-web-1.dc1.example.com");
+  registerAgent("agent-5", "web-1.dc1.example.com.test");
+
+  http::Response response = request("POST", filter("hostnameRegex", "web-\\d+\\.dc1\\.example\\.com"));
+  ASSERT_EQ(http::Status::OK, response.code) << response.body;
+
+  set<string> expected;
+  expected.insert("web-1.dc1.example.com");
+  expected.insert("web-22.dc1.example.com");
+  EXPECT_EQ(expected, withheldHostnames());
+
+  registerAgent("agent-6", "web-3.dc1.example.com");
+  expected.insert("web-3.dc1.example.com");
+  EXPECT_EQ(expected, withheldHostnames());
+}
+
+
+TEST_F(OfferFilterTest, InvalidHostnameRegex)
+{
+  start();
+  registerAgent("agent-1", "web-1.dc1.example.com");
+
+  http::Response response = request("POST", filter("hostnameRegex", "web-(\\d+"));
+  EXPECT_EQ(http::Status::BAD_REQUEST, response.code) << response.body;
+  EXPECT_TRUE(withheldHostnames().empty());
+}
+
+
+// Agents matched by several selectors stay filtered until the last one is removed.
+TEST_F(OfferFilterTest, PatternAndDomainSelectors)
+{
+  start();
+  registerAgent("agent-1", "web-1.dc1.example.com");
+  registerAgent("agent-2", "web-1.dc2.example.com");
+  registerAgent("agent-3", "db-1.dc2.example.com");
+  registerAgent("agent-4", "db-1.dc1.example.com");
+
+  ASSERT_EQ(http::Status::OK, request("POST", filter("hostnamePattern", "web-*.example.com")).code);
+  ASSERT_EQ(http::Status::OK, request("POST", filter("domain", "dc2.example.com")).code);
+
+  set<string> expected;
+  expected.insert("web-1.dc1.example.com");
+  expected.insert("web-1.dc2.example.com");
+  expected.insert("db-1.dc2.example.com");
+  EXPECT_EQ(expected, withheldHostnames());
+
+  hashmap<string, string> query;
+  query["hostnamePattern"] = "web-*.example.com";
+  ASSERT_EQ(http::Status::OK, request("DELETE", None(), query).code);
+
+  expected.erase("web-1.dc1.example.com");
+  EXPECT_EQ(expected, withheldHostnames());
+}
+
+
+// A filter with a ttl is lifted once it expires, while an unbounded one stays.
+TEST_F(OfferFilterTest, FilterExpires)
+{
+  start();
+  registerAgent("agent-1", "host-1");
+  registerAgent("agent-2", "host-2");
+
+  JSON::Object bounded = filter("hostname", "host-1");
+  bounded.values["ttl"] = "1hrs";
+  ASSERT_EQ(http::Status::OK, request("POST", bounded).code);
+  ASSERT_EQ(http::Status::OK, request("POST", filter("hostname", "host-2")).code);
+
+  process::Clock::pause();
+  process::Clock::advance(Minutes(59));
+  process::Clock::settle();
+
+  set<string> expected;
+  expected.insert("host-1");
+  expected.insert("host-2");
+  EXPECT_EQ(expected, withheldHostnames());
+
+  process::Clock::advance(Minutes(2));
+  process::Clock::settle();
+
+  expected.erase("host-1");
+  EXPECT_EQ(expected, withheldHostnames());
+}
+
+
+// The expiry of a filter is persisted, so it holds with the next leader.
+TEST_F(OfferFilterTest, FilterExpiresAfterFailover)
+{
+  start();
+  registerAgent("agent-1", "host-1");
+
+  JSON::Object bounded = filter("hostname", "host-1");
+  bounded.values["ttl"] = "1hrs";
+  ASSERT_EQ(http::Status::OK, request("POST", bounded).code);
+  stop();
+
+  start();
+  registerAgent("agent-1", "host-1");
+
+  set<string> expected;
+  expected.insert("host-1");
+  EXPECT_EQ(expected, withheldHostnames());
+
+  process::Clock::pause();
+  process::Clock::advance(Minutes(61));
+  process::Clock::settle();
+
+  EXPECT_TRUE(withheldHostnames().empty());
+}
+
+
+// The frameworks of the roles a filter is scoped to are skipped for its agent,
+// which the other frameworks are offered; once lifted, they are offered it too.
+TEST_F(OfferFilterTest, RoleScopedFilter)
+{
+  start();
+  registerAgent("agent-1", "host-1");
+
+  JSON::Object scoped = filter("hostname", "host-1");
+  scoped.values["roles"] = array("batch");
+  ASSERT_EQ(http::Status::OK, request("POST", scoped).code);
+  EXPECT_TRUE(withheldHostnames().empty());
+
+  registerFramework("framework-batch", "batch");
+  EXPECT_TRUE(offered("framework-batch", "agent-1").empty());
+
+  hashmap<string, string> query;
+  query["hostname"] = "host-1";
+  ASSERT_EQ(http::Status::OK, request("DELETE", None(), query).code);
+  EXPECT_EQ(Resources::parse(AGENT_RESOURCES).get(), offered("framework-batch", "agent-1"));
+}
+
+
+TEST_F(OfferFilterTest, FrameworkScopedFilter)
+{
+  start();
+  registerAgent("agent-1", "host-1");
+
+  JSON::Object scoped = filter("hostname", "host-1");
+  scoped.values["frameworks"] = array("framework-1");
+  ASSERT_EQ(http::Status::OK, request("POST", scoped).code);
+
+  registerFramework("framework-1");
+  registerFramework("framework-2");
+  EXPECT_TRUE(offered("framework-1", "agent-1").empty());
+  EXPECT_EQ(Resources::parse(AGENT_RESOURCES).get(), offered("framework-2", "agent-1"));
+}
+
+
+// A resource filter withholds only the resources it names; the rest of the
+// agent keeps being offered.
+TEST_F(OfferFilterTest, ResourceFilter)
+{
+  start();
+  registerAgent("agent-1", "host-1");
+
+  JSON::Object partial = filter("agentId", "agent-1");
+  partial.values["resources"] = "cpus:1;ports:[31000-31099]";
+  ASSERT_EQ(http::Status::OK, request("POST", partial).code);
+  EXPECT_TRUE(withheldHostnames().empty());
+
+  registerFramework("framework-1");
+  EXPECT_EQ(Resources::parse("cpus:3;mem:1024;ports:[31100-32000]").get(),
+            offered("framework-1", "agent-1"));
+}
+
+
+TEST_F(OfferFilterTest, ResourceFilterByName)
+{
+  start();
+  registerAgent("agent-1", "host-1");
+
+  JSON::Object partial = filter("hostname", "host-1");
+  partial.values["resourceNames"] = array("ports");
+  ASSERT_EQ(http::Status::OK, request("POST", partial).code);
+
+  registerFramework("framework-1");
+  EXPECT_EQ(Resources::parse("cpus:4;mem:1024").get(), offered("framework-1", "agent-1"));
+}
+
+
+// Resources are matched by role as well as by name.
+TEST_F(OfferFilterTest, ResourceFilterOfReservedResources)
+{
+  start();
+  registerAgent("agent-1", "host-1", "cpus(batch):2;cpus:2;mem:1024");
+
+  JSON::Object partial = filter("agentId", "agent-1");
+  partial.values["resources"] = "cpus(batch):1";
+  ASSERT_EQ(http::Status::OK, request("POST", partial).code);
+
+  registerFramework("framework-1", "batch");
+  EXPECT_EQ(Resources::parse("cpus(batch):1;cpus:2;mem:1024").get(), offered("framework-1", "agent-1"));
+}
+
+
+// A resource filter for more than the agent has is rejected, and withholds nothing.
+TEST_F(OfferFilterTest, ResourceFilterExceedingAgent)
+{
+  start();
+  registerAgent("agent-1", "host-1");
+
+  JSON::Object partial = filter("agentId", "agent-1");
+  partial.values["resources"] = "cpus:8";
+  EXPECT_EQ(http::Status::BAD_REQUEST, request("POST", partial).code);
+
+  registerFramework("framework-1");
+  EXPECT_EQ(Resources::parse(AGENT_RESOURCES).get(), offered("framework-1", "agent-1"));
+}
+
+
+// A request which would filter more of the cluster than the guard rail allows
+// is rejected as a whole.
+TEST_F(OfferFilterTest, GuardRail)
+{
+  GuardRails guardRails;
+  guardRails.maxFilteredFraction = 0.3;
+  start(guardRails);
+  registerAgent("agent-1", "host-1");
+  registerAgent("agent-2", "host-2");
+  registerAgent("agent-3", "host-3");
+  registerAgent("agent-4", "host-4");
+
+  ASSERT_EQ(http::Status::OK, request("POST", filter("hostname", "host-1")).code);
+  EXPECT_EQ(http::Status::CONFLICT, request("POST", filter("hostname", "host-2")).code);
+
+  std::vector<string> hosts;
+  hosts.push_back("host-3");
+  hosts.push_back("host-4");
+  EXPECT_EQ(http::Status::CONFLICT, request("PUT", filters(hosts)).code);
+
+  set<string> expected;
+  expected.insert("host-1");
+  EXPECT_EQ(expected, withheldHostnames());
+}
+
+
+// A dry run reports the impact of a request, whether or not it would exceed
+// a guard rail, and applies nothing.
+TEST_F(OfferFilterTest, DryRun)
+{
+  GuardRails guardRails;
+  guardRails.maxFilteredFraction = 0.3;
+  start(guardRails);
+  registerAgent("agent-1", "host-1");
+  registerAgent("agent-2", "host-2");
+  registerAgent("agent-3", "host-3");
+  registerAgent("agent-4", "host-4");
+
+  hashmap<string, string> dryRun;
+  dryRun["dryRun"] = "true";
+
+  http::Response response = request("POST", filter("hostname", "host-1"), dryRun);
+  ASSERT_EQ(http::Status::OK, response.code) << response.body;
+  EXPECT_EQ(Option<double>(1), number(response, "agents.filtered"));
+  EXPECT_EQ(Option<double>(4), number(response, "change.*.cpus"));
+  EXPECT_EQ(Option<double>(16), number(response, "total.*.cpus"));
+  EXPECT_EQ(string::npos, response.body.find("rejected"));
+
+  std::vector<string> hosts;
+  hosts.push_back("host-1");
+  hosts.push_back("host-2");
+  response = request("PUT", filters(hosts), dryRun);
+  ASSERT_EQ(http::Status::OK, response.code) << response.body;
+  EXPECT_EQ(Option<double>(2), number(response, "agents.filtered"));
+  EXPECT_NE(string::npos, response.body.find("rejected"));
+
+  EXPECT_TRUE(withheldHostnames().empty());
+}
+
+
+// A local snapshot is applied at once, and reconciled with the store, which
+// another leader changed since: the filters it no longer holds are lifted,
+// and those it added applied.
+TEST_F(OfferFilterTest, SnapshotReconciledWithStore)
+{
+  string snapshot = snapshotPath();
+
+  start(GuardRails(), snapshot);
+  registerAgent("agent-1", "host-1");
+  registerAgent("agent-2", "host-2");
+  registerAgent("agent-3", "host-3");
+
+  std::vector<string> hosts;
+  hosts.push_back("host-1");
+  hosts.push_back("host-2");
+  ASSERT_EQ(http::Status::OK, request("PUT", filters(hosts)).code);
+  ASSERT_TRUE(awaitSnapshot(snapshot, "filter-agent-agent-2"));
+  stop();
+
+  start();
+  registerAgent("agent-1", "host-1");
+  registerAgent("agent-2", "host-2");
+  registerAgent("agent-3", "host-3");
+
+  hashmap<string, string> query;
+  query["hostname"] = "host-2";
+  ASSERT_EQ(http::Status::OK, request("DELETE", None(), query).code);
+  ASSERT_EQ(http::Status::OK, request("POST", filter("hostname", "host-3")).code);
+  stop();
+
+  start(GuardRails(), snapshot);
+
+  set<string> expected;
+  expected.insert("host-1");
+  expected.insert("host-3");
+  EXPECT_TRUE(awaitFilters(expected));
+}
+
+
+// A mutation sent with an outdated ETag in If-Match applies nothing.
+TEST_F(OfferFilterTest, IfMatch)
+{
+  start();
+  registerAgent("agent-1", "host-1");
+  registerAgent("agent-2", "host-2");
+
+  http::Response response = request("GET");
+  ASSERT_TRUE(response.headers.contains("ETag"));
+
+  http::Headers ifMatch;
+  ifMatch["If-Match"] = response.headers.at("ETag");
+
+  response = request("POST", filter("hostname", "host-1"), hashmap<string, string>(), ifMatch);
+  ASSERT_EQ(http::Status::OK, response.code) << response.body;
+  ASSERT_TRUE(response.headers.contains("ETag"));
+  string etag = response.headers.at("ETag");
+
+  response = request("POST", filter("hostname", "host-2"), hashmap<string, string>(), ifMatch);
+  EXPECT_EQ(http::Status::PRECONDITION_FAILED, response.code) << response.body;
+  EXPECT_EQ(Option<string>(etag), response.headers.get("ETag"));
+
+  set<string> expected;
+  expected.insert("host-1");
+  EXPECT_EQ(expected, withheldHostnames());
+}
+
+
+// The ETag of the filters committed by a leader stays valid with the next one.
+TEST_F(OfferFilterTest, ETagSurvivesFailover)
+{
+  start();
+  registerAgent("agent-1", "host-1");
+
+  http::Response response = request("POST", filter("hostname", "host-1"));
+  ASSERT_EQ(http::Status::OK, response.code) << response.body;
+  ASSERT_TRUE(response.headers.contains("ETag"));
+  string etag = response.headers.at("ETag");
+  stop();
+
+  start();
+  EXPECT_EQ(Option<string>(etag), request("GET").headers.get("ETag"));
+}
+
+
+// A PATCH applies all of its changes, or none when a removal matches no filter;
+// it responds with its own changes only.
+TEST_F(OfferFilterTest, PatchIsAtomic)
+{
+  start();
+  registerAgent("agent-1", "host-1");
+  registerAgent("agent-2", "host-2");
+  registerAgent("agent-3", "host-3");
+  ASSERT_EQ(http::Status::OK, request("POST", filter("hostname", "host-1")).code);
+
+  JSON::Array add;
+  add.values.push_back(filter("hostname", "host-2"));
+  JSON::Array remove;
+  remove.values.push_back(filter("hostname", "host-3"));
+
+  JSON::Object patch;
+  patch.values["add"] = add;
+  patch.values["remove"] = remove;
+  EXPECT_EQ(http::Status::NOT_FOUND, request("PATCH", patch).code);
+
+  set<string> expected;
+  expected.insert("host-1");
+  EXPECT_EQ(expected, withheldHostnames());
+
+  remove.values.clear();
+  remove.values.push_back(filter("hostname", "host-1"));
+  patch.values["remove"] = remove;
+  http::Response response = request("PATCH", patch);
+  ASSERT_EQ(http::Status::OK, response.code) << response.body;
+
+  Try<JSON::Object> body = JSON::parse<JSON::Object>(response.body);
+  ASSERT_TRUE(body.isSome()) << response.body;
+  EXPECT_TRUE(body.get().values.count("filters") == 0) << response.body;
+
+  set<string> changes;
+  Result<JSON::Array> events = body.get().find<JSON::Array>("events");
+  ASSERT_TRUE(events.isSome()) << response.body;
+  foreach (const JSON::Value& event, events.get().values) {
+    ASSERT_TRUE(event.is<JSON::Object>());
+    Result<JSON::String> type = event.as<JSON::Object>().find<JSON::String>("type");
+    Result<JSON::String> hostname = event.as<JSON::Object>().find<JSON::String>("filter.hostname");
+    ASSERT_TRUE(type.isSome() && hostname.isSome()) << stringify(event);
+    changes.insert(type.get().value + " " + hostname.get().value);
+  }
+
+  set<string> expectedChanges;
+  expectedChanges.insert("REMOVED host-1");
+  expectedChanges.insert("ADDED host-2");
+  EXPECT_EQ(expectedChanges, changes);
+
+  expected.clear();
+  expected.insert("host-2");
+  EXPECT_EQ(expected, withheldHostnames());
+}